@@ -0,0 +1,205 @@
+/*
+ * concurrent_interval_tree.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef CONCURRENT_INTERVAL_TREE_HH_
+#define CONCURRENT_INTERVAL_TREE_HH_
+
+#include "interval_tree.hh"
+#include "rw_lock.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// interval_tree for many concurrent readers and a few writers:
+//
+// - the keys are split into ranges of low (shards), each with its
+//   own interval_tree and reader-writer lock, so writers to different
+//   shards don't block each other and readers don't block anybody
+//   but a writer to the shard they are reading
+// - an interval lives in the shard of its low, but may reach into
+//   the following shards, so each shard publishes the highest high
+//   it holds and a query looks into a shard below its low only if
+//   the shard reaches that far
+//
+// every shard is read consistently, but a query spanning several
+// shards is not a snapshot of the whole tree: an interval inserted
+// or erased while the query runs may or may not be seen
+template<typename I, typename V, typename P = node_pool< interval_node_t<I, V> > >
+class concurrent_interval_tree
+{
+    static_assert( std::is_same<typename P::node_type::compare, std::less<I> >::value, "the shards are ordered with operator<" );
+
+  public:
+
+    typedef typename interval_tree<I, V, P>::iterator iterator;
+
+    // shard i holds the intervals with low in [ bounds[i - 1], bounds[i] ),
+    // the bounds have to be sorted without duplicates (otherwise
+    // std::invalid_argument is thrown)
+    explicit concurrent_interval_tree( const std::vector<I> &bounds ) : bounds( bounds )
+    {
+      for( size_t i = 1; i < bounds.size(); ++i )
+        if( !( bounds[i - 1] < bounds[i] ) )
+          throw std::invalid_argument( "concurrent_interval_tree: the shard bounds are not sorted" );
+      init();
+    }
+
+    // the given number of shards of equal width between min and max
+    concurrent_interval_tree( I min, I max, size_t shards )
+    {
+      if( !shards ) shards = 1;
+      if( min < max ) split( min, max, shards, std::is_integral<I>() );
+      init();
+    }
+
+    concurrent_interval_tree( const concurrent_interval_tree& ) = delete;
+
+    concurrent_interval_tree& operator=( const concurrent_interval_tree& ) = delete;
+
+    void insert( I low, I high, const V &value )
+    {
+      shard_t &shard = *shards[shard_of( low )];
+      std::lock_guard<rw_lock> lock( shard.lock );
+      shard.tree.insert( low, high, value );
+      publish( shard );
+    }
+
+    void erase( I low, I high )
+    {
+      shard_t &shard = *shards[shard_of( low )];
+      std::lock_guard<rw_lock> lock( shard.lock );
+      shard.tree.erase( low, high );
+      publish( shard );
+    }
+
+    // calls visitor( iterator ) for every interval overlapping
+    // with ( low, high ) in ascending order of low, the visitor
+    // runs under the read lock of the shard, so it must not write
+    // to the tree nor keep the iterator, and returns false to stop
+    // the query early
+    //
+    // returns false if the query has been stopped by the visitor
+    template<typename F>
+    bool query( I low, I high, F visitor )
+    {
+      size_t last = std::lower_bound( bounds.begin(), bounds.end(), high ) - bounds.begin();
+      for( size_t i = 0; i <= last; ++i )
+      {
+        shard_t &shard = *shards[i];
+        if( !reaches( shard, low ) ) continue;
+        read_guard lock( shard.lock );
+        if( !shard.tree.query( low, high, std::ref( visitor ) ) )
+          return false;
+      }
+      return true;
+    }
+
+    bool has_overlap( I low, I high )
+    {
+      return !query( low, high, []( const iterator& ) { return false; } );
+    }
+
+    size_t count_overlaps( I low, I high )
+    {
+      size_t count = 0;
+      size_t last = std::lower_bound( bounds.begin(), bounds.end(), high ) - bounds.begin();
+      for( size_t i = 0; i <= last; ++i )
+      {
+        shard_t &shard = *shards[i];
+        if( !reaches( shard, low ) ) continue;
+        read_guard lock( shard.lock );
+        count += shard.tree.count_overlaps( low, high );
+      }
+      return count;
+    }
+
+    size_t size() const
+    {
+      size_t count = 0;
+      for( size_t i = 0; i < shards.size(); ++i )
+        count += shards[i]->size.load( std::memory_order_relaxed );
+      return count;
+    }
+
+    bool empty() const
+    {
+      return size() == 0;
+    }
+
+    size_t shard_count() const
+    {
+      return shards.size();
+    }
+
+  private:
+
+    struct shard_t
+    {
+        shard_t() : max( I() ), size( 0 ) { }
+
+        rw_lock                  lock;
+        interval_tree<I, V, P>   tree;
+        // the highest high and the number of intervals, written under
+        // the lock and read without it (to skip the shard)
+        std::atomic<I>           max;
+        std::atomic<size_t>      size;
+    };
+
+    // integral keys: the span is taken unsigned, so that it doesn't
+    // overflow for a signed I (e.g. INT_MIN to INT_MAX), every bound
+    // is within [ min, max ] and so fits back into I
+    void split( I min, I max, size_t shards, std::true_type )
+    {
+      typedef typename std::make_unsigned<I>::type U;
+      U width = U( U( max ) - U( min ) ) / U( shards );
+      for( size_t i = 1; i < shards && width > U( 0 ); ++i )
+        bounds.push_back( I( U( U( min ) + width * U( i ) ) ) );
+    }
+
+    void split( I min, I max, size_t shards, std::false_type )
+    {
+      I width = ( max - min ) / I( shards );
+      for( size_t i = 1; i < shards && width > I( 0 ); ++i )
+        bounds.push_back( min + width * I( i ) );
+    }
+
+    void init()
+    {
+      for( size_t i = 0; i <= bounds.size(); ++i )
+        shards.emplace_back( new shard_t() );
+    }
+
+    size_t shard_of( I low ) const
+    {
+      return std::upper_bound( bounds.begin(), bounds.end(), low ) - bounds.begin();
+    }
+
+    // called under the write lock of the shard
+    static void publish( shard_t &shard )
+    {
+      if( !shard.tree.empty() )
+        shard.max.store( shard.tree.max_high(), std::memory_order_relaxed );
+      shard.size.store( shard.tree.size(), std::memory_order_relaxed );
+    }
+
+    // true if the shard might have an interval ending after low
+    static bool reaches( const shard_t &shard, I low )
+    {
+      return shard.size.load( std::memory_order_relaxed ) && low < shard.max.load( std::memory_order_relaxed );
+    }
+
+    std::vector<I>                         bounds;
+    std::vector< std::unique_ptr<shard_t> > shards;
+};
+
+#endif /* CONCURRENT_INTERVAL_TREE_HH_ */
@@ -0,0 +1,504 @@
+/*
+ * frozen_interval_tree.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef FROZEN_INTERVAL_TREE_HH_
+#define FROZEN_INTERVAL_TREE_HH_
+
+#include "interval_tree.hh"
+#include "overlap_kernel.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// what the visitor of a frozen (or mapped) tree gets to see
+template<typename I, typename V>
+struct frozen_entry
+{
+    frozen_entry( I low, I high, const V &value ) : low( low ), high( high ), value( value ) { }
+
+    I low;
+    I high;
+    V value;
+};
+
+// the file a frozen_interval_tree is saved to (and mapped_interval_tree
+// maps) holds its arrays one after the other, each on a 64-byte
+// boundary so that it can be used in place:
+//
+//   header | entries | lows | highs | level 0 min | level 0 max | level 1 min | ...
+//
+// the arrays are in the byte order and with the type sizes of the
+// machine that wrote them, the header records both (and the fanout)
+// and the reader refuses a file that doesn't match
+struct frozen_file_header
+{
+    static const uint32_t current_version = 1;
+    static const uint32_t byte_order_mark = 0x01020304;
+
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  byte_order;
+    // sizeof and kind ( 0 unsigned, 1 signed, 2 floating point )
+    // of the ends
+    uint32_t  key_size;
+    uint32_t  key_kind;
+    uint32_t  value_size;
+    uint32_t  entry_size;
+    uint32_t  fanout;
+    uint32_t  reserved;
+    // the number of intervals and of levels above the leaves
+    uint64_t  size;
+    uint64_t  levels;
+
+    static const char* file_magic()
+    {
+      return "FROZENIT";
+    }
+
+    template<typename I>
+    static uint32_t kind_of()
+    {
+      return std::is_floating_point<I>::value ? 2 : std::numeric_limits<I>::is_signed ? 1 : 0;
+    }
+
+    // where the next array starts
+    static uint64_t align( uint64_t offset )
+    {
+      return ( offset + 63 ) & ~uint64_t( 63 );
+    }
+
+    // the number of entries of every level above size intervals
+    static std::vector<uint64_t> level_sizes( uint64_t size, uint64_t fanout )
+    {
+      std::vector<uint64_t> sizes;
+      for( uint64_t n = size; n && ( sizes.empty() || n > 1 ); )
+      {
+        n = ( n + fanout - 1 ) / fanout;
+        sizes.push_back( n );
+      }
+      return sizes;
+    }
+};
+
+// the queries of a frozen tree over its arrays, wherever they live
+// (vectors for frozen_interval_tree, the pages of a file for
+// mapped_interval_tree), D provides size(), leaf_entries(),
+// leaf_lows() and leaf_highs(), level_count(), and level_min( k ),
+// level_max( k ) and level_size( k ) for level k above the leaves
+template<typename D, typename I, typename E, size_t B>
+class frozen_query
+{
+  public:
+
+    // calls visitor( entry ) for every interval overlapping
+    // with ( low, high ) in ascending order of low, the visitor
+    // returns false to stop the query early
+    //
+    // returns false if the query has been stopped by the visitor
+    template<typename F>
+    bool query( I low, I high, F visitor ) const
+    {
+      if( !self().size() ) return true;
+      return query_in( low, high, self().level_count() - 1, 0, visitor );
+    }
+
+    // the intervals overlapping with ( low, high )
+    // in ascending order of low
+    std::vector<const E*> query( I low, I high ) const
+    {
+      std::vector<const E*> result;
+      query( low, high, [&result]( const E &e ) { result.push_back( &e ); return true; } );
+      return result;
+    }
+
+    bool has_overlap( I low, I high ) const
+    {
+      return !query( low, high, []( const E& ) { return false; } );
+    }
+
+    size_t count_overlaps( I low, I high ) const
+    {
+      if( !self().size() ) return 0;
+      return count_in( low, high, self().level_count() - 1, 0 );
+    }
+
+  private:
+
+    const D& self() const
+    {
+      return static_cast<const D&>( *this );
+    }
+
+    // node is the index of a block at the given level, its children
+    // are the blocks node * B, ..., node * B + B - 1 one level below
+    // (the leaf intervals for level 0)
+    template<typename F>
+    bool query_in( I low, I high, size_t level, size_t node, F &visitor ) const
+    {
+      const D &tree = self();
+      size_t first = node * B;
+      if( level == 0 )
+      {
+        uint64_t mask = overlap_mask( tree.leaf_lows() + first, tree.leaf_highs() + first, std::min( tree.size() - first, B ), low, high );
+        for( ; mask; mask &= mask - 1 )
+          if( !visitor( tree.leaf_entries()[first + mask_first( mask )] ) )
+            return false;
+        return true;
+      }
+
+      uint64_t mask = overlap_mask( tree.level_min( level - 1 ) + first, tree.level_max( level - 1 ) + first,
+                                    std::min( tree.level_size( level - 1 ) - first, B ), low, high );
+      for( ; mask; mask &= mask - 1 )
+        if( !query_in( low, high, level - 1, first + mask_first( mask ), visitor ) )
+          return false;
+      return true;
+    }
+
+    size_t count_in( I low, I high, size_t level, size_t node ) const
+    {
+      const D &tree = self();
+      size_t first = node * B;
+      if( level == 0 )
+        return mask_count( overlap_mask( tree.leaf_lows() + first, tree.leaf_highs() + first, std::min( tree.size() - first, B ), low, high ) );
+
+      uint64_t mask = overlap_mask( tree.level_min( level - 1 ) + first, tree.level_max( level - 1 ) + first,
+                                    std::min( tree.level_size( level - 1 ) - first, B ), low, high );
+      size_t count = 0;
+      for( ; mask; mask &= mask - 1 )
+        count += count_in( low, high, level - 1, first + mask_first( mask ) );
+      return count;
+    }
+};
+
+// read-only interval set for the read-mostly case: built once (from
+// an interval_tree or from sorted tuples) and then only queried
+//
+// the layout is an implicit B+-tree of fanout B:
+//
+// - the intervals are kept sorted by low in flat arrays, the lows
+//   and the highs (all a query needs to look at) apart from the
+//   values, cut into leaf blocks of B intervals
+// - level 0 has the smallest low and the highest high of every leaf
+//   block, level k of every B consecutive entries of level k - 1,
+//   and so on up to a single root entry
+// - the entries of one inner node are adjacent, so deciding which
+//   children to descend into costs a cache line or two rather than
+//   a cache miss per binary node, and the leaves are scanned linearly
+//   rather than branched through
+// - both the children of an inner node and the intervals of a leaf
+//   are tested in one go by overlap_mask (a child overlaps if its
+//   smallest low is below high and its highest high above low), so
+//   there is no branch per interval
+//
+// with trivially copyable ends and values the tree can be saved to a
+// file and mapped back by mapped_interval_tree (mapped_interval_tree.hh)
+template<typename I, typename V, size_t B = 16>
+class frozen_interval_tree : public frozen_query<frozen_interval_tree<I, V, B>, I, frozen_entry<I, V>, B>
+{
+    static_assert( B >= 2 && B <= 64, "the fanout has to be between 2 and 64" );
+
+    friend class frozen_query<frozen_interval_tree, I, frozen_entry<I, V>, B>;
+
+  public:
+
+    typedef frozen_entry<I, V> entry;
+
+    frozen_interval_tree() { }
+
+    template<typename P>
+    explicit frozen_interval_tree( const interval_tree<I, V, P> &tree )
+    {
+      static_assert( std::is_same<typename P::node_type::compare, std::less<I> >::value, "frozen_interval_tree orders the intervals with operator<" );
+      entries.reserve( tree.size() );
+      for( typename interval_tree<I, V, P>::const_iterator itr = tree.begin(); itr != tree.end(); ++itr )
+        entries.push_back( entry( itr->low, itr->high, itr->value ) );
+      build();
+    }
+
+    // from the ( low, high, value ) tuples in [ first, last ), which
+    // have to be sorted by low (otherwise std::invalid_argument is
+    // thrown)
+    template<typename It>
+    frozen_interval_tree( It first, It last )
+    {
+      for( ; first != last; ++first )
+      {
+        if( !entries.empty() && std::get<0>( *first ) < entries.back().low )
+          throw std::invalid_argument( "frozen_interval_tree: the intervals are not sorted" );
+        entries.push_back( entry( std::get<0>( *first ), std::get<1>( *first ), std::get<2>( *first ) ) );
+      }
+      build();
+    }
+
+    size_t size() const
+    {
+      return entries.size();
+    }
+
+    bool empty() const
+    {
+      return entries.empty();
+    }
+
+    // the intervals in ascending order of low
+    typedef typename std::vector<entry>::const_iterator iterator;
+
+    iterator begin() const
+    {
+      return entries.begin();
+    }
+
+    iterator end() const
+    {
+      return entries.end();
+    }
+
+    // writes the tree to the given file (see frozen_file_header):
+    //
+    // - through a temporary file with a name of its own, so saves to
+    //   the same path don't get in each other's way
+    // - the temporary file is synced and then renamed over path, so
+    //   a process that has the old file mapped keeps its pages, one
+    //   that maps it afterwards never sees half of a file, and after
+    //   a crash path is either the old or the new file
+    // - the file is readable by everybody (0644)
+    // - the padding between the fields of the entries is written as
+    //   zeros, so the same tree always makes the same file
+    //
+    // POSIX only, throws std::runtime_error if the file can't be written
+    void save( const std::string &path ) const
+    {
+      static_assert( std::is_trivially_copyable<I>::value && std::is_trivially_copyable<V>::value, "only trivially copyable ends and values can be saved" );
+
+      frozen_file_header header;
+      std::memset( &header, 0, sizeof( header ) );
+      std::memcpy( header.magic, frozen_file_header::file_magic(), sizeof( header.magic ) );
+      header.version = frozen_file_header::current_version;
+      header.byte_order = frozen_file_header::byte_order_mark;
+      header.key_size = sizeof( I );
+      header.key_kind = frozen_file_header::kind_of<I>();
+      header.value_size = sizeof( V );
+      header.entry_size = sizeof( entry );
+      header.fanout = B;
+      header.size = entries.size();
+      header.levels = levels.size();
+
+      std::string tmp = path + ".XXXXXX";
+      int fd = ::mkstemp( &tmp[0] );
+      if( fd < 0 ) save_error( "can't create " + tmp, errno );
+      FILE *out = ::fdopen( fd, "wb" );
+      if( !out )
+      {
+        int error = errno;
+        ::close( fd );
+        ::unlink( tmp.c_str() );
+        save_error( "can't write " + tmp, error );
+      }
+
+      bool written = false;
+      int error = 0;
+      try
+      {
+        written = ::fchmod( fd, 0644 ) == 0 && write_arrays( out, header ) && std::fflush( out ) == 0 && ::fsync( fd ) == 0;
+        error = errno;
+      }
+      catch( ... )
+      {
+        std::fclose( out );
+        ::unlink( tmp.c_str() );
+        throw;
+      }
+      if( std::fclose( out ) != 0 && written )
+      {
+        written = false;
+        error = errno;
+      }
+      if( !written )
+      {
+        ::unlink( tmp.c_str() );
+        save_error( "can't write " + tmp, error );
+      }
+
+      if( std::rename( tmp.c_str(), path.c_str() ) != 0 )
+      {
+        error = errno;
+        ::unlink( tmp.c_str() );
+        save_error( "can't rename " + tmp + " to " + path, error );
+      }
+      sync_directory( path );
+    }
+
+  private:
+
+    static void save_error( const std::string &what, int error )
+    {
+      throw std::runtime_error( "frozen_interval_tree: " + what + ": " + std::strerror( error ) );
+    }
+
+    bool write_arrays( FILE *out, const frozen_file_header &header ) const
+    {
+      uint64_t offset = 0;
+      if( !write( out, offset, &header, sizeof( header ) ) ) return false;
+
+      // the entries go through a zeroed buffer field by field, rather
+      // than with whatever the padding holds in memory
+      typedef typename std::aligned_storage<sizeof( entry ), alignof( entry )>::type slot_t;
+      std::vector<slot_t> buffer( std::min<size_t>( entries.size(), 1024 ) );
+      for( size_t first = 0; first < entries.size(); first += buffer.size() )
+      {
+        size_t n = std::min( buffer.size(), entries.size() - first );
+        std::memset( buffer.data(), 0, n * sizeof( slot_t ) );
+        for( size_t i = 0; i < n; ++i )
+        {
+          const entry &e = entries[first + i];
+          new( &buffer[i] ) entry( e.low, e.high, e.value );
+        }
+        if( !write_bytes( out, offset, buffer.data(), n * sizeof( slot_t ) ) ) return false;
+      }
+      if( !pad( out, offset ) ) return false;
+
+      if( !write( out, offset, lows.data(), lows.size() * sizeof( I ) ) ) return false;
+      if( !write( out, offset, highs.data(), highs.size() * sizeof( I ) ) ) return false;
+      for( size_t k = 0; k < levels.size(); ++k )
+      {
+        if( !write( out, offset, levels[k].min.data(), levels[k].min.size() * sizeof( I ) ) ) return false;
+        if( !write( out, offset, levels[k].max.data(), levels[k].max.size() * sizeof( I ) ) ) return false;
+      }
+      return true;
+    }
+
+    // one array of the file, padded to the next one
+    static bool write( FILE *out, uint64_t &offset, const void *data, size_t bytes )
+    {
+      return write_bytes( out, offset, data, bytes ) && pad( out, offset );
+    }
+
+    static bool write_bytes( FILE *out, uint64_t &offset, const void *data, size_t bytes )
+    {
+      offset += bytes;
+      return !bytes || std::fwrite( data, 1, bytes, out ) == bytes;
+    }
+
+    static bool pad( FILE *out, uint64_t &offset )
+    {
+      static const char zeros[64] = { };
+      return write_bytes( out, offset, zeros, frozen_file_header::align( offset ) - offset );
+    }
+
+    // so that the rename survives a crash as well (best effort, not
+    // every file system can sync a directory)
+    static void sync_directory( const std::string &path )
+    {
+      std::string::size_type slash = path.rfind( '/' );
+      std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr( 0, slash );
+      int fd = ::open( directory.c_str(), O_RDONLY );
+      if( fd < 0 ) return;
+      ::fsync( fd );
+      ::close( fd );
+    }
+
+    const entry* leaf_entries() const
+    {
+      return entries.data();
+    }
+
+    const I* leaf_lows() const
+    {
+      return lows.data();
+    }
+
+    const I* leaf_highs() const
+    {
+      return highs.data();
+    }
+
+    size_t level_count() const
+    {
+      return levels.size();
+    }
+
+    const I* level_min( size_t level ) const
+    {
+      return levels[level].min.data();
+    }
+
+    const I* level_max( size_t level ) const
+    {
+      return levels[level].max.data();
+    }
+
+    size_t level_size( size_t level ) const
+    {
+      return levels[level].max.size();
+    }
+
+    // the smallest low and the highest high of each block of a level
+    struct level_t
+    {
+        std::vector<I> min;
+        std::vector<I> max;
+    };
+
+    void build()
+    {
+      lows.resize( entries.size() );
+      highs.resize( entries.size() );
+      for( size_t i = 0; i < entries.size(); ++i )
+      {
+        lows[i] = entries[i].low;
+        highs[i] = entries[i].high;
+      }
+
+      if( entries.empty() ) return;
+
+      // level 0 over the leaves
+      levels.push_back( level_t() );
+      summarise( lows, highs, levels.back() );
+      // and up to the root
+      while( levels.back().max.size() > 1 )
+      {
+        level_t up;
+        summarise( levels.back().min, levels.back().max, up );
+        levels.push_back( std::move( up ) );
+      }
+    }
+
+    // one entry per B consecutive entries below
+    static void summarise( const std::vector<I> &min, const std::vector<I> &max, level_t &up )
+    {
+      for( size_t first = 0; first < max.size(); first += B )
+      {
+        size_t last = std::min( max.size(), first + B );
+        up.min.push_back( min[first] );
+        up.max.push_back( *std::max_element( max.begin() + first, max.begin() + last ) );
+      }
+    }
+
+    std::vector<entry>    entries;
+    std::vector<I>        lows;
+    std::vector<I>        highs;
+    // from the leaf blocks (levels[0]) up to the root
+    std::vector<level_t>  levels;
+};
+
+#endif /* FROZEN_INTERVAL_TREE_HH_ */
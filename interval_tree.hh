@@ -11,261 +11,798 @@
 #include "rbtree.hh"
 
 #include <set>
-#include <memory>
 #include <vector>
 #include <exception>
+#include <iterator>
 #include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <tuple>
+#include <memory>
+#include <functional>
+
+
+// the order of the ends of the intervals: C is a strict weak ordering
+// on I (default constructed for every comparison, as in rbtree), and
+// the intervals ( low, high ) and ( l, h ) overlap if
+//
+//   low < h && l < high
+//
+// which takes nothing but comparisons, so there is no overflow even
+// for the extremes of I; integers in their natural order evaluate both
+// comparisons without a branch
+template<typename I, typename C, bool NATIVE = std::is_integral<I>::value && std::is_same< C, std::less<I> >::value>
+struct interval_order
+{
+    static bool less( const I &x, const I &y )
+    {
+      return C()( x, y );
+    }
+
+    static bool overlaps( const I &low, const I &high, const I &l, const I &h )
+    {
+      return less( low, h ) && less( l, high );
+    }
+};
+
+template<typename I, typename C>
+struct interval_order<I, C, true>
+{
+    static bool less( I x, I y )
+    {
+      return x < y;
+    }
+
+    static bool overlaps( I low, I high, I l, I h )
+    {
+      return ( low < h ) & ( l < high );
+    }
+};
+
+// augmentation policy: the highest and the lowest high in
+// the subtree and the number of nodes in the subtree, with them
+// count_overlaps counts whole subtrees at a time, query_contained
+// skips the subtrees ending after the range and join_overlaps
+// knows how big a subtree is
+template<typename I, typename C = std::less<I> >
+struct interval_summary
+{
+    static const bool counted = true;
+
+    struct value_type
+    {
+      I max;
+      I min_high;
+      size_t count;
+    };
+
+    template<typename N>
+    static value_type lift( const N &node )
+    {
+      value_type summary = { node.high, node.high, 1 };
+      return summary;
+    }
 
+    static value_type combine( const value_type &left, const value_type &right )
+    {
+      value_type summary = { std::max( left.max, right.max, C() ), std::min( left.min_high, right.min_high, C() ), left.count + right.count };
+      return summary;
+    }
+};
+
+// augmentation policy: only the highest high in the subtree, which
+// is all query needs; the nodes are smaller (with int ends and values
+// an index_links node takes 28 B rather than 40 B) but count_overlaps
+// and query_contained go down to every node they count or report
+template<typename I, typename C = std::less<I> >
+struct interval_max
+{
+    static const bool counted = false;
+
+    struct value_type
+    {
+      I max;
+    };
+
+    template<typename N>
+    static value_type lift( const N &node )
+    {
+      value_type summary = { node.high };
+      return summary;
+    }
+
+    static value_type combine( const value_type &left, const value_type &right )
+    {
+      value_type summary = { std::max( left.max, right.max, C() ) };
+      return summary;
+    }
+};
+
+// the key of an interval: the intervals are ordered by low and the
+// ones starting at the same low by high, so any number of them can
+// start at the same point
+//
+// a bare low converts to the key right before all the intervals
+// starting at low (e.g. for split or extract_range)
+template<typename I>
+struct interval_key
+{
+    interval_key( I low ) : low( low ), high( low ), bare( true ) { }
+
+    interval_key( I low, I high ) : low( low ), high( high ), bare( false ) { }
+
+    I low;
+    I high;
+    // only the low counts
+    bool bare;
+};
+
+// the order of the keys, C is the order of the ends
+template<typename I, typename C = std::less<I> >
+struct interval_key_less
+{
+    bool operator()( const interval_key<I> &x, const interval_key<I> &y ) const
+    {
+      typedef interval_order<I, C> order;
+      if( order::less( x.low, y.low ) ) return true;
+      if( order::less( y.low, x.low ) ) return false;
+      // a bare low goes before the intervals starting there
+      if( x.bare || y.bare ) return x.bare && !y.bare;
+      return order::less( x.high, y.high );
+    }
+};
 
-template<typename I,typename V>
-class interval_node_t
+// L is the link storage: pointer_links (used with node_pool)
+// or index_links (used with index_node_pool), C is the order
+// of the ends of the intervals (see interval_order), A is the
+// augmentation policy (interval_summary or interval_max)
+template<typename I, typename V, template<typename> class L = pointer_links, typename C = std::less<I>, typename A = interval_summary<I, C> >
+class interval_node_t : private summary_holder<typename A::value_type>, private L< interval_node_t<I, V, L, C, A> >
 {
   public:
 
-    template<typename, typename> friend class interval_tree;
-    template<typename, typename, typename> friend class rbtree;
-    friend class interval_tree_tester;
+    template<typename, typename, typename, typename, typename> friend class rbtree;
+    template<typename, size_t> friend class node_pool;
+    template<typename, size_t> friend class index_node_pool;
 
 
     public:
 
-      interval_node_t( I low, I high, const V &value ) :
-        low( low ), high( high ), value( value ), key( this->low ), max( high ), colour( RED ), parent( nullptr ) { }
+      typedef A augmentation;
+
+      typedef C compare;
+
+      // the value is constructed in place from args
+      template<typename ... Args>
+      interval_node_t( I low, I high, Args&& ... args ) :
+        low( low ), high( high ), value( std::forward<Args>( args )... ) { }
 
       const I low;
       const I high;
       V value;
-
-    private:
-      const I &key;
-      I max;
-      colour_t colour;
-      interval_node_t* parent;
-
-      std::unique_ptr<interval_node_t> left;
-      std::unique_ptr<interval_node_t> right;
 };
 
-template<typename I, typename V>
-class interval_tree : public rbtree< I, V, interval_node_t<I, V> >
+template<typename I, typename V, template<typename> class L, typename C, typename A>
+inline interval_key<I> node_key( const interval_node_t<I, V, L, C, A> &node )
+{
+  return interval_key<I>( node.low, node.high );
+}
+
+// the intervals are ordered by the C of the node type (std::less<I>
+// by default), so anything with a strict weak ordering does for I
+template<typename I, typename V, typename P = node_pool< interval_node_t<I, V> > >
+class interval_tree : public rbtree< interval_key<I>, V, typename P::node_type, P, interval_key_less<I, typename P::node_type::compare> >
 {
   private:
 
-    typedef interval_node_t<I, V> N;
+    typedef typename P::node_type N;
 
-    typedef typename rbtree<I, V, N>::leaf_node_t leaf_node_t;
+    typedef typename N::compare C;
 
-    std::unique_ptr<N> make_node( I low, I high, const V &value )
-    {
-      return std::unique_ptr<N>( new N( low, high, value ) );
-    }
+    typedef interval_order<I, C> order;
+
+    // the summary has min_high and count (see interval_summary)
+    typedef std::integral_constant<bool, N::augmentation::counted> counted;
+
+    typedef rbtree<interval_key<I>, V, N, P, interval_key_less<I, C> > base_t;
 
   public:
 
-    typedef typename rbtree<I, V, N>::iterator iterator;
+    // in order of low and then of high, a bare low is the position
+    // before all the intervals starting there, so the intervals with
+    // low in [ a, b ) are [ lower_bound( a ), lower_bound( b ) )
+    typedef typename base_t::iterator iterator;
+
+    typedef typename base_t::const_iterator const_iterator;
+
+  private:
+
+    // join_overlaps walks the other tree too
+    template<typename, typename, typename> friend class interval_tree;
+
+    // true if F can be called with an iterator
+    template<typename F>
+    struct is_visitor
+    {
+        template<typename T>
+        static auto test( int ) -> decltype( std::declval<T&>()( std::declval<const iterator&>() ), std::true_type() );
+
+        template<typename>
+        static std::false_type test( ... );
+
+        static const bool value = decltype( test<F>( 0 ) )::value;
+    };
 
+  public:
+
+    // by low and then by high, the order of the tree
     struct less
     {
         bool operator() ( const iterator &x, const iterator &y) const
         {
-          return x->low < y->low;
+          return interval_key_less<I, C>()( node_key( *x ), node_key( *y ) );
         }
     };
 
-    virtual ~interval_tree()
+    // the interval is added unless the very same ( low, high )
+    // is already there, the inserts return the node of the interval
+    // and whether it is a new one
+    std::pair<iterator, bool> insert( I low, I high, const V &value )
+    {
+      return try_emplace( low, high, value );
+    }
+
+    std::pair<iterator, bool> insert( I low, I high, V &&value )
+    {
+      return try_emplace( low, high, std::move( value ) );
+    }
+
+    // with a hint, see rbtree::insert
+    iterator insert( const_iterator hint, I low, I high, const V &value )
     {
+      return this->make_iterator( this->insert_node_hint( hint, interval_key<I>( low, high ), low, high, value ).first );
+    }
 
+    iterator insert( const_iterator hint, I low, I high, V &&value )
+    {
+      return this->make_iterator( this->insert_node_hint( hint, interval_key<I>( low, high ), low, high, std::move( value ) ).first );
+    }
+
+    // the value is constructed in place from args, and only if the
+    // interval is not there yet (the key is known up front, so emplace
+    // doesn't need to make the node first either)
+    template<typename ... Args>
+    std::pair<iterator, bool> try_emplace( I low, I high, Args&& ... args )
+    {
+      std::pair<N*, bool> result = this->insert_node( interval_key<I>( low, high ), low, high, std::forward<Args>( args )... );
+      return std::make_pair( this->make_iterator( result.first ), result.second );
     }
 
-    void insert( I low, I high, const V &value )
+    template<typename ... Args>
+    std::pair<iterator, bool> emplace( I low, I high, Args&& ... args )
     {
-      insert_into( low, high, value, this->tree_root );
+      return try_emplace( low, high, std::forward<Args>( args )... );
+    }
+
+    // like insert, but if the interval is there its value
+    // is assigned from value
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign( I low, I high, M &&value )
+    {
+      std::pair<iterator, bool> result = try_emplace( low, high, std::forward<M>( value ) );
+      if( !result.second ) result.first->value = std::forward<M>( value );
+      return result;
     }
 
     void erase( I low, I high )
     {
-      std::unique_ptr<N> &node = this->find_in( low, this->tree_root );
-      if( !node || node->low != low || node->high != high )
-        return;
-      this->erase_node( node );
+      N *node = this->find_in( interval_key<I>( low, high ), this->tree_root );
+      if( node ) this->erase_node( node );
+    }
+
+    // replaces the content of the tree with the ( low, high, value )
+    // tuples from [ first, last ), which have to be sorted by low and
+    // high without duplicates (otherwise std::invalid_argument is thrown
+    // and the tree is left empty)
+    //
+    // O(n), max is computed bottom-up while linking, with
+    // threads > 1 the subtrees are linked in parallel
+    template<typename It>
+    void build_from_sorted( It first, It last, unsigned threads = 1 )
+    {
+      this->build_sorted( first, last, [this]( It itr )
+      {
+        return this->make_node( std::get<0>( *itr ), std::get<1>( *itr ), std::get<2>( *itr ) );
+      }, threads );
+    }
+
+    // inserts the ( low, high, value ) tuples from [ first, last )
+    // (forward iterators), see rbtree::insert_batch
+    template<typename It>
+    void insert_batch( It first, It last )
+    {
+      this->insert_batch_by( first, last, []( It itr ) { return interval_key<I>( std::get<0>( *itr ), std::get<1>( *itr ) ); }, [this]( It itr )
+      {
+        return this->make_node( std::get<0>( *itr ), std::get<1>( *itr ), std::get<2>( *itr ) );
+      } );
+    }
+
+    // erases the ( low, high ) pairs from [ first, last ) (forward
+    // iterators), max is recomputed once per touched path
+    template<typename It>
+    void erase_batch( It first, It last )
+    {
+      this->erase_batch_by( first, last, []( It itr ) { return interval_key<I>( itr->first, itr->second ); },
+                            []( const N*, It ) { return true; } );
+    }
+
+    // set operations with another interval tree (left as it is), an
+    // interval is in both trees if both low and high match, max is
+    // rebuilt along the joins, see rbtree::union_with
+    void union_with( const interval_tree &other, unsigned threads = 1 )
+    {
+      this->set_operation( other, base_t::set_union, threads, []( const N*, const N* ) { return true; },
+                           [this]( const N *node ) { return this->make_node( node->low, node->high, node->value ); } );
+    }
+
+    void intersection_with( const interval_tree &other, unsigned threads = 1 )
+    {
+      this->set_operation( other, base_t::set_intersection, threads, []( const N*, const N* ) { return true; },
+                           [this]( const N *node ) { return this->make_node( node->low, node->high, node->value ); } );
+    }
+
+    void difference_with( const interval_tree &other, unsigned threads = 1 )
+    {
+      this->set_operation( other, base_t::set_difference, threads, []( const N*, const N* ) { return true; },
+                           [this]( const N *node ) { return this->make_node( node->low, node->high, node->value ); } );
     }
 
     std::set<iterator, less> query( I low, I high )
     {
+      // the hits come in ascending order so inserting
+      // at the end is amortized constant
       std::set<iterator, less> result;
-      query( low, high, this->tree_root, result );
+      query( low, high, std::inserter( result, result.end() ) );
       return result;
     }
 
-  private:
+    // calls visitor( iterator ) for every interval overlapping
+    // with ( low, high ) in ascending order of low, the visitor
+    // returns false to stop the query early
+    //
+    // returns false if the query has been stopped by the visitor
+    template<typename F>
+    typename std::enable_if<is_visitor<F>::value, bool>::type query( I low, I high, F visitor )
+    {
+      return query_in_order( low, high, this->tree_root, visitor );
+    }
 
-    using rbtree<I, V, N>::insert;
-    using rbtree<I, V, N>::erase;
-    using rbtree<I, V, N>::find;
+    // writes an iterator for every interval overlapping
+    // with ( low, high ) to out in ascending order of low
+    template<typename O>
+    typename std::enable_if<!is_visitor<O>::value, O>::type query( I low, I high, O out )
+    {
+      output_visitor<O> write( out );
+      query_in_order( low, high, this->tree_root, write );
+      return write.out;
+    }
 
-    static bool overlaps( I low, I high, const N *node )
+    bool has_overlap( I low, I high )
     {
-      int64_t s1 = low + high;
-      int64_t d1 = high - low;
-      int64_t s2 = node->low + node->high;
-      int64_t d2 = node->high - node->low;
-      return abs( s2 - s1 ) < d1 + d2;
+      return !query( low, high, []( const iterator& ) { return false; } );
     }
 
-    static void query( I low, I high, std::unique_ptr<N> &node, std::set<iterator, less> &result )
+    size_t count_overlaps( I low, I high ) const
     {
-      // base case
-      if( !node ) return;
-      // the interval is to the right of the rightmost point of any interval
-      if( low > node->max ) return;
-      // check if the interval overlaps fully with current node
-      if( overlaps( low, high, node.get() ))
-        result.insert( iterator( node.get() ) );
-      // check the left subtree
-      query( low, high, node->left, result );
-      // Do we need to check the right subtree?
-      if( high > node->low )
-        query( low, high, node->right, result);
+      return count_in( low, high, this->tree_root, false );
     }
 
-    void insert_into( I low, I high, const V &value, std::unique_ptr<N> &node, N *parent = nullptr )
+    // runs the ( low, high ) queries from [ first, last ) (forward
+    // iterators over pairs) and calls sink( index, iterator ) for
+    // every hit, index being the position of the query in the batch;
+    // for every query the hits come in ascending order of low, the
+    // hits of different queries interleave
+    //
+    // rather than starting from the root for each query, the batch
+    // is sorted by low (unless it already is) and goes down the tree
+    // in one pass: every node is visited once for all the queries that
+    // reach it, and the queries that can't reach a subtree are cut off
+    // as a whole (see sweep_in)
+    //
+    // with threads > 1 the sorted batch is cut into runs of neighbouring
+    // queries swept in parallel, every query is still answered by a
+    // single thread (so a sink writing only to the slot of its query
+    // needs no locking)
+    template<typename It, typename F>
+    void query_batch( It first, It last, F sink, unsigned threads = 1 )
     {
-      if( !node )
+      batch_t batch;
+      for( ; first != last; ++first )
       {
-        node = make_node( low, high, value );
-        node->parent = parent;
-        ++this->tree_size;
-        update_max( node->parent, node->max );
-        this->rb_insert_case1( node.get() );
-        return;
+        batch.low.push_back( first->first );
+        batch.high.push_back( first->second );
       }
+      if( batch.low.empty() ) return;
+
+      batch.order.resize( batch.low.size() );
+      for( size_t i = 0; i < batch.order.size(); ++i )
+        batch.order[i] = i;
+      if( !std::is_sorted( batch.low.begin(), batch.low.end(), C() ) )
+        std::stable_sort( batch.order.begin(), batch.order.end(), [&batch]( size_t a, size_t b ) { return order::less( batch.low[a], batch.low[b] ); } );
 
-      if( low == node->low )
+      size_t runs = std::max<size_t>( 1, std::min<size_t>( threads, batch.order.size() / batch_grain ) );
+      if( runs == 1 )
+      {
+        sweep_run( batch, 0, 1, sink );
         return;
+      }
+      // task_pool waits for all the runs and then rethrows whatever
+      // the sink has thrown
+      task_pool tasks( static_cast<unsigned>( runs ) );
+      tasks.run( [&]() { sweep_runs( tasks, batch, 0, runs, runs, sink ); } );
+    }
 
-      if( low < node->low )
-        insert_into( low, high, value, node->left, node.get() );
+    // calls sink( a, b ) for every pair of overlapping intervals, a
+    // from this tree and b from the other one, in no particular order
+    //
+    // the two trees are walked together: each pair of subtrees is
+    // dropped as a whole unless the lows of either side (bounded by the
+    // ancestors) start before the max of the other side, so sparse
+    // joins cost far less than a query per interval; with threads > 1
+    // the pairs of subtrees are joined in parallel and sink has to be
+    // thread-safe
+    template<typename V2, typename P2, typename F>
+    void join_overlaps( interval_tree<I, V2, P2> &other, F sink, unsigned threads = 1 )
+    {
+      static_assert( std::is_same<typename P2::node_type::compare, C>::value, "the trees have to order the intervals the same way" );
+      std::unique_ptr<task_pool> tasks;
+      if( threads > 1 ) tasks.reset( new task_pool( threads ) );
+      auto join = [&]() { join_in( other, tasks.get(), this->tree_root, nullptr, other.tree_root, nullptr, sink ); };
+      if( tasks )
+        tasks->run( join );
       else
-        insert_into( low, high, value, node->right, node.get() );
+        join();
     }
 
-    void erase_node( std::unique_ptr<N> &node )
+    // the highest high in the tree (which must not be empty)
+    I max_high() const
     {
-      if( !node ) return;
+      return this->summary_of( this->tree_root ).max;
+    }
 
-      if( this->has_two( node.get() ) )
-      {
-        // in this case:
-        // 1. look for the in-order successor
-        // 2. replace the node with the in-order successor
-        // 3. erase the in-order successor
-        N *n = node.get();
-        std::unique_ptr<N> &successor = this->find_successor( node );
-        this->swap_successor( node, successor );
-        // we don't update max since in erase_node we
-        // will do it after removing respective node
-        // we swapped the node with successor and the
-        // 'successor' unique pointer holds now the node
-        if( successor.get() == n )
-          erase_node( successor );
-        // otherwise the successor was the right child of node,
-        // hence node should be now the right child of 'node'
-        // unoique pointer
-        else if( node->right.get() == n )
-          erase_node( node->right );
-        // there are no other cases so anything else is wrong
-        else
-          throw std::logic_error( "Bad rbtree swap." );
-        return;
-      }
+    // intervals containing the point ( low <= point < high )
+    template<typename F>
+    typename std::enable_if<is_visitor<F>::value, bool>::type stab( I point, F visitor )
+    {
+      return stab_in_order( point, this->tree_root, visitor );
+    }
 
-      // node has at most one child
-      // in this case simply replace the node with the
-      // single child or null if there are no children
-      N *parent = node->parent;
-      std::unique_ptr<N> &child = node->left ? node->left : node->right;
-      colour_t old_colour = node->colour;
-      if( child )
-        child->parent = node->parent;
-      node.reset( child.release() );
-      update_max( parent );
-      --this->tree_size;
-      if( old_colour == BLACK)
-      {
-        if( node && node->colour == RED )
-          node->colour = BLACK;
-        else
-        {
-          // if we are here the node is null because a BLACK
-          // node that has at most one non-leaf child must
-          // have two null children (null children are BLACK)
-          if( node ) throw rb_invariant_error();
-          this->rb_erase_case1( leaf_node_t( parent ) );
-        }
-      }
-      else if( node )
-        // if the node was red it has to have two BLACK children
-        // and since at most one of those children is a non-leaf
-        // child actually both have to be leafs (null) in order
-        // to satisfy the red-black tree invariant
-        throw rb_invariant_error();
+    template<typename O>
+    typename std::enable_if<!is_visitor<O>::value, O>::type stab( I point, O out )
+    {
+      output_visitor<O> write( out );
+      stab_in_order( point, this->tree_root, write );
+      return write.out;
     }
 
-    void update_max( N *node, I new_high )
+    // intervals that lie within [ low, high ]
+    template<typename F>
+    typename std::enable_if<is_visitor<F>::value, bool>::type query_contained( I low, I high, F visitor )
     {
-      while( node )
-      {
-        if( node->max < new_high )
+      return contained_in_order( low, high, this->tree_root, visitor );
+    }
+
+    template<typename O>
+    typename std::enable_if<!is_visitor<O>::value, O>::type query_contained( I low, I high, O out )
+    {
+      output_visitor<O> write( out );
+      contained_in_order( low, high, this->tree_root, write );
+      return write.out;
+    }
+
+    // intervals that cover the whole [ low, high ]
+    template<typename F>
+    typename std::enable_if<is_visitor<F>::value, bool>::type query_containing( I low, I high, F visitor )
+    {
+      return containing_in_order( low, high, this->tree_root, visitor );
+    }
+
+    template<typename O>
+    typename std::enable_if<!is_visitor<O>::value, O>::type query_containing( I low, I high, O out )
+    {
+      output_visitor<O> write( out );
+      containing_in_order( low, high, this->tree_root, write );
+      return write.out;
+    }
+
+  private:
+
+    // turns an output iterator into a visitor
+    template<typename O>
+    struct output_visitor
+    {
+        output_visitor( O out ) : out( out ) { }
+
+        bool operator()( const iterator &itr )
         {
-          node->max = new_high;
-          node = node->parent;
+          *out++ = itr;
+          return true;
         }
-        else
-          break;
-      }
+
+        O out;
+    };
+
+    using base_t::insert;
+    using base_t::erase;
+    using base_t::find;
+
+    static bool overlaps( I low, I high, const N *node )
+    {
+      return order::overlaps( low, high, node->low, node->high );
+    }
+
+    // in-order walk, so the hits come sorted by low
+    template<typename F>
+    bool query_in_order( I low, I high, N *node, F &visitor ) const
+    {
+      // base case
+      if( !node ) return true;
+      // the interval is to the right of the rightmost point of any interval
+      if( !order::less( low, this->summary_of( node ).max ) ) return true;
+      // check the left subtree
+      if( !query_in_order( low, high, this->left_of( node ), visitor ) )
+        return false;
+      // the interval is to the left of the current node, and
+      // hence of everything in the right subtree
+      if( !order::less( node->low, high ) ) return true;
+      // check if the interval overlaps with current node
+      if( overlaps( low, high, node ) && !visitor( this->make_iterator( node ) ) )
+        return false;
+      // check the right subtree
+      return query_in_order( low, high, this->right_of( node ), visitor );
+    }
+
+    // the queries of query_batch, order has the indices of the
+    // queries sorted by low
+    struct batch_t
+    {
+        std::vector<I>       low;
+        std::vector<I>       high;
+        std::vector<size_t>  order;
+    };
+
+    // the smallest run of queries worth a thread of its own
+    static const size_t batch_grain = 1 << 10;
+
+    // sweeps the r-th of runs runs of the sorted batch
+    template<typename F>
+    void sweep_run( const batch_t &batch, size_t r, size_t runs, F &sink ) const
+    {
+      size_t begin = batch.order.size() * r / runs;
+      size_t end = batch.order.size() * ( r + 1 ) / runs;
+      // scratch[d] has the queries going into the right
+      // subtree of the node at depth d
+      std::vector< std::vector<size_t> > scratch;
+      sweep_in( batch, this->tree_root, batch.order.data() + begin, end - begin, 0, scratch, sink );
     }
 
-    void update_max( N *node )
+    // sweeps the runs [ first, last ), halving them over the pool
+    template<typename F>
+    void sweep_runs( task_pool &tasks, const batch_t &batch, size_t first, size_t last, size_t runs, F &sink ) const
     {
-      while( node )
+      if( last - first == 1 )
       {
-        set_max( node );
-        node = node->parent;
+        sweep_run( batch, first, runs, sink );
+        return;
       }
+      size_t middle = first + ( last - first ) / 2;
+      tasks.invoke( [&]() { sweep_runs( tasks, batch, first, middle, runs, sink ); },
+                    [&]() { sweep_runs( tasks, batch, middle, last, runs, sink ); } );
     }
 
-    void set_max( N* node )
+    // queries has the indices of count queries (sorted by low) that
+    // might overlap with something in the subtree of node
+    template<typename F>
+    void sweep_in( const batch_t &batch, N *node, const size_t *queries, size_t count, size_t depth,
+                   std::vector< std::vector<size_t> > &scratch, F &sink ) const
     {
-      if( !node->left && !node->right )
+      if( !node || !count ) return;
+      // the queries starting at or after max are done with this subtree,
+      // and since they are sorted by low that's a suffix
+      const I &max = this->summary_of( node ).max;
+      count = std::partition_point( queries, queries + count, [&]( size_t q ) { return order::less( batch.low[q], max ); } ) - queries;
+      if( !count ) return;
+
+      // a lone query is cheaper on its own
+      if( count == 1 )
       {
-        node->max = node->high;
+        size_t q = queries[0];
+        auto visitor = [&sink, q]( const iterator &itr ) { sink( q, itr ); return true; };
+        query_in_order( batch.low[q], batch.high[q], node, visitor );
         return;
       }
 
-      if( !node->left || !node->right )
+      // the left subtree gets all of them (it cuts off its own suffix)
+      sweep_in( batch, this->left_of( node ), queries, count, depth + 1, scratch, sink );
+
+      // the ones ending after the low of the node may hit the node
+      // itself and the right subtree
+      if( scratch.size() <= depth ) scratch.resize( depth + 1 );
+      std::vector<size_t> &right = scratch[depth];
+      right.clear();
+      for( size_t i = 0; i < count; ++i )
       {
-        node->max = std::max( node->high, ( node->left ? node->left->max : node->right->max ) );
-        return;
+        size_t q = queries[i];
+        if( !order::less( node->low, batch.high[q] ) ) continue;
+        if( order::less( batch.low[q], node->high ) ) sink( q, this->make_iterator( node ) );
+        right.push_back( q );
       }
 
-      node->max = std::max( node->high, std::max( node->left->max, node->right->max ) );
+      sweep_in( batch, this->right_of( node ), right.data(), right.size(), depth + 1, scratch, sink );
     }
 
-    virtual void right_rotation( N *node )
+    // the smallest pair of subtrees (in intervals) worth a task of its own
+    static const size_t join_grain = 1 << 12;
+
+    // joins the subtrees of a and b, the lows in them are at least
+    // *a_low and *b_low (no bound if null)
+    template<typename T, typename N2, typename F>
+    void join_in( T &other, task_pool *tasks, N *a, const I *a_low, N2 *b, const I *b_low, F &sink ) const
     {
-      N *pivot = node->left.get();
-      rbtree<I, V, N>::right_rotation( node );
-      set_max( node ); // set first max for node since now it's lower in the tree
-      set_max( pivot );
+      if( !a || !b ) return;
+      if( a_low && !order::less( *a_low, other.summary_of( b ).max ) ) return;
+      if( b_low && !order::less( *b_low, this->summary_of( a ).max ) ) return;
+
+      if( order::overlaps( a->low, a->high, b->low, b->high ) )
+        sink( this->make_iterator( a ), other.make_iterator( b ) );
+
+      // a against the children of b and b against the children of a
+      auto with_a = [&]( const typename T::iterator &itr ) { sink( this->make_iterator( a ), itr ); return true; };
+      other.query_in_order( a->low, a->high, other.left_of( b ), with_a );
+      other.query_in_order( a->low, a->high, other.right_of( b ), with_a );
+      auto with_b = [&]( const iterator &itr ) { sink( itr, other.make_iterator( b ) ); return true; };
+      query_in_order( b->low, b->high, this->left_of( a ), with_b );
+      query_in_order( b->low, b->high, this->right_of( a ), with_b );
+
+      // and the four pairs of children
+      auto left = [&]()
+      {
+        join_in( other, tasks, this->left_of( a ), a_low, other.left_of( b ), b_low, sink );
+        join_in( other, tasks, this->left_of( a ), a_low, other.right_of( b ), &b->low, sink );
+      };
+      auto right = [&]()
+      {
+        join_in( other, tasks, this->right_of( a ), &a->low, other.left_of( b ), b_low, sink );
+        join_in( other, tasks, this->right_of( a ), &a->low, other.right_of( b ), &b->low, sink );
+      };
+      if( tasks && subtree_size( a ) + other.subtree_size( b ) >= join_grain )
+        tasks->invoke( left, right );
+      else
+      {
+        left();
+        right();
+      }
     }
 
-    virtual void left_rotation( N *node )
+    // true if all the intervals in the subtree end after x, without
+    // min_high in the summary that is never known
+    bool ends_after( I x, N *node, std::true_type ) const
     {
-      N* pivot = node->right.get();
-      rbtree<I, V, N>::left_rotation( node );
-      set_max( node ); // set first max for node since now it's lower in the tree
-      set_max( pivot );
+      return order::less( x, this->summary_of( node ).min_high );
+    }
+
+    bool ends_after( I, N*, std::false_type ) const
+    {
+      return false;
+    }
+
+    // the number of intervals in the subtree, without the counts in
+    // the summary the lower bound that its black height guarantees
+    size_t subtree_size( N *node ) const
+    {
+      return subtree_size( node, counted() );
+    }
+
+    size_t subtree_size( N *node, std::true_type ) const
+    {
+      return this->summary_of( node ).count;
+    }
+
+    size_t subtree_size( N *node, std::false_type ) const
+    {
+      return ( size_t( 1 ) << this->black_height( node ) ) - 1;
+    }
+
+    // below_high is true if we know that all the intervals
+    // in the subtree start before high
+    size_t count_in( I low, I high, N *node, bool below_high ) const
+    {
+      if( !node ) return 0;
+      // all the intervals end before low
+      if( !order::less( low, this->summary_of( node ).max ) ) return 0;
+      // all the intervals end after low and start before high,
+      // so all of them overlap
+      if( below_high && ends_after( low, node, counted() ) ) return subtree_size( node );
+      // the left subtree starts before the current node
+      size_t count = count_in( low, high, this->left_of( node ), below_high || order::less( node->low, high ) );
+      // the current node and the right subtree start after high
+      if( !order::less( node->low, high ) ) return count;
+      if( overlaps( low, high, node ) ) ++count;
+      return count + count_in( low, high, this->right_of( node ), below_high );
+    }
+
+    template<typename F>
+    bool stab_in_order( I point, N *node, F &visitor ) const
+    {
+      if( !node ) return true;
+      // all the intervals end before the point
+      if( !order::less( point, this->summary_of( node ).max ) ) return true;
+      if( !stab_in_order( point, this->left_of( node ), visitor ) )
+        return false;
+      // the current node and the right subtree start after the point
+      if( order::less( point, node->low ) ) return true;
+      if( order::less( point, node->high ) && !visitor( this->make_iterator( node ) ) )
+        return false;
+      return stab_in_order( point, this->right_of( node ), visitor );
+    }
+
+    template<typename F>
+    bool contained_in_order( I low, I high, N *node, F &visitor ) const
+    {
+      if( !node ) return true;
+      // all the intervals end after high
+      if( ends_after( high, node, counted() ) ) return true;
+      // the left subtree starts before the current node,
+      // if the current node starts before low so does
+      // the left subtree
+      if( !order::less( node->low, low ) && !contained_in_order( low, high, this->left_of( node ), visitor ) )
+        return false;
+      // the current node and the right subtree start after high (an
+      // empty interval starting at high still lies within [ low, high ])
+      if( order::less( high, node->low ) ) return true;
+      if( !order::less( node->low, low ) && !order::less( high, node->high ) && !visitor( this->make_iterator( node ) ) )
+        return false;
+      return contained_in_order( low, high, this->right_of( node ), visitor );
+    }
+
+    template<typename F>
+    bool containing_in_order( I low, I high, N *node, F &visitor ) const
+    {
+      if( !node ) return true;
+      // all the intervals end before high
+      if( order::less( this->summary_of( node ).max, high ) ) return true;
+      if( !containing_in_order( low, high, this->left_of( node ), visitor ) )
+        return false;
+      // the current node and the right subtree start after low
+      if( order::less( low, node->low ) ) return true;
+      if( !order::less( node->high, high ) && !visitor( this->make_iterator( node ) ) )
+        return false;
+      return containing_in_order( low, high, this->right_of( node ), visitor );
     }
 };
 
+// same API as interval_tree, but the nodes are kept in an
+// index_node_pool and link to each other with 32-bit indices;
+// to keep them small they only summarise the highest high
+// (interval_max), A = interval_summary<I, C> opts in to the
+// counts (see interval_summary)
+template<typename I, typename V, typename C = std::less<I>, typename A = interval_max<I, C> >
+using compact_interval_tree = interval_tree< I, V, index_node_pool< interval_node_t<I, V, index_links, C, A> > >;
+
+// interval_tree with threaded links, see threaded_rbtree
+template<typename I, typename V, typename C = std::less<I> >
+using threaded_interval_tree = interval_tree< I, V, node_pool< interval_node_t<I, V, threaded_links, C> > >;
+
+// interval_tree with the ends of the intervals ordered by C
+template<typename I, typename V, typename C>
+using ordered_interval_tree = interval_tree< I, V, node_pool< interval_node_t<I, V, pointer_links, C> > >;
+
+// calls sink( a, b ) for every pair of overlapping intervals from
+// tree_a and tree_b, see interval_tree::join_overlaps
+template<typename I, typename V1, typename P1, typename V2, typename P2, typename F>
+inline void join_overlaps( interval_tree<I, V1, P1> &tree_a, interval_tree<I, V2, P2> &tree_b, F sink, unsigned threads = 1 )
+{
+  tree_a.join_overlaps( tree_b, sink, threads );
+}
+
 #endif /* INTERVALTREE_HH_ */
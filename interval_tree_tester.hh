@@ -9,9 +9,29 @@
 #define INTERVAL_TREE_TESTER_HH_
 
 #include "interval_tree.hh"
+#include "concurrent_interval_tree.hh"
+#include "frozen_interval_tree.hh"
+#include "mapped_interval_tree.hh"
 #include <unistd.h>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <list>
+#include <ctime>
+#include <map>
 #include <iterator>
+#include <vector>
+#include <tuple>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <limits>
+#include <climits>
+#include <mutex>
+#include <set>
+#include <algorithm>
+#include <functional>
+#include <memory>
 
 class interval_tree_tester
 {
@@ -19,12 +39,12 @@ class interval_tree_tester
 
     void print()
     {
-      print( tree.tree_root );
+      print( tree, tree.tree_root );
     }
 
     bool test_rb_invariant()
     {
-      return test_rb_invariant( tree.tree_root ).first;
+      return test_rb_invariant( tree, tree.tree_root ).first;
     }
 
     bool test_rb_iterator()
@@ -55,7 +75,7 @@ class interval_tree_tester
 
     bool test_interval_invariant()
     {
-      return test_invariant( tree.tree_root );
+      return test_invariant( tree, tree.tree_root );
     }
 
     bool test_interval_query()
@@ -97,6 +117,935 @@ class interval_tree_tester
       return true;
     }
 
+    bool test_interval_visitor()
+    {
+      typedef interval_tree<int, std::string>::iterator iterator;
+
+      clear();
+
+      tree.insert( 5, 10, "(5, 10)" );
+      tree.insert( 1, 12, "(1, 12)" );
+      tree.insert( 2, 8, "(2, 8)" );
+      tree.insert( 15, 25, "(15, 25)" );
+      tree.insert( 8, 16, "(8, 16)" );
+      tree.insert( 14, 20, "(14, 20)" );
+      tree.insert( 18, 21, "(18, 21)" );
+
+      // the hits come in ascending order of low
+      std::vector<iterator> hits;
+      tree.query( 7, 15, std::back_inserter( hits ) );
+      if( hits.size() != 5 ) return false;
+      for( size_t i = 1; i < hits.size(); ++i )
+        if( !( hits[i - 1]->low < hits[i]->low ) ) return false;
+
+      // stop after the second hit
+      int count = 0;
+      bool done = tree.query( 0, 26, [&count]( const iterator& ) { return ++count < 2; } );
+      if( done || count != 2 ) return false;
+
+      return tree.has_overlap( 12, 14 ) && !tree.has_overlap( 26, 28 );
+    }
+
+    bool test_interval_queries()
+    {
+      typedef interval_tree<int, std::string>::iterator iterator;
+
+      clear();
+
+      tree.insert( 5, 10, "(5, 10)" );
+      tree.insert( 1, 12, "(1, 12)" );
+      tree.insert( 2, 8, "(2, 8)" );
+      tree.insert( 15, 25, "(15, 25)" );
+      tree.insert( 8, 16, "(8, 16)" );
+      tree.insert( 14, 20, "(14, 20)" );
+      tree.insert( 18, 21, "(18, 21)" );
+
+      if( tree.count_overlaps( 26, 28 ) != 0 ) return false;
+      if( tree.count_overlaps( 10, 12 ) != 2 ) return false;
+      if( tree.count_overlaps( 6, 16 ) != 6 ) return false;
+      if( tree.count_overlaps( 0, 26 ) != 7 ) return false;
+
+      // (2, 8), (5, 10), (1, 12)
+      std::vector<iterator> hits;
+      tree.stab( 7, std::back_inserter( hits ) );
+      if( hits.size() != 3 || hits[0]->low != 1 || hits[1]->low != 2 || hits[2]->low != 5 ) return false;
+
+      // (8, 16), (14, 20)
+      hits.clear();
+      tree.query_contained( 8, 20, std::back_inserter( hits ) );
+      if( hits.size() != 2 || hits[0]->low != 8 || hits[1]->low != 14 ) return false;
+
+      // (8, 16), (14, 20) and the empty (20, 20) at the upper bound
+      tree.insert( 20, 20, "(20, 20)" );
+      hits.clear();
+      tree.query_contained( 8, 20, std::back_inserter( hits ) );
+      if( hits.size() != 3 || hits[2]->low != 20 || hits[2]->high != 20 ) return false;
+      tree.erase( 20, 20 );
+
+      // (1, 12), (5, 10)
+      hits.clear();
+      tree.query_containing( 5, 10, std::back_inserter( hits ) );
+      if( hits.size() != 2 || hits[0]->low != 1 || hits[1]->low != 5 ) return false;
+
+      return true;
+    }
+
+    bool test_duplicate_lows()
+    {
+      typedef interval_tree<int, std::string>::iterator iterator;
+
+      clear();
+
+      // all of them start at 5
+      tree.insert( 5, 10, "(5, 10)" );
+      tree.insert( 5, 7, "(5, 7)" );
+      tree.insert( 5, 20, "(5, 20)" );
+      tree.insert( 5, 7, "again" ); // already there
+      tree.insert( 1, 6, "(1, 6)" );
+      tree.insert( 8, 9, "(8, 9)" );
+      if( tree.size() != 5 || !test_rb_invariant() || !test_interval_invariant() )
+        return false;
+
+      // the hits come by low and then by high
+      std::vector<iterator> hits;
+      tree.query( 5, 9, std::back_inserter( hits ) );
+      if( hits.size() != 5 || hits[0]->high != 6 || hits[1]->high != 7 || hits[2]->high != 10 || hits[3]->high != 20 || hits[4]->low != 8 )
+        return false;
+      if( hits[1]->value != "(5, 7)" || tree.query( 5, 9 ).size() != 5 || tree.count_overlaps( 7, 9 ) != 3 )
+        return false;
+
+      // erase takes out exactly the one interval
+      tree.erase( 5, 10 );
+      tree.erase( 5, 11 );
+      if( tree.size() != 4 || tree.count_overlaps( 9, 11 ) != 1 || !test_rb_invariant() || !test_interval_invariant() )
+        return false;
+
+      // a bare low splits before all the intervals starting there
+      interval_tree<int, std::string>::subtree window = tree.extract_range( 5, 6 );
+      return window.size() == 2 && tree.size() == 2 && test_interval_invariant();
+    }
+
+    bool test_hint()
+    {
+      typedef interval_tree<int, std::string>::iterator iterator;
+      std::set< std::pair<int, int> > intervals;
+      std::mt19937 gen( time( NULL ) );
+      clear();
+      tree.use_finger();
+
+      // increasing lows with a few at the same low, at the end, through
+      // the finger and out of order
+      for( int low = 0; low < 3000; low += 1 + gen() % 3 )
+      {
+        int high = low + 1 + gen() % 50;
+        if( low % 2 )
+          tree.insert( tree.end(), low, high, "" );
+        else
+          tree.insert( low, high, "" );
+        tree.insert( low, high + 1, "" );
+        intervals.insert( std::make_pair( low, high ) );
+        intervals.insert( std::make_pair( low, high + 1 ) );
+        if( gen() % 10 == 0 )
+        {
+          int l = gen() % 3000, h = l + 1 + gen() % 50;
+          tree.insert( tree.lower_bound( gen() % 3000 ), l, h, "" );
+          intervals.insert( std::make_pair( l, h ) );
+        }
+      }
+      tree.use_finger( false );
+      if( tree.size() != intervals.size() || !test_rb_invariant() || !test_interval_invariant() )
+        return false;
+
+      std::set< std::pair<int, int> >::iterator i = intervals.begin();
+      for( iterator itr = tree.begin(); itr != tree.end(); ++itr, ++i )
+        if( itr->low != i->first || itr->high != i->second )
+          return false;
+      // and max is right after the inserts without a search
+      size_t expected = 0;
+      for( i = intervals.begin(); i != intervals.end(); ++i )
+        if( i->first < 1510 && 1500 < i->second ) ++expected;
+      return tree.count_overlaps( 1500, 1510 ) == expected;
+    }
+
+    bool test_threaded()
+    {
+      typedef threaded_interval_tree<int, int> threaded_t;
+      threaded_t threaded;
+      std::set< std::pair<int, int> > intervals;
+      std::mt19937 gen( time( NULL ) );
+      for( int i = 0; i < 5000; ++i )
+      {
+        int low = gen() % 2000, high = low + 1 + gen() % 100;
+        if( gen() % 3 )
+        {
+          threaded.insert( low, high, i );
+          intervals.insert( std::make_pair( low, high ) );
+        }
+        else
+        {
+          threaded.erase( low, high );
+          intervals.erase( std::make_pair( low, high ) );
+        }
+      }
+      if( !test_invariant( threaded, threaded.tree_root ) )
+        return false;
+
+      // the hits step through the links as well
+      std::vector<threaded_t::iterator> hits;
+      threaded.query( 500, 600, std::back_inserter( hits ) );
+      for( size_t i = 1; i < hits.size(); ++i )
+        if( !node_less( *hits[i - 1], *hits[i] ) )
+          return false;
+
+      std::set< std::pair<int, int> >::iterator i = intervals.begin();
+      for( threaded_t::iterator itr = threaded.begin(); itr != threaded.end(); ++itr, ++i )
+        if( i == intervals.end() || itr->low != i->first || itr->high != i->second )
+          return false;
+      std::set< std::pair<int, int> >::reverse_iterator r = intervals.rbegin();
+      for( threaded_t::reverse_iterator itr = threaded.rbegin(); itr != threaded.rend(); ++itr, ++r )
+        if( r == intervals.rend() || itr->low != r->first || itr->high != r->second )
+          return false;
+      return i == intervals.end() && r == intervals.rend();
+    }
+
+    bool test_bounds()
+    {
+      clear();
+      std::set< std::pair<int, int> > intervals;
+      std::mt19937 gen( time( NULL ) );
+      for( int i = 0; i < 1000; ++i )
+      {
+        int low = gen() % 2000, high = low + 1 + gen() % 100;
+        tree.insert( low, high, "" );
+        intervals.insert( std::make_pair( low, high ) );
+      }
+
+      // the intervals starting in a window, from both ends
+      for( int a = 0; a < 2000; a += 37 )
+      {
+        int b = a + int( gen() % 100 );
+        std::set< std::pair<int, int> >::iterator first = intervals.lower_bound( std::make_pair( a, INT_MIN ) );
+        std::set< std::pair<int, int> >::iterator last = intervals.lower_bound( std::make_pair( b, INT_MIN ) );
+        interval_tree<int, std::string>::iterator itr = tree.lower_bound( a ), end = tree.lower_bound( b );
+        for( std::set< std::pair<int, int> >::iterator i = first; i != last; ++i, ++itr )
+          if( itr == end || itr->low != i->first || itr->high != i->second )
+            return false;
+        if( itr != end )
+          return false;
+        for( std::set< std::pair<int, int> >::iterator i = last; i != first; )
+          if( ( --i )->first != ( --itr )->low || i->second != itr->high )
+            return false;
+      }
+
+      const interval_tree<int, std::string> &ctree = tree;
+      std::set< std::pair<int, int> >::reverse_iterator i = intervals.rbegin();
+      for( interval_tree<int, std::string>::const_reverse_iterator r = ctree.rbegin(); r != ctree.rend(); ++r, ++i )
+        if( r->low != i->first || r->high != i->second )
+          return false;
+      return i == intervals.rend();
+    }
+
+    bool test_emplace()
+    {
+      typedef interval_tree<int, std::unique_ptr<std::string> > owned_t;
+      owned_t owned;
+      std::pair<owned_t::iterator, bool> result = owned.try_emplace( 1, 5, new std::string( "a" ) );
+      if( !result.second || *result.first->value != "a" )
+        return false;
+      // the same interval again leaves the value alone
+      std::unique_ptr<std::string> value( new std::string( "b" ) );
+      result = owned.insert( 1, 5, std::move( value ) );
+      if( result.second || *result.first->value != "a" || !value )
+        return false;
+      // the same low is another interval
+      result = owned.insert( 1, 6, std::move( value ) );
+      if( !result.second || *result.first->value != "b" || value )
+        return false;
+      result = owned.insert_or_assign( 1, 5, std::unique_ptr<std::string>( new std::string( "c" ) ) );
+      if( result.second || *result.first->value != "c" || !owned.emplace( 2, 3, new std::string( "d" ) ).second )
+        return false;
+      if( owned.size() != 3 || owned.count_overlaps( 4, 5 ) != 2 || !test_invariant( owned, owned.tree_root ) )
+        return false;
+
+      // the buffer is moved into the node
+      interval_tree<int, std::vector<char> > buffers;
+      std::vector<char> buffer( 4096 );
+      const char *data = buffer.data();
+      return buffers.insert( 0, 10, std::move( buffer ) ).first->value.data() == data;
+    }
+
+    bool test_comparator()
+    {
+      // the ends at the limits of int64_t, where the sums and the
+      // differences of the ends would overflow
+      const int64_t min = std::numeric_limits<int64_t>::min();
+      const int64_t max = std::numeric_limits<int64_t>::max();
+      interval_tree<int64_t, int> wide;
+      wide.insert( min, max, 0 );
+      wide.insert( max - 10, max, 1 );
+      wide.insert( min, min + 10, 2 );
+      wide.insert( -5, 5, 3 );
+      if( wide.count_overlaps( max - 1, max ) != 2 || wide.count_overlaps( min, min + 1 ) != 2 ||
+          wide.count_overlaps( min, max ) != 4 || wide.count_overlaps( 5, max - 10 ) != 1 || wide.query( min + 10, -5 ).size() != 1 )
+        return false;
+
+      // timestamps above the range of int64_t
+      const uint64_t now = std::numeric_limits<uint64_t>::max() - 1000;
+      interval_tree<uint64_t, int> stamps;
+      stamps.insert( now, now + 100, 0 );
+      stamps.insert( now + 50, now + 1000, 1 );
+      stamps.insert( 0, now, 2 );
+      if( stamps.count_overlaps( now + 99, now + 100 ) != 2 || stamps.count_overlaps( now - 1, now + 1 ) != 2 || stamps.query( now + 100, now + 1000 ).size() != 1 )
+        return false;
+
+      interval_tree<double, int> real;
+      real.insert( 0.5, 1.5, 0 );
+      real.insert( 1.25, 2.0, 1 );
+      real.insert( -1e300, 1e300, 2 );
+      std::vector<interval_tree<double, int>::iterator> hits;
+      real.stab( 1.3, std::back_inserter( hits ) );
+      if( hits.size() != 3 || real.count_overlaps( 1.5, 1.75 ) != 2 || real.count_overlaps( 2.0, 3.0 ) != 1 )
+        return false;
+
+      // the reversed order: the intervals run from a greater number down
+      // to a smaller one, compared against a model with the order spelt out
+      return test_reversed< ordered_interval_tree<int, int, std::greater<int> > >() &&
+             test_reversed< compact_interval_tree<int, int, std::greater<int> > >();
+    }
+
+    bool test_compact()
+    {
+      typedef compact_interval_tree<int, std::string> lean_t;
+      typedef compact_interval_tree<int, std::string, std::less<int>, interval_summary<int> > counted_t;
+
+      // the counts are opt-in, since they make the nodes bigger
+      if( !( sizeof( interval_node_t<int, int, index_links, std::less<int>, interval_max<int> > ) < sizeof( interval_node_t<int, int, index_links> ) ) )
+        return false;
+
+      return test_compact<lean_t>() && test_compact<counted_t>();
+    }
+
+    template<typename TREE>
+    bool test_compact()
+    {
+      TREE compact;
+      std::set< std::pair<int, int> > intervals;
+
+      srand( time( NULL ) );
+
+      for( int i = 0; i < 5000; ++i )
+      {
+        int l = rand() % 1000;
+        int h = l + rand() % 100 + 1;
+        if( rand() % 3 )
+        {
+          compact.insert( l, h, "" );
+          intervals.insert( std::make_pair( l, h ) );
+        }
+        else
+        {
+          // the first interval starting at l
+          std::set< std::pair<int, int> >::iterator itr = intervals.lower_bound( std::make_pair( l, INT_MIN ) );
+          if( itr == intervals.end() || itr->first != l ) continue;
+          compact.erase( l, itr->second );
+          intervals.erase( itr );
+        }
+      }
+
+      if( !test_rb_invariant( compact, compact.tree_root ).first || !test_invariant( compact, compact.tree_root ) )
+        return false;
+
+      for( int i = 0; i < 100; ++i )
+      {
+        int l = rand() % 1100;
+        int h = l + rand() % 20 + 1;
+        size_t count = 0, contained = 0;
+        for( std::set< std::pair<int, int> >::iterator itr = intervals.begin(); itr != intervals.end(); ++itr )
+        {
+          if( itr->first < h && l < itr->second ) ++count;
+          if( l <= itr->first && itr->second <= h + 50 ) ++contained;
+        }
+        if( compact.query( l, h ).size() != count || compact.count_overlaps( l, h ) != count )
+          return false;
+        size_t hits = 0;
+        compact.query_contained( l, h + 50, [&hits]( const typename TREE::iterator& ) { ++hits; return true; } );
+        if( hits != contained )
+          return false;
+      }
+
+      return true;
+    }
+
+    bool test_build_from_sorted()
+    {
+      std::vector< std::tuple<int, int, std::string> > sorted;
+
+      srand( time( NULL ) );
+
+      for( int i = 0; i < 50000; ++i )
+        sorted.push_back( std::make_tuple( i * 2, i * 2 + rand() % 100 + 1, "" ) );
+
+      for( unsigned threads = 1; threads <= 4; threads *= 4 )
+      {
+        tree.build_from_sorted( sorted.begin(), sorted.end(), threads );
+
+        if( tree.size() != sorted.size() || !test_rb_invariant( tree, tree.tree_root ).first || !test_invariant( tree, tree.tree_root ) )
+          return false;
+
+        for( int i = 0; i < 100; ++i )
+        {
+          int l = rand() % 100100;
+          int h = l + rand() % 20 + 1;
+          size_t count = 0;
+          for( size_t j = 0; j < sorted.size(); ++j )
+            if( std::get<0>( sorted[j] ) < h && l < std::get<1>( sorted[j] ) ) ++count;
+          if( tree.count_overlaps( l, h ) != count || tree.query( l, h ).size() != count )
+            return false;
+        }
+      }
+
+      return true;
+    }
+
+    bool test_batch()
+    {
+      std::set< std::pair<int, int> > intervals;
+
+      clear();
+      srand( time( NULL ) );
+
+      // the small batches go one by one, the big ones are merged
+      const size_t sizes[] = { 1, 16, 300, 5000 };
+      for( int round = 0; round < 40; ++round )
+      {
+        size_t n = sizes[round % 4];
+
+        std::vector< std::tuple<int, int, std::string> > inserted;
+        for( size_t i = 0; i < n; ++i )
+        {
+          int l = rand() % 20000;
+          int h = l + rand() % 100 + 1;
+          inserted.push_back( std::make_tuple( l, h, "" ) );
+          intervals.insert( std::make_pair( l, h ) );
+        }
+        tree.insert_batch( inserted.begin(), inserted.end() );
+
+        // every other one has the wrong high and (most likely) stays
+        std::vector< std::pair<int, int> > erased;
+        for( size_t i = 0; i < n / 2; ++i )
+        {
+          int l = rand() % 20000;
+          std::set< std::pair<int, int> >::iterator itr = intervals.lower_bound( std::make_pair( l, INT_MIN ) );
+          if( itr == intervals.end() || itr->first != l ) continue;
+          erased.push_back( std::make_pair( l, itr->second + int( i % 2 ) ) );
+        }
+        tree.erase_batch( erased.begin(), erased.end() );
+        for( size_t i = 0; i < erased.size(); ++i )
+          intervals.erase( erased[i] );
+
+        if( tree.size() != intervals.size() || !test_rb_invariant( tree, tree.tree_root ).first || !test_invariant( tree, tree.tree_root ) )
+          return false;
+
+        for( int i = 0; i < 10; ++i )
+        {
+          int l = rand() % 20100;
+          int h = l + rand() % 20 + 1;
+          size_t count = 0;
+          for( std::set< std::pair<int, int> >::iterator itr = intervals.begin(); itr != intervals.end(); ++itr )
+            if( itr->first < h && l < itr->second ) ++count;
+          if( tree.count_overlaps( l, h ) != count )
+            return false;
+        }
+      }
+
+      return true;
+    }
+
+    bool test_split_join()
+    {
+      std::set< std::pair<int, int> > intervals;
+
+      clear();
+      srand( time( NULL ) );
+
+      for( int i = 0; i < 3000; ++i )
+      {
+        int l = rand() % 10000;
+        int h = l + rand() % 500 + 1;
+        tree.insert( l, h, "" );
+        intervals.insert( std::make_pair( l, h ) );
+      }
+
+      for( int round = 0; round < 50; ++round )
+      {
+        // evict a window, the max of the rest has to shrink accordingly
+        int first = rand() % 10000;
+        int last = first + rand() % 1000;
+        interval_tree<int, std::string>::subtree window = tree.extract_range( first, last );
+        // all the intervals with low in [ first, last )
+        std::pair<int, int> from( first, INT_MIN ), to( last, INT_MIN );
+        std::set< std::pair<int, int> > extracted( intervals.lower_bound( from ), intervals.lower_bound( to ) );
+        intervals.erase( intervals.lower_bound( from ), intervals.lower_bound( to ) );
+
+        if( tree.size() != intervals.size() || window.size() != extracted.size() )
+          return false;
+        if( !test_rb_invariant( tree, tree.tree_root ).first || !test_invariant( tree, tree.tree_root ) || !test_invariant( tree, window.root ) )
+          return false;
+
+        for( int i = 0; i < 10; ++i )
+        {
+          int l = rand() % 10600;
+          int h = l + rand() % 20 + 1;
+          size_t count = 0;
+          for( std::set< std::pair<int, int> >::iterator itr = intervals.begin(); itr != intervals.end(); ++itr )
+            if( itr->first < h && l < itr->second ) ++count;
+          if( tree.count_overlaps( l, h ) != count || tree.query( l, h ).size() != count )
+            return false;
+        }
+
+        // every other window goes back
+        if( round % 2 )
+        {
+          tree.join( std::move( window ) );
+          intervals.insert( extracted.begin(), extracted.end() );
+        }
+      }
+
+      return test_rb_invariant( tree, tree.tree_root ).first && test_invariant( tree, tree.tree_root ) && tree.size() == intervals.size();
+    }
+
+    bool test_set_operations()
+    {
+      srand( time( NULL ) );
+
+      for( int round = 0; round < 12; ++round )
+      {
+        std::set< std::pair<int, int> > a, b, expected;
+        interval_tree<int, std::string> other;
+        // index links, so the threads mustn't see the pool grow
+        compact_interval_tree<int, std::string> compact, compact_other;
+        clear();
+        // one union big enough to be split between the threads
+        int n = round == 3 ? 1 << 20 : 20000;
+        for( int i = 0; i < n; ++i )
+        {
+          int l = rand() % ( 3 * n );
+          int h = l + rand() % 200 + 1;
+          if( a.insert( std::make_pair( l, h ) ).second )
+          {
+            tree.insert( l, h, "" );
+            compact.insert( l, h, "" );
+          }
+          // a third of the shared lows has the same high
+          l = rand() % ( 3 * n );
+          h = l + rand() % 200 + 1;
+          std::set< std::pair<int, int> >::iterator shared = a.lower_bound( std::make_pair( l, INT_MIN ) );
+          if( shared != a.end() && shared->first == l && rand() % 3 == 0 ) h = shared->second;
+          if( b.insert( std::make_pair( l, h ) ).second )
+          {
+            other.insert( l, h, "" );
+            compact_other.insert( l, h, "" );
+          }
+        }
+
+        unsigned threads = round % 2 ? 4 : 1;
+        switch( round % 3 )
+        {
+          case 0:
+            tree.union_with( other, threads );
+            compact.union_with( compact_other, threads );
+            expected = a;
+            expected.insert( b.begin(), b.end() );
+            break;
+          case 1:
+            tree.intersection_with( other, threads );
+            compact.intersection_with( compact_other, threads );
+            for( std::set< std::pair<int, int> >::iterator itr = a.begin(); itr != a.end(); ++itr )
+              if( b.count( *itr ) ) expected.insert( *itr );
+            break;
+          default:
+            tree.difference_with( other, threads );
+            compact.difference_with( compact_other, threads );
+            for( std::set< std::pair<int, int> >::iterator itr = a.begin(); itr != a.end(); ++itr )
+              if( !b.count( *itr ) ) expected.insert( *itr );
+        }
+
+        if( tree.size() != expected.size() || !test_rb_invariant( tree, tree.tree_root ).first || !test_invariant( tree, tree.tree_root ) )
+          return false;
+        if( compact.size() != expected.size() || !test_rb_invariant( compact, compact.tree_root ).first || !test_invariant( compact, compact.tree_root ) )
+          return false;
+        std::set< std::pair<int, int> >::iterator e = expected.begin();
+        for( compact_interval_tree<int, std::string>::iterator itr = compact.begin(); itr != compact.end(); ++itr, ++e )
+          if( itr->low != e->first || itr->high != e->second )
+            return false;
+
+        for( int i = 0; i < 20; ++i )
+        {
+          int l = rand() % ( 3 * n + 300 );
+          int h = l + rand() % 20 + 1;
+          size_t count = 0;
+          for( std::set< std::pair<int, int> >::iterator itr = expected.begin(); itr != expected.end(); ++itr )
+            if( itr->first < h && l < itr->second ) ++count;
+          if( tree.count_overlaps( l, h ) != count )
+            return false;
+        }
+      }
+
+      return true;
+    }
+
+    bool test_concurrent()
+    {
+      srand( time( NULL ) );
+
+      // long intervals reach across several shards
+      concurrent_interval_tree<int, int> sharded( 0, 10000, 8 );
+      std::map<int, int> expected;
+      for( int i = 0; i < 5000; ++i )
+      {
+        int l = rand() % 10000;
+        int h = l + ( rand() % 10 ? rand() % 50 + 1 : rand() % 5000 + 1 );
+        if( rand() % 3 )
+        {
+          if( expected.insert( std::make_pair( l, h ) ).second )
+            sharded.insert( l, h, h );
+        }
+        else if( expected.count( l ) )
+        {
+          sharded.erase( l, expected[l] );
+          expected.erase( l );
+        }
+      }
+
+      if( sharded.size() != expected.size() )
+        return false;
+
+      for( int i = 0; i < 500; ++i )
+      {
+        int l = rand() % 11000;
+        int h = l + rand() % 100 + 1;
+        std::vector< std::pair<int, int> > hits, brute;
+        sharded.query( l, h, [&]( const concurrent_interval_tree<int, int>::iterator &itr )
+        {
+          hits.push_back( std::make_pair( itr->low, itr->high ) );
+          return true;
+        } );
+        for( std::map<int, int>::iterator itr = expected.begin(); itr != expected.end(); ++itr )
+          if( itr->first < h && l < itr->second ) brute.push_back( *itr );
+        if( hits != brute || sharded.count_overlaps( l, h ) != brute.size() || sharded.has_overlap( l, h ) != !brute.empty() )
+          return false;
+      }
+
+      // shards over the whole range of int, whose width doesn't fit
+      // into an int
+      concurrent_interval_tree<int, int> wide( INT_MIN, INT_MAX, 8 );
+      if( wide.shard_count() != 8 )
+        return false;
+      const int ends[] = { INT_MIN, INT_MIN / 2, -1, 0, INT_MAX / 2, INT_MAX - 1 };
+      for( size_t i = 0; i < sizeof( ends ) / sizeof( ends[0] ); ++i )
+        wide.insert( ends[i], ends[i] + 1, ends[i] );
+      if( wide.count_overlaps( INT_MIN, INT_MAX ) != 6 || wide.count_overlaps( -1, 1 ) != 2 || wide.count_overlaps( INT_MAX - 1, INT_MAX ) != 1 )
+        return false;
+
+      // the writers only touch the odd lows, so the readers have
+      // to see every interval with an even low all the time
+      concurrent_interval_tree<int, int> tree( 0, 10000, 8 );
+      std::map<int, int> stable;
+      for( int l = 0; l < 10000; l += 2 )
+      {
+        int h = l + ( l % 100 ? 20 : 3000 );
+        stable[l] = h;
+        tree.insert( l, h, h );
+      }
+
+      std::atomic<bool> stop( false );
+      std::atomic<int> errors( 0 );
+      std::vector<std::thread> threads;
+      for( int t = 0; t < 2; ++t )
+        threads.push_back( std::thread( [&, t]()
+        {
+          std::mt19937 gen( t );
+          for( int i = 0; i < 20000; ++i )
+          {
+            int l = int( gen() % 5000 ) * 2 + 1;
+            if( gen() % 2 )
+              tree.insert( l, l + 10, l + 10 );
+            else
+              tree.erase( l, l + 10 );
+          }
+        } ) );
+      for( int t = 0; t < 4; ++t )
+        threads.push_back( std::thread( [&, t]()
+        {
+          std::mt19937 gen( 100 + t );
+          while( !stop )
+          {
+            int l = int( gen() % 11000 ), h = l + int( gen() % 200 ) + 1;
+            size_t count = 0;
+            int previous = -1;
+            tree.query( l, h, [&]( const concurrent_interval_tree<int, int>::iterator &itr )
+            {
+              if( itr->low <= previous || itr->value != itr->high ) ++errors;
+              previous = itr->low;
+              if( itr->low % 2 == 0 ) ++count;
+              return true;
+            } );
+            size_t brute = 0;
+            for( std::map<int, int>::iterator itr = stable.begin(); itr != stable.end() && itr->first < h; ++itr )
+              if( l < itr->second ) ++brute;
+            if( count != brute ) ++errors;
+          }
+        } ) );
+
+      for( int t = 0; t < 2; ++t )
+        threads[t].join();
+      stop = true;
+      for( size_t t = 2; t < threads.size(); ++t )
+        threads[t].join();
+
+      return !errors;
+    }
+
+    bool test_frozen()
+    {
+      typedef interval_tree<int, std::string>::iterator iterator;
+
+      srand( time( NULL ) );
+
+      for( int n = 0; n <= 20000; n = n * 4 + 1 )
+      {
+        clear();
+        for( int i = 0; i < n; ++i )
+        {
+          int l = rand() % 50000;
+          int h = l + ( rand() % 10 ? rand() % 50 + 1 : rand() % 10000 + 1 );
+          std::stringstream ss;
+          ss << "(" << l << ", " << h << ")";
+          tree.insert( l, h, ss.str() );
+        }
+
+        frozen_interval_tree<int, std::string> frozen( tree );
+        // more levels
+        frozen_interval_tree<int, std::string, 2> narrow( tree );
+        if( frozen.size() != tree.size() || narrow.size() != tree.size() )
+          return false;
+
+        for( int i = 0; i < 200; ++i )
+        {
+          int l = rand() % 52000;
+          int h = l + rand() % 100 + 1;
+          std::vector<iterator> expected;
+          tree.query( l, h, std::back_inserter( expected ) );
+
+          std::vector<const frozen_interval_tree<int, std::string>::entry*> hits = frozen.query( l, h );
+          if( hits.size() != expected.size() || frozen.count_overlaps( l, h ) != expected.size() )
+            return false;
+          for( size_t j = 0; j < hits.size(); ++j )
+            if( hits[j]->low != expected[j]->low || hits[j]->high != expected[j]->high || hits[j]->value != expected[j]->value )
+              return false;
+
+          size_t count = 0;
+          narrow.query( l, h, [&count]( const frozen_interval_tree<int, std::string, 2>::entry& ) { ++count; return true; } );
+          if( count != expected.size() || narrow.count_overlaps( l, h ) != count || narrow.has_overlap( l, h ) != !expected.empty() )
+            return false;
+        }
+      }
+
+      // from sorted tuples
+      std::vector< std::tuple<int, int, int> > sorted;
+      sorted.push_back( std::make_tuple( 1, 12, 0 ) );
+      sorted.push_back( std::make_tuple( 2, 8, 1 ) );
+      sorted.push_back( std::make_tuple( 5, 10, 2 ) );
+      frozen_interval_tree<int, int> frozen( sorted.begin(), sorted.end() );
+      if( frozen.count_overlaps( 9, 11 ) != 2 || frozen.has_overlap( 12, 14 ) )
+        return false;
+
+      std::swap( sorted[0], sorted[2] );
+      try
+      {
+        frozen_interval_tree<int, int> unsorted( sorted.begin(), sorted.end() );
+        return false;
+      }
+      catch( const std::invalid_argument& ) { }
+
+      return true;
+    }
+
+    bool test_mapped()
+    {
+      typedef frozen_interval_tree<int64_t, int, 4>::entry entry;
+
+      std::stringstream ss;
+      ss << "/tmp/interval_tree_tester." << getpid() << ".frozen";
+      const std::string path = ss.str();
+      srand( time( NULL ) );
+
+      for( int n = 0; n <= 20000; n = n * 4 + 1 )
+      {
+        std::vector< std::tuple<int64_t, int64_t, int> > sorted;
+        for( int i = 0; i < n; ++i )
+        {
+          int64_t l = rand() % 50000;
+          sorted.push_back( std::make_tuple( l, l + rand() % 100 + 1, i ) );
+        }
+        std::sort( sorted.begin(), sorted.end() );
+        frozen_interval_tree<int64_t, int, 4> frozen( sorted.begin(), sorted.end() );
+        frozen.save( path );
+        mapped_interval_tree<int64_t, int, 4> mapped( path );
+        if( mapped.size() != frozen.size() || !std::equal( mapped.begin(), mapped.end(), frozen.begin(), &test_same_entry<entry> ) )
+          return false;
+
+        for( int i = 0; i < 200; ++i )
+        {
+          int64_t l = rand() % 52000;
+          int64_t h = l + rand() % 100 + 1;
+          std::vector<const entry*> expected = frozen.query( l, h );
+          std::vector<const entry*> hits = mapped.query( l, h );
+          if( hits.size() != expected.size() || mapped.count_overlaps( l, h ) != expected.size() || mapped.has_overlap( l, h ) != !expected.empty() )
+            return false;
+          for( size_t j = 0; j < hits.size(); ++j )
+            if( !test_same_entry( *hits[j], *expected[j] ) )
+              return false;
+        }
+
+        // moved, and still mapped after the file has been replaced
+        mapped_interval_tree<int64_t, int, 4> moved( std::move( mapped ) );
+        frozen_interval_tree<int64_t, int, 4>().save( path );
+        if( !mapped.empty() || moved.size() != frozen.size() || moved.count_overlaps( 0, 60000 ) != frozen.size() )
+          return false;
+      }
+
+      // another fanout, other types and a truncated file are refused
+      std::vector< std::tuple<int64_t, int64_t, int> > sorted( 100, std::make_tuple( 1, 2, 3 ) );
+      frozen_interval_tree<int64_t, int, 4>( sorted.begin(), sorted.end() ).save( path );
+      int refused = 0;
+      try { mapped_interval_tree<int64_t, int, 8> mapped( path ); } catch( const std::runtime_error& ) { ++refused; }
+      try { mapped_interval_tree<uint64_t, int, 4> mapped( path ); } catch( const std::runtime_error& ) { ++refused; }
+      try { mapped_interval_tree<int64_t, int64_t, 4> mapped( path ); } catch( const std::runtime_error& ) { ++refused; }
+      if( truncate( path.c_str(), 1000 ) != 0 ) return false;
+      try { mapped_interval_tree<int64_t, int, 4> mapped( path ); } catch( const std::runtime_error& ) { ++refused; }
+      unlink( path.c_str() );
+      try { mapped_interval_tree<int64_t, int, 4> mapped( path ); } catch( const std::runtime_error& ) { ++refused; }
+
+      return refused == 5;
+    }
+
+    bool test_query_batch()
+    {
+      typedef interval_tree<int, std::string>::iterator iterator;
+
+      clear();
+      srand( time( NULL ) );
+
+      for( int i = 0; i < 20000; ++i )
+      {
+        int l = rand() % 100000;
+        int h = l + ( rand() % 10 ? rand() % 100 + 1 : rand() % 10000 + 1 );
+        tree.insert( l, h, "" );
+      }
+
+      for( int round = 0; round < 4; ++round )
+      {
+        std::vector< std::pair<int, int> > queries;
+        for( int i = 0; i < 5000; ++i )
+        {
+          int l = rand() % 110000;
+          queries.push_back( std::make_pair( l, l + rand() % 200 + 1 ) );
+        }
+        if( round % 2 ) std::sort( queries.begin(), queries.end() );
+
+        // every query has a slot of its own, so no locking
+        std::vector< std::vector<int> > hits( queries.size() );
+        tree.query_batch( queries.begin(), queries.end(), [&hits]( size_t q, const iterator &itr )
+        {
+          hits[q].push_back( itr->low );
+        }, round < 2 ? 1 : 4 );
+
+        for( size_t q = 0; q < queries.size(); ++q )
+        {
+          std::vector<int> expected;
+          tree.query( queries[q].first, queries[q].second, [&expected]( const iterator &itr ) { expected.push_back( itr->low ); return true; } );
+          if( hits[q] != expected )
+            return false;
+        }
+      }
+
+      // a throwing sink gets its exception back out of the
+      // parallel runs (rather than terminating the process)
+      std::vector< std::pair<int, int> > queries;
+      for( int i = 0; i < 5000; ++i )
+        queries.push_back( std::make_pair( i * 20, i * 20 + 50 ) );
+      for( unsigned threads = 1; threads <= 4; threads *= 4 )
+      {
+        bool thrown = false;
+        try
+        {
+          tree.query_batch( queries.begin(), queries.end(), []( size_t q, const iterator& )
+          {
+            if( q == 4000 ) throw std::runtime_error( "sink" );
+          }, threads );
+        }
+        catch( const std::runtime_error& )
+        {
+          thrown = true;
+        }
+        if( !thrown ) return false;
+      }
+
+      return true;
+    }
+
+    bool test_join_overlaps()
+    {
+      typedef interval_tree<int, std::string>::iterator iterator;
+      typedef compact_interval_tree<int, int>::iterator other_iterator;
+
+      srand( time( NULL ) );
+
+      for( int round = 0; round < 6; ++round )
+      {
+        clear();
+        compact_interval_tree<int, int> other;
+        for( int i = 0; i < 3000; ++i )
+        {
+          int l = rand() % 100000;
+          tree.insert( l, l + ( rand() % 10 ? rand() % 100 + 1 : rand() % 5000 + 1 ), "" );
+          l = rand() % 100000;
+          other.insert( l, l + ( rand() % 10 ? rand() % 100 + 1 : rand() % 5000 + 1 ), l );
+        }
+
+        typedef std::tuple<int, int, int, int> pair_t;
+        std::set<pair_t> expected;
+        for( iterator itr = tree.begin(); itr != tree.end(); ++itr )
+          other.query( itr->low, itr->high, [&]( const other_iterator &o )
+          {
+            expected.insert( std::make_tuple( itr->low, itr->high, o->low, o->high ) );
+            return true;
+          } );
+
+        std::mutex mutex;
+        std::vector<pair_t> pairs;
+        join_overlaps( tree, other, [&]( const iterator &a, const other_iterator &b )
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          pairs.push_back( std::make_tuple( a->low, a->high, b->low, b->high ) );
+        }, round % 2 ? 4 : 1 );
+
+        // every pair once
+        std::sort( pairs.begin(), pairs.end() );
+        if( pairs.size() != expected.size() || !std::equal( pairs.begin(), pairs.end(), expected.begin() ) )
+          return false;
+      }
+
+      return true;
+    }
+
+    // every kernel the CPU supports against the scalar one
+    bool test_overlap_kernel()
+    {
+      return test_overlap_kernel<int32_t>() && test_overlap_kernel<int64_t>();
+    }
+
     void clear()
     {
       tree.clear();
@@ -131,34 +1080,123 @@ class interval_tree_tester
 
   private:
 
-    void print( const std::unique_ptr< interval_node_t<int, std::string> > &root, const std::string &indent = "" )
+    template<typename N>
+    static bool node_less( const N &x, const N &y )
+    {
+      return x.low < y.low || ( x.low == y.low && x.high < y.high );
+    }
+
+    template<typename E>
+    static bool test_same_entry( const E &a, const E &b )
+    {
+      return a.low == b.low && a.high == b.high && a.value == b.value;
+    }
+
+    template<typename TREE>
+    static bool test_reversed()
+    {
+      std::mt19937 gen( time( NULL ) );
+      TREE reversed;
+      std::set< std::pair<int, int> > intervals;
+      for( int i = 0; i < 2000; ++i )
+      {
+        int low = gen() % 1000, high = low - 1 - int( gen() % 50 );
+        reversed.insert( low, high, i );
+        intervals.insert( std::make_pair( low, high ) );
+      }
+      if( reversed.size() != intervals.size() )
+        return false;
+
+      // in descending order of low and then of high
+      int low = std::numeric_limits<int>::max(), high = std::numeric_limits<int>::max();
+      for( typename TREE::iterator itr = reversed.begin(); itr != reversed.end(); ++itr )
+      {
+        if( itr->low > low || ( itr->low == low && itr->high >= high ) )
+          return false;
+        low = itr->low;
+        high = itr->high;
+      }
+
+      for( int round = 0; round < 200; ++round )
+      {
+        int qlow = gen() % 1100 - 50, qhigh = qlow - int( gen() % 100 );
+        size_t expected = 0;
+        for( std::set< std::pair<int, int> >::const_iterator itr = intervals.begin(); itr != intervals.end(); ++itr )
+          if( qlow > itr->second && itr->first > qhigh ) ++expected;
+        std::vector<typename TREE::iterator> hits;
+        reversed.query( qlow, qhigh, std::back_inserter( hits ) );
+        if( hits.size() != expected || reversed.count_overlaps( qlow, qhigh ) != expected )
+          return false;
+        for( size_t i = 0; i < hits.size(); ++i )
+          if( !( qlow > hits[i]->high && hits[i]->low > qhigh ) )
+            return false;
+      }
+      return true;
+    }
+
+    template<typename I>
+    static bool test_overlap_kernel()
+    {
+      std::mt19937 gen( time( NULL ) );
+      // small values, so that the ends often meet, and the extremes
+      const I extremes[] = { std::numeric_limits<I>::min(), std::numeric_limits<I>::max(), I( 0 ), I( -1 ) };
+      std::vector<I> lows( 64 ), highs( 64 );
+      for( int round = 0; round < 2000; ++round )
+      {
+        for( size_t i = 0; i < 64; ++i )
+        {
+          lows[i] = gen() % 8 ? I( int( gen() % 100 ) - 50 ) : extremes[gen() % 4];
+          highs[i] = gen() % 8 ? I( int( gen() % 100 ) - 50 ) : extremes[gen() % 4];
+        }
+        I low = gen() % 8 ? I( int( gen() % 100 ) - 50 ) : extremes[gen() % 4];
+        I high = gen() % 8 ? I( int( gen() % 100 ) - 50 ) : extremes[gen() % 4];
+
+        for( size_t n = 0; n <= 64; ++n )
+        {
+          uint64_t expected = overlap_mask_scalar( &lows[0], &highs[0], n, low, high );
+          if( overlap_mask( &lows[0], &highs[0], n, low, high ) != expected )
+            return false;
+#ifdef OVERLAP_KERNEL_X86
+          if( overlap_isa() >= AVX2_ISA && overlap_mask_avx2( &lows[0], &highs[0], n, low, high ) != expected )
+            return false;
+          if( overlap_isa() >= AVX512_ISA && overlap_mask_avx512( &lows[0], &highs[0], n, low, high ) != expected )
+            return false;
+#endif
+        }
+      }
+      return true;
+    }
+
+    template<typename TREE, typename N>
+    void print( const TREE &t, const N *root, const std::string &indent = "" )
     {
       if( !root ) return;
 
-      print( root->right, indent + "  " );
-      std::string colour = root->colour ? "(R)" : "(B)";
+      print( t, t.right_of( root ), indent + "  " );
+      std::string colour = t.colour_of( root ) ? "(R)" : "(B)";
       std::cout << indent << root->value << colour << std::endl;
-      print( root->left, indent + "  " );
+      print( t, t.left_of( root ), indent + "  " );
     }
 
-    static std::pair<bool, int> test_rb_invariant( const std::unique_ptr< interval_node_t<int, std::string> > &root )
+    template<typename TREE, typename N>
+    static std::pair<bool, int> test_rb_invariant( const TREE &t, const N *root )
     {
       // base case
       if( !root )
         return std::make_pair( true, 0 );
 
       int black = 0;
-      if( root->colour == RED )
+      if( t.colour_of( root ) == RED )
       {
         // RED node cannot have RED children
-        if( ( root->left && root->left->colour == RED ) || ( root->right && root->right->colour == RED ) )
+        if( t.colour_of( t.left_of( root ) ) == RED || t.colour_of( t.right_of( root ) ) == RED )
           return std::make_pair( false, -1 );
       }
       else
         black += 1;
 
-      std::pair<bool, int> l = test_rb_invariant( root->left );
-      std::pair<bool, int> r = test_rb_invariant( root->right );
+      std::pair<bool, int> l = test_rb_invariant( t, t.left_of( root ) );
+      std::pair<bool, int> r = test_rb_invariant( t, t.right_of( root ) );
 
       if( !l.first || !r.first )
         return std::make_pair( false, -1 );
@@ -169,26 +1207,60 @@ class interval_tree_tester
       return std::make_pair( true, l.second + black );
     }
 
-    static bool test_invariant( const std::unique_ptr< interval_node_t<int, std::string> > &root )
+    template<typename TREE, typename N>
+    static bool test_invariant( const TREE &t, const N *root )
     {
       // base case
       if( !root )
         return true;
 
+      const N *left = t.left_of( root );
+      const N *right = t.right_of( root );
+
+      // the summary of the subtree
+      auto summary = t.summary_of( root );
+
       // max has to be >= high
-      if( root->max < root->high )
+      if( summary.max < root->high )
         return false;
 
       // max has to be >= left->max
-      if( root->left && root->max < root->left->max )
+      if( left && summary.max < t.summary_of( left ).max )
         return false;
 
       // max has to be >= right->max
-      if( root->right && root->max < root->right->max )
+      if( right && summary.max < t.summary_of( right ).max )
+        return false;
+
+      if( !test_counts( t, root, std::integral_constant<bool, N::augmentation::counted>() ) )
         return false;
 
       // test children
-      return test_invariant( root->left ) && test_invariant( root->right );
+      return test_invariant( t, left ) && test_invariant( t, right );
+    }
+
+    template<typename TREE, typename N>
+    static bool test_counts( const TREE &t, const N *root, std::true_type )
+    {
+      const N *left = t.left_of( root );
+      const N *right = t.right_of( root );
+      auto summary = t.summary_of( root );
+
+      // min_high has to be <= high, left->min_high and right->min_high
+      if( root->high < summary.min_high ||
+          ( left && t.summary_of( left ).min_high < summary.min_high ) ||
+          ( right && t.summary_of( right ).min_high < summary.min_high ) )
+        return false;
+
+      // count is the size of the subtree
+      return summary.count == 1 + ( left ? t.summary_of( left ).count : 0 ) + ( right ? t.summary_of( right ).count : 0 );
+    }
+
+    // interval_max has nothing but the max
+    template<typename TREE, typename N>
+    static bool test_counts( const TREE&, const N*, std::false_type )
+    {
+      return true;
     }
 
     interval_tree<int, std::string> tree;
@@ -0,0 +1,256 @@
+/*
+ * mapped_interval_tree.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef MAPPED_INTERVAL_TREE_HH_
+#define MAPPED_INTERVAL_TREE_HH_
+
+#include "frozen_interval_tree.hh"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a frozen_interval_tree saved to a file (frozen_interval_tree::save),
+// mapped read-only and queried straight from the mapped pages:
+//
+// - opening it reads nothing but the header, the pages of the arrays
+//   are faulted in by the queries that touch them, so there is no
+//   deserialisation and no allocation per interval
+// - the mapping is shared, so all the processes that map the same
+//   file share one copy of it in the page cache
+// - I, V and B have to be the ones the file has been saved with,
+//   otherwise (or if the file is not a frozen tree of this version,
+//   is truncated or comes from a machine of the other byte order)
+//   std::runtime_error is thrown
+//
+// POSIX only (mmap)
+template<typename I, typename V, size_t B = 16>
+class mapped_interval_tree : public frozen_query<mapped_interval_tree<I, V, B>, I, frozen_entry<I, V>, B>
+{
+    static_assert( std::is_trivially_copyable<I>::value && std::is_trivially_copyable<V>::value, "only trivially copyable ends and values can be mapped" );
+    static_assert( alignof( frozen_entry<I, V> ) <= 64, "the arrays are aligned to 64 bytes" );
+
+    friend class frozen_query<mapped_interval_tree, I, frozen_entry<I, V>, B>;
+
+  public:
+
+    typedef frozen_entry<I, V> entry;
+
+    explicit mapped_interval_tree( const std::string &path ) : data( nullptr ), length( 0 ), entries( nullptr ), lows( nullptr ), highs( nullptr ), count( 0 )
+    {
+      int fd = ::open( path.c_str(), O_RDONLY );
+      if( fd < 0 ) fail( path, std::strerror( errno ) );
+      struct stat st;
+      if( ::fstat( fd, &st ) != 0 )
+      {
+        int error = errno;
+        ::close( fd );
+        fail( path, std::strerror( error ) );
+      }
+      length = size_t( st.st_size );
+      if( length < sizeof( frozen_file_header ) )
+      {
+        ::close( fd );
+        fail( path, "too short for a header" );
+      }
+      void *mapped = ::mmap( nullptr, length, PROT_READ, MAP_SHARED, fd, 0 );
+      int error = errno;
+      // the mapping keeps the file
+      ::close( fd );
+      if( mapped == MAP_FAILED ) fail( path, std::strerror( error ) );
+      data = static_cast<const char*>( mapped );
+
+      try
+      {
+        init( path );
+      }
+      catch( ... )
+      {
+        unmap();
+        throw;
+      }
+    }
+
+    mapped_interval_tree( mapped_interval_tree &&other ) : data( nullptr ), length( 0 ), entries( nullptr ), lows( nullptr ), highs( nullptr ), count( 0 )
+    {
+      swap( other );
+    }
+
+    mapped_interval_tree& operator=( mapped_interval_tree &&other )
+    {
+      if( this != &other )
+      {
+        unmap();
+        swap( other );
+      }
+      return *this;
+    }
+
+    mapped_interval_tree( const mapped_interval_tree& ) = delete;
+
+    mapped_interval_tree& operator=( const mapped_interval_tree& ) = delete;
+
+    ~mapped_interval_tree()
+    {
+      unmap();
+    }
+
+    size_t size() const
+    {
+      return count;
+    }
+
+    bool empty() const
+    {
+      return count == 0;
+    }
+
+    // the intervals in ascending order of low
+    typedef const entry* iterator;
+
+    iterator begin() const
+    {
+      return entries;
+    }
+
+    iterator end() const
+    {
+      return entries + count;
+    }
+
+  private:
+
+    // the header, and where the arrays are (and that they are all
+    // within the file)
+    void init( const std::string &path )
+    {
+      frozen_file_header header;
+      std::memcpy( &header, data, sizeof( header ) );
+      if( std::memcmp( header.magic, frozen_file_header::file_magic(), sizeof( header.magic ) ) != 0 )
+        fail( path, "not a frozen interval tree" );
+      if( header.version != frozen_file_header::current_version )
+        fail( path, "unsupported version" );
+      if( header.byte_order != frozen_file_header::byte_order_mark )
+        fail( path, "written on a machine of the other byte order" );
+      if( header.key_size != sizeof( I ) || header.key_kind != frozen_file_header::kind_of<I>() || header.value_size != sizeof( V ) || header.entry_size != sizeof( entry ) )
+        fail( path, "saved with other interval or value types" );
+      if( header.fanout != B )
+        fail( path, "saved with another fanout" );
+
+      std::vector<uint64_t> sizes = frozen_file_header::level_sizes( header.size, B );
+      if( header.levels != sizes.size() || header.size > length / sizeof( entry ) )
+        fail( path, "inconsistent header" );
+
+      uint64_t offset = frozen_file_header::align( sizeof( header ) );
+      entries = array<entry>( offset, header.size, path );
+      lows = array<I>( offset, header.size, path );
+      highs = array<I>( offset, header.size, path );
+      for( size_t k = 0; k < sizes.size(); ++k )
+      {
+        mins.push_back( array<I>( offset, sizes[k], path ) );
+        maxs.push_back( array<I>( offset, sizes[k], path ) );
+        widths.push_back( size_t( sizes[k] ) );
+      }
+      count = size_t( header.size );
+    }
+
+    template<typename T>
+    const T* array( uint64_t &offset, uint64_t n, const std::string &path ) const
+    {
+      if( offset + n * sizeof( T ) > length )
+        fail( path, "truncated" );
+      const T *begin = reinterpret_cast<const T*>( data + offset );
+      offset = frozen_file_header::align( offset + n * sizeof( T ) );
+      return begin;
+    }
+
+    static void fail( const std::string &path, const std::string &what )
+    {
+      throw std::runtime_error( "mapped_interval_tree: " + path + ": " + what );
+    }
+
+    void unmap()
+    {
+      if( data ) ::munmap( const_cast<char*>( data ), length );
+      data = nullptr;
+      length = 0;
+      entries = nullptr;
+      lows = highs = nullptr;
+      count = 0;
+      mins.clear();
+      maxs.clear();
+      widths.clear();
+    }
+
+    void swap( mapped_interval_tree &other )
+    {
+      std::swap( data, other.data );
+      std::swap( length, other.length );
+      std::swap( entries, other.entries );
+      std::swap( lows, other.lows );
+      std::swap( highs, other.highs );
+      std::swap( count, other.count );
+      mins.swap( other.mins );
+      maxs.swap( other.maxs );
+      widths.swap( other.widths );
+    }
+
+    const entry* leaf_entries() const
+    {
+      return entries;
+    }
+
+    const I* leaf_lows() const
+    {
+      return lows;
+    }
+
+    const I* leaf_highs() const
+    {
+      return highs;
+    }
+
+    size_t level_count() const
+    {
+      return mins.size();
+    }
+
+    const I* level_min( size_t level ) const
+    {
+      return mins[level];
+    }
+
+    const I* level_max( size_t level ) const
+    {
+      return maxs[level];
+    }
+
+    size_t level_size( size_t level ) const
+    {
+      return widths[level];
+    }
+
+    const char            *data;
+    size_t                 length;
+    const entry           *entries;
+    const I               *lows;
+    const I               *highs;
+    size_t                 count;
+    // the levels above the leaves, within the mapping
+    std::vector<const I*>  mins;
+    std::vector<const I*>  maxs;
+    std::vector<size_t>    widths;
+};
+
+#endif /* MAPPED_INTERVAL_TREE_HH_ */
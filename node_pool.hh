@@ -0,0 +1,398 @@
+/*
+ * node_pool.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef NODE_POOL_HH_
+#define NODE_POOL_HH_
+
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include <type_traits>
+
+enum colour_t
+{
+  RED = true,
+  BLACK = false
+};
+
+// links of a node stored as plain pointers
+template<typename N>
+struct pointer_links
+{
+    pointer_links() : colour( RED ), parent( nullptr ), left( nullptr ), right( nullptr ) { }
+
+    colour_t colour;
+    N* parent;
+    N* left;
+    N* right;
+};
+
+// pointer links plus the in-order neighbours of the node, so that
+// stepping an iterator is a single hop instead of a climb through
+// the parents (two more pointers per node, only with node_pool)
+template<typename N>
+struct threaded_links : pointer_links<N>
+{
+    threaded_links() : prev( nullptr ), next( nullptr ) { }
+
+    N* prev;
+    N* next;
+};
+
+// links of a node stored as 32-bit indices into
+// an index_node_pool (0 stands for null), the colour
+// is kept in the top bit of the parent index
+template<typename N>
+struct index_links
+{
+    static const uint32_t colour_bit = uint32_t( 1 ) << 31;
+    static const uint32_t index_mask = colour_bit - 1;
+
+    index_links() : parent_colour( colour_bit ), left( 0 ), right( 0 ) { }
+
+    uint32_t parent_colour;
+    uint32_t left;
+    uint32_t right;
+};
+
+// slab allocator for tree nodes:
+// - nodes are handed out from contiguous chunks of
+//   CHUNK_SIZE nodes each
+// - destroyed nodes are kept on a free list and reused
+//   by the next allocation
+// - all the memory is given back at once in release()
+//
+// CHUNK_SIZE = 1 degenerates to one heap allocation per
+// node (that's how the trees used to allocate nodes)
+//
+// the nodes have to use pointer_links (or threaded_links)
+template<typename N, size_t CHUNK_SIZE = 1024>
+class node_pool
+{
+  public:
+
+    typedef N node_type;
+
+    node_pool() : free_list( nullptr ), used( CHUNK_SIZE ) { }
+
+    node_pool( const node_pool& ) = delete;
+
+    node_pool& operator=( const node_pool& ) = delete;
+
+    ~node_pool()
+    {
+      release();
+    }
+
+    template<typename ... Args>
+    N* create( Args&& ... args )
+    {
+      slot_t *slot = allocate();
+      try
+      {
+        return new( slot ) N( std::forward<Args>( args )... );
+      }
+      catch( ... )
+      {
+        deallocate( slot );
+        throw;
+      }
+    }
+
+    void destroy( N *node )
+    {
+      node->~N();
+      deallocate( reinterpret_cast<slot_t*>( node ) );
+    }
+
+    // gives back all the chunks, the caller is responsible for
+    // calling the destructors of the nodes that are still alive
+    void release()
+    {
+      for( slot_t *chunk : chunks )
+        ::operator delete( chunk );
+      chunks.clear();
+      free_list = nullptr;
+      used = CHUNK_SIZE;
+    }
+
+    // nothing to do, the links are pointers so following
+    // them never looks at the chunks (see index_node_pool)
+    void reserve( size_t )
+    {
+    }
+
+    static N* parent( const N *node ) { return links( node ).parent; }
+    static N* left( const N *node ) { return links( node ).left; }
+    static N* right( const N *node ) { return links( node ).right; }
+    static colour_t colour( const N *node ) { return links( node ).colour; }
+
+    static void set_parent( N *node, N *parent ) { links( node ).parent = parent; }
+    static void set_left( N *node, N *left ) { links( node ).left = left; }
+    static void set_right( N *node, N *right ) { links( node ).right = right; }
+    static void set_colour( N *node, colour_t colour ) { links( node ).colour = colour; }
+
+    // only for nodes with threaded_links
+    static N* prev( const N *node ) { return threads( node ).prev; }
+    static N* next( const N *node ) { return threads( node ).next; }
+
+    static void set_prev( N *node, N *prev ) { threads( node ).prev = prev; }
+    static void set_next( N *node, N *next ) { threads( node ).next = next; }
+
+  private:
+
+    static const pointer_links<N>& links( const N *node ) { return *node; }
+    static pointer_links<N>& links( N *node ) { return *node; }
+
+    static const threaded_links<N>& threads( const N *node ) { return *node; }
+    static threaded_links<N>& threads( N *node ) { return *node; }
+
+    // a free slot holds the pointer to the next free slot
+    union slot_t
+    {
+      slot_t *next;
+      typename std::aligned_storage<sizeof( N ), alignof( N )>::type storage;
+    };
+
+    slot_t* allocate()
+    {
+      if( free_list )
+      {
+        slot_t *slot = free_list;
+        free_list = slot->next;
+        return slot;
+      }
+
+      if( used == CHUNK_SIZE )
+      {
+        slot_t *chunk = static_cast<slot_t*>( ::operator new( CHUNK_SIZE * sizeof( slot_t ) ) );
+        try
+        {
+          chunks.push_back( chunk );
+        }
+        catch( ... )
+        {
+          ::operator delete( chunk );
+          throw;
+        }
+        used = 0;
+      }
+
+      return chunks.back() + used++;
+    }
+
+    void deallocate( slot_t *slot )
+    {
+      slot->next = free_list;
+      free_list = slot;
+    }
+
+    std::vector<slot_t*> chunks;
+    slot_t              *free_list;
+    size_t               used;
+};
+
+// slab allocator for nodes with index_links:
+// - the nodes are numbered consecutively across all
+//   chunks, so they can refer to each other with
+//   32-bit indices (at most 2^31 - 1 nodes)
+// - each chunk is CHUNK_BYTES long (power of 2) and
+//   aligned to its size, the chunk number is kept at the
+//   beginning of the chunk so a node pointer can be turned
+//   into an index without storing the index in the node
+template<typename N, size_t CHUNK_BYTES = 65536>
+class index_node_pool
+{
+    static_assert( ( CHUNK_BYTES & ( CHUNK_BYTES - 1 ) ) == 0, "CHUNK_BYTES has to be a power of 2" );
+
+    struct chunk_header
+    {
+        uint32_t number;
+    };
+
+    // a free slot holds the index of the next free slot
+    union slot_t
+    {
+      uint32_t next;
+      typename std::aligned_storage<sizeof( N ), alignof( N )>::type storage;
+    };
+
+    static const size_t slots_offset = ( ( sizeof( chunk_header ) + alignof( slot_t ) - 1 ) / alignof( slot_t ) ) * alignof( slot_t );
+    static const size_t chunk_slots = ( CHUNK_BYTES - slots_offset ) / sizeof( slot_t );
+
+    static_assert( chunk_slots > 0, "CHUNK_BYTES too small for the node type" );
+
+    typedef index_links<N> links_t;
+
+  public:
+
+    typedef N node_type;
+
+    index_node_pool() : in_use( 0 ), free_list( 0 ), used( chunk_slots ) { }
+
+    index_node_pool( const index_node_pool& ) = delete;
+
+    index_node_pool& operator=( const index_node_pool& ) = delete;
+
+    ~index_node_pool()
+    {
+      release();
+    }
+
+    template<typename ... Args>
+    N* create( Args&& ... args )
+    {
+      uint32_t index = allocate();
+      try
+      {
+        return new( slot( index ) ) N( std::forward<Args>( args )... );
+      }
+      catch( ... )
+      {
+        deallocate( index );
+        throw;
+      }
+    }
+
+    void destroy( N *node )
+    {
+      uint32_t index = index_of( node );
+      node->~N();
+      deallocate( index );
+    }
+
+    // gives back all the chunks, the caller is responsible for
+    // calling the destructors of the nodes that are still alive
+    void release()
+    {
+      for( char *chunk : chunks )
+        free( chunk );
+      chunks.clear();
+      in_use = 0;
+      free_list = 0;
+      used = chunk_slots;
+    }
+
+    // makes sure the next n nodes are created without adding a chunk:
+    // following a link looks the chunk up in the chunk table, so the
+    // table must not move while other threads are following links
+    // (create and destroy still have to be serialised)
+    void reserve( size_t n )
+    {
+      while( ( chunks.size() - in_use ) * chunk_slots + ( chunk_slots - used ) < n )
+        add_chunk();
+    }
+
+    N* parent( const N *node ) const { return at( links( node ).parent_colour & links_t::index_mask ); }
+    N* left( const N *node ) const { return at( links( node ).left ); }
+    N* right( const N *node ) const { return at( links( node ).right ); }
+
+    static colour_t colour( const N *node )
+    {
+      return ( links( node ).parent_colour & links_t::colour_bit ) ? RED : BLACK;
+    }
+
+    static void set_parent( N *node, N *parent )
+    {
+      uint32_t &pc = links( node ).parent_colour;
+      pc = ( pc & links_t::colour_bit ) | index_of( parent );
+    }
+
+    static void set_left( N *node, N *left ) { links( node ).left = index_of( left ); }
+    static void set_right( N *node, N *right ) { links( node ).right = index_of( right ); }
+
+    static void set_colour( N *node, colour_t colour )
+    {
+      uint32_t &pc = links( node ).parent_colour;
+      pc = colour == RED ? ( pc | links_t::colour_bit ) : ( pc & links_t::index_mask );
+    }
+
+  private:
+
+    static const links_t& links( const N *node ) { return *node; }
+    static links_t& links( N *node ) { return *node; }
+
+    slot_t* slot( uint32_t index ) const
+    {
+      --index;
+      return reinterpret_cast<slot_t*>( chunks[index / chunk_slots] + slots_offset ) + index % chunk_slots;
+    }
+
+    N* at( uint32_t index ) const
+    {
+      if( !index ) return nullptr;
+      return reinterpret_cast<N*>( slot( index ) );
+    }
+
+    static uint32_t index_of( const N *node )
+    {
+      if( !node ) return 0;
+      uintptr_t address = reinterpret_cast<uintptr_t>( node );
+      const char *chunk = reinterpret_cast<const char*>( address & ~uintptr_t( CHUNK_BYTES - 1 ) );
+      uint32_t number = reinterpret_cast<const chunk_header*>( chunk )->number;
+      size_t offset = ( reinterpret_cast<const char*>( node ) - chunk - slots_offset ) / sizeof( slot_t );
+      return uint32_t( number * chunk_slots + offset + 1 );
+    }
+
+    uint32_t allocate()
+    {
+      if( free_list )
+      {
+        uint32_t index = free_list;
+        free_list = slot( index )->next;
+        return index;
+      }
+
+      if( used == chunk_slots )
+      {
+        if( in_use == chunks.size() ) add_chunk();
+        ++in_use;
+        used = 0;
+      }
+
+      return uint32_t( ( in_use - 1 ) * chunk_slots + used++ + 1 );
+    }
+
+    void add_chunk()
+    {
+      if( ( chunks.size() + 1 ) * chunk_slots > links_t::index_mask )
+        throw std::length_error( "index_node_pool: too many nodes" );
+
+      void *chunk = nullptr;
+      if( posix_memalign( &chunk, CHUNK_BYTES, CHUNK_BYTES ) )
+        throw std::bad_alloc();
+      try
+      {
+        chunks.push_back( static_cast<char*>( chunk ) );
+      }
+      catch( ... )
+      {
+        free( chunk );
+        throw;
+      }
+      new( chunk ) chunk_header{ uint32_t( chunks.size() - 1 ) };
+    }
+
+    void deallocate( uint32_t index )
+    {
+      slot( index )->next = free_list;
+      free_list = index;
+    }
+
+    std::vector<char*> chunks;
+    // the chunks handed out slots from, the ones past
+    // them have been added in advance by reserve
+    size_t             in_use;
+    uint32_t           free_list;
+    size_t             used;
+};
+
+#endif /* NODE_POOL_HH_ */
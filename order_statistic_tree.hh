@@ -0,0 +1,127 @@
+/*
+ * order_statistic_tree.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef ORDER_STATISTIC_TREE_HH_
+#define ORDER_STATISTIC_TREE_HH_
+
+#include "rbtree.hh"
+
+#include <functional>
+#include <random>
+
+// augmentation policy: the number of nodes in the subtree
+struct subtree_size
+{
+    typedef size_t value_type;
+
+    template<typename N>
+    static value_type lift( const N& ) { return 1; }
+
+    static value_type combine( value_type left, value_type right ) { return left + right; }
+};
+
+template<typename K, typename V, template<typename> class L = pointer_links>
+using counted_node_t = node_t<K, V, L, subtree_size>;
+
+// red-black tree where every node knows the size of its
+// subtree, so ranks and range counts are O(log n); the keys
+// are ordered by O, ranks and ranges follow that order
+template<typename K, typename V, typename P = node_pool< counted_node_t<K, V> >, typename O = std::less<K> >
+class order_statistic_tree : public rbtree< K, V, typename P::node_type, P, O >
+{
+    friend class order_statistic_tree_tester;
+
+  private:
+
+    typedef typename P::node_type N;
+
+    typedef rbtree<K, V, N, P, O> base_t;
+
+  public:
+
+    typedef typename base_t::iterator iterator;
+
+    // the number of keys smaller than key
+    size_t rank( const K &key ) const
+    {
+      size_t rank = 0;
+      N *node = this->tree_root;
+      while( node )
+      {
+        if( this->key_less( node->key, key ) )
+        {
+          rank += count_of( this->left_of( node ) ) + 1;
+          node = this->right_of( node );
+        }
+        else
+          node = this->left_of( node );
+      }
+      return rank;
+    }
+
+    // the k-th smallest key (counting from 0), end() if
+    // there are not that many keys
+    iterator select( size_t k ) const
+    {
+      N *node = this->tree_root;
+      while( node )
+      {
+        size_t left = count_of( this->left_of( node ) );
+        if( k == left )
+          break;
+        if( k < left )
+          node = this->left_of( node );
+        else
+        {
+          k -= left + 1;
+          node = this->right_of( node );
+        }
+      }
+      return this->make_iterator( node );
+    }
+
+    // the number of keys in [ first, last ]
+    size_t count_range( const K &first, const K &last ) const
+    {
+      if( this->key_less( last, first ) ) return 0;
+      size_t end = rank( last ) + ( this->find_in( last, this->tree_root ) ? 1 : 0 );
+      return end - rank( first );
+    }
+
+    // uniformly distributed random key
+    template<typename G>
+    iterator sample( G &generator ) const
+    {
+      if( this->empty() ) return iterator();
+      std::uniform_int_distribution<size_t> distribution( 0, this->size() - 1 );
+      return select( distribution( generator ) );
+    }
+
+    // uniformly distributed random key from [ first, last ]
+    template<typename G>
+    iterator sample( const K &first, const K &last, G &generator ) const
+    {
+      size_t count = count_range( first, last );
+      if( !count ) return iterator();
+      std::uniform_int_distribution<size_t> distribution( 0, count - 1 );
+      return select( rank( first ) + distribution( generator ) );
+    }
+
+  private:
+
+    size_t count_of( const N *node ) const
+    {
+      return node ? this->summary_of( node ) : 0;
+    }
+};
+
+// same API as order_statistic_tree, but the nodes are kept in an
+// index_node_pool and link to each other with 32-bit indices
+template<typename K, typename V, typename O = std::less<K> >
+using compact_order_statistic_tree = order_statistic_tree< K, V, index_node_pool< counted_node_t<K, V, index_links> >, O >;
+
+#endif /* ORDER_STATISTIC_TREE_HH_ */
@@ -0,0 +1,167 @@
+/*
+ * order_statistic_tree_tester.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef ORDER_STATISTIC_TREE_TESTER_HH_
+#define ORDER_STATISTIC_TREE_TESTER_HH_
+
+#include "order_statistic_tree.hh"
+#include <unistd.h>
+#include <iostream>
+#include <random>
+#include <string>
+#include <ctime>
+#include <set>
+
+class order_statistic_tree_tester
+{
+  public:
+
+    bool test_invariant()
+    {
+      return test_invariant( tree, tree.tree_root );
+    }
+
+    // on a tree of its own, so tree and keys are left alone
+    bool test_rank_select()
+    {
+      order_statistic_tree<int, std::string> ranked;
+
+      for( int i = 1; i <= 9; ++i )
+        ranked.insert( i * 10, "" );
+
+      for( int i = 1; i <= 9; ++i )
+      {
+        if( ranked.rank( i * 10 ) != size_t( i - 1 ) )
+          return false;
+        if( ranked.select( i - 1 )->key != i * 10 )
+          return false;
+      }
+
+      if( ranked.rank( 0 ) != 0 || ranked.rank( 15 ) != 1 || ranked.rank( 100 ) != 9 )
+        return false;
+
+      if( ranked.select( 9 ) )
+        return false;
+
+      if( ranked.count_range( 10, 90 ) != 9 || ranked.count_range( 15, 45 ) != 3 || ranked.count_range( 45, 15 ) != 0 )
+        return false;
+
+      std::mt19937 generator( 0 );
+      for( int i = 0; i < 100; ++i )
+      {
+        order_statistic_tree<int, std::string>::iterator itr = ranked.sample( 25, 55, generator );
+        if( !itr || itr->key < 25 || itr->key > 55 )
+          return false;
+      }
+
+      return true;
+    }
+
+    // the keys in descending order, so are the ranks and the ranges
+    bool test_comparator()
+    {
+      return test_descending< order_statistic_tree<int, int, node_pool< counted_node_t<int, int> >, std::greater<int> > >() &&
+             test_descending< compact_order_statistic_tree<int, int, std::greater<int> > >();
+    }
+
+    bool test_ranks()
+    {
+      size_t rank = 0;
+      for( std::set<int>::iterator itr = keys.begin(); itr != keys.end(); ++itr, ++rank )
+        if( tree.rank( *itr ) != rank || tree.select( rank )->key != *itr )
+          return false;
+      return tree.size() == keys.size();
+    }
+
+    void clear()
+    {
+      tree.clear();
+      keys.clear();
+    }
+
+    void populate()
+    {
+      srand( time( NULL ) );
+
+      for( int i = 0; i < 1000; ++i )
+      {
+        int k = rand() % 1000 + 1;
+        tree.insert( k, "" );
+        keys.insert( k );
+      }
+
+      for( int i = 0; i < 200; ++i )
+      {
+        int k = rand() % 1000 + 1;
+        tree.erase( k );
+        keys.erase( k );
+      }
+    }
+
+  private:
+
+    template<typename TREE>
+    static bool test_descending()
+    {
+      TREE descending;
+      std::set< int, std::greater<int> > expected;
+
+      srand( time( NULL ) );
+      for( int i = 0; i < 2000; ++i )
+      {
+        int k = rand() % 1000;
+        descending.insert( k, k );
+        expected.insert( k );
+      }
+      for( int i = 0; i < 500; ++i )
+      {
+        int k = rand() % 1000;
+        descending.erase( k );
+        expected.erase( k );
+      }
+
+      size_t rank = 0;
+      for( std::set< int, std::greater<int> >::iterator itr = expected.begin(); itr != expected.end(); ++itr, ++rank )
+        if( descending.rank( *itr ) != rank || descending.select( rank )->key != *itr )
+          return false;
+
+      for( int i = 0; i < 200; ++i )
+      {
+        int first = rand() % 1100, last = rand() % 1100;
+        size_t count = 0;
+        for( std::set< int, std::greater<int> >::iterator itr = expected.begin(); itr != expected.end(); ++itr )
+          if( *itr <= first && *itr >= last ) ++count;
+        if( descending.count_range( first, last ) != count )
+          return false;
+      }
+
+      return descending.size() == expected.size();
+    }
+
+    template<typename TREE, typename N>
+    static bool test_invariant( const TREE &t, const N *root )
+    {
+      // base case
+      if( !root )
+        return true;
+
+      const N *left = t.left_of( root );
+      const N *right = t.right_of( root );
+
+      // count is the size of the subtree
+      if( t.summary_of( root ) != 1 + ( left ? t.summary_of( left ) : 0 ) + ( right ? t.summary_of( right ) : 0 ) )
+        return false;
+
+      // test children
+      return test_invariant( t, left ) && test_invariant( t, right );
+    }
+
+    order_statistic_tree<int, std::string> tree;
+    std::set<int> keys;
+};
+
+#endif /* ORDER_STATISTIC_TREE_TESTER_HH_ */
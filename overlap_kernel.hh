@@ -0,0 +1,199 @@
+/*
+ * overlap_kernel.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef OVERLAP_KERNEL_HH_
+#define OVERLAP_KERNEL_HH_
+
+#include <cstddef>
+#include <cstdint>
+
+// the vector kernels are compiled for x86-64 with GCC or clang (with
+// the target attribute, so the rest of the code doesn't need -mavx2)
+// and picked at runtime, OVERLAP_KERNEL_SCALAR turns them off
+#if defined( __x86_64__ ) && ( defined( __GNUC__ ) || defined( __clang__ ) ) && !defined( OVERLAP_KERNEL_SCALAR )
+#define OVERLAP_KERNEL_X86 1
+#include <immintrin.h>
+#endif
+
+// overlap_mask( lows, highs, n, low, high ) tests up to 64 intervals
+// ( lows[i], highs[i] ) against the query ( low, high ) and returns
+// a bitmask with bit i set if
+//
+//   lows[i] < high && low < highs[i]
+//
+// (the same test as interval_tree) without a branch per interval:
+//
+// - 32-bit and 64-bit integers go through AVX-512 (16 or 8 intervals
+//   per compare) or AVX2 (8 or 4), whichever the CPU supports
+// - everything else (and all of it on other CPUs) through a scalar
+//   loop that the compiler is free to vectorise
+
+enum overlap_isa_t
+{
+  SCALAR_ISA,
+  AVX2_ISA,
+  AVX512_ISA
+};
+
+inline overlap_isa_t detect_overlap_isa()
+{
+#ifdef OVERLAP_KERNEL_X86
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports( "avx512f" ) ) return AVX512_ISA;
+  if( __builtin_cpu_supports( "avx2" ) ) return AVX2_ISA;
+#endif
+  return SCALAR_ISA;
+}
+
+// the instruction set overlap_mask uses (detected once)
+inline overlap_isa_t overlap_isa()
+{
+  static const overlap_isa_t isa = detect_overlap_isa();
+  return isa;
+}
+
+template<typename I>
+inline uint64_t overlap_mask_scalar( const I *lows, const I *highs, size_t n, I low, I high )
+{
+  uint64_t mask = 0;
+  for( size_t i = 0; i < n; ++i )
+    mask |= uint64_t( ( lows[i] < high ) & ( low < highs[i] ) ) << i;
+  return mask;
+}
+
+#ifdef OVERLAP_KERNEL_X86
+
+__attribute__(( target( "avx2" ) ))
+inline uint64_t overlap_mask_avx2( const int32_t *lows, const int32_t *highs, size_t n, int32_t low, int32_t high )
+{
+  const __m256i ql = _mm256_set1_epi32( low );
+  const __m256i qh = _mm256_set1_epi32( high );
+  uint64_t mask = 0;
+  size_t i = 0;
+  for( ; i + 8 <= n; i += 8 )
+  {
+    __m256i l = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( lows + i ) );
+    __m256i h = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( highs + i ) );
+    __m256i m = _mm256_and_si256( _mm256_cmpgt_epi32( qh, l ), _mm256_cmpgt_epi32( h, ql ) );
+    mask |= uint64_t( uint32_t( _mm256_movemask_ps( _mm256_castsi256_ps( m ) ) ) ) << i;
+  }
+  if( i < n ) mask |= overlap_mask_scalar( lows + i, highs + i, n - i, low, high ) << i;
+  return mask;
+}
+
+__attribute__(( target( "avx2" ) ))
+inline uint64_t overlap_mask_avx2( const int64_t *lows, const int64_t *highs, size_t n, int64_t low, int64_t high )
+{
+  const __m256i ql = _mm256_set1_epi64x( low );
+  const __m256i qh = _mm256_set1_epi64x( high );
+  uint64_t mask = 0;
+  size_t i = 0;
+  for( ; i + 4 <= n; i += 4 )
+  {
+    __m256i l = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( lows + i ) );
+    __m256i h = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( highs + i ) );
+    __m256i m = _mm256_and_si256( _mm256_cmpgt_epi64( qh, l ), _mm256_cmpgt_epi64( h, ql ) );
+    mask |= uint64_t( uint32_t( _mm256_movemask_pd( _mm256_castsi256_pd( m ) ) ) ) << i;
+  }
+  if( i < n ) mask |= overlap_mask_scalar( lows + i, highs + i, n - i, low, high ) << i;
+  return mask;
+}
+
+// the tail is loaded with a mask, so there is no scalar loop at all
+__attribute__(( target( "avx512f" ) ))
+inline uint64_t overlap_mask_avx512( const int32_t *lows, const int32_t *highs, size_t n, int32_t low, int32_t high )
+{
+  const __m512i ql = _mm512_set1_epi32( low );
+  const __m512i qh = _mm512_set1_epi32( high );
+  uint64_t mask = 0;
+  for( size_t i = 0; i < n; i += 16 )
+  {
+    __mmask16 load = n - i >= 16 ? __mmask16( 0xffff ) : __mmask16( ( 1u << ( n - i ) ) - 1 );
+    __m512i l = _mm512_maskz_loadu_epi32( load, lows + i );
+    __m512i h = _mm512_maskz_loadu_epi32( load, highs + i );
+    __mmask16 m = _mm512_mask_cmplt_epi32_mask( load, l, qh ) & _mm512_cmpgt_epi32_mask( h, ql );
+    mask |= uint64_t( m ) << i;
+  }
+  return mask;
+}
+
+__attribute__(( target( "avx512f" ) ))
+inline uint64_t overlap_mask_avx512( const int64_t *lows, const int64_t *highs, size_t n, int64_t low, int64_t high )
+{
+  const __m512i ql = _mm512_set1_epi64( low );
+  const __m512i qh = _mm512_set1_epi64( high );
+  uint64_t mask = 0;
+  for( size_t i = 0; i < n; i += 8 )
+  {
+    __mmask8 load = n - i >= 8 ? __mmask8( 0xff ) : __mmask8( ( 1u << ( n - i ) ) - 1 );
+    __m512i l = _mm512_maskz_loadu_epi64( load, lows + i );
+    __m512i h = _mm512_maskz_loadu_epi64( load, highs + i );
+    __mmask8 m = _mm512_mask_cmplt_epi64_mask( load, l, qh ) & _mm512_cmpgt_epi64_mask( h, ql );
+    mask |= uint64_t( m ) << i;
+  }
+  return mask;
+}
+
+#endif
+
+template<typename I>
+inline uint64_t overlap_mask( const I *lows, const I *highs, size_t n, I low, I high )
+{
+  return overlap_mask_scalar( lows, highs, n, low, high );
+}
+
+inline uint64_t overlap_mask( const int32_t *lows, const int32_t *highs, size_t n, int32_t low, int32_t high )
+{
+#ifdef OVERLAP_KERNEL_X86
+  switch( overlap_isa() )
+  {
+    case AVX512_ISA: return overlap_mask_avx512( lows, highs, n, low, high );
+    case AVX2_ISA: return overlap_mask_avx2( lows, highs, n, low, high );
+    default: break;
+  }
+#endif
+  return overlap_mask_scalar( lows, highs, n, low, high );
+}
+
+inline uint64_t overlap_mask( const int64_t *lows, const int64_t *highs, size_t n, int64_t low, int64_t high )
+{
+#ifdef OVERLAP_KERNEL_X86
+  switch( overlap_isa() )
+  {
+    case AVX512_ISA: return overlap_mask_avx512( lows, highs, n, low, high );
+    case AVX2_ISA: return overlap_mask_avx2( lows, highs, n, low, high );
+    default: break;
+  }
+#endif
+  return overlap_mask_scalar( lows, highs, n, low, high );
+}
+
+// the number of bits set
+inline size_t mask_count( uint64_t mask )
+{
+#if defined( __GNUC__ ) || defined( __clang__ )
+  return size_t( __builtin_popcountll( mask ) );
+#else
+  size_t count = 0;
+  for( ; mask; mask &= mask - 1 ) ++count;
+  return count;
+#endif
+}
+
+// the index of the lowest bit set (mask must not be 0)
+inline size_t mask_first( uint64_t mask )
+{
+#if defined( __GNUC__ ) || defined( __clang__ )
+  return size_t( __builtin_ctzll( mask ) );
+#else
+  size_t index = 0;
+  for( ; !( mask & 1 ); mask >>= 1 ) ++index;
+  return index;
+#endif
+}
+
+#endif /* OVERLAP_KERNEL_HH_ */
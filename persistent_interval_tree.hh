@@ -0,0 +1,150 @@
+/*
+ * persistent_interval_tree.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef PERSISTENT_INTERVAL_TREE_HH_
+#define PERSISTENT_INTERVAL_TREE_HH_
+
+#include "persistent_rbtree.hh"
+#include "interval_tree.hh"
+
+// C is the order of the ends (see interval_order)
+template<typename I, typename V, typename C = std::less<I> >
+class persistent_interval_node_t : private summary_holder<typename interval_summary<I, C>::value_type>
+{
+  template<typename, typename, typename, typename, typename> friend class persistent_rbtree;
+
+  public:
+    typedef interval_summary<I, C> augmentation;
+
+    typedef C compare;
+
+    persistent_interval_node_t( I low, I high, const V &value ) :
+      low( low ), high( high ), value( value ), left( nullptr ), right( nullptr ), colour( RED ), version( 0 ) { }
+
+    const I low;
+    const I high;
+    const V value;
+
+  private:
+    persistent_interval_node_t *left;
+    persistent_interval_node_t *right;
+    colour_t                    colour;
+    uint64_t                    version;
+};
+
+// ordered by low and then by high, as in interval_tree
+template<typename I, typename V, typename C>
+inline interval_key<I> node_key( const persistent_interval_node_t<I, V, C> &node )
+{
+  return interval_key<I>( node.low, node.high );
+}
+
+// interval tree with lock-free readers: the writers publish new
+// versions, the readers query snapshots (see persistent_rbtree)
+//
+// the ends are ordered by the C of the node type, as in interval_tree
+template<typename I, typename V, typename P = node_pool< persistent_interval_node_t<I, V> > >
+class persistent_interval_tree : public persistent_rbtree< interval_key<I>, V, typename P::node_type, P, interval_key_less<I, typename P::node_type::compare> >
+{
+  private:
+
+    typedef typename P::node_type N;
+
+    typedef typename N::compare C;
+
+    typedef interval_order<I, C> order;
+
+    typedef persistent_rbtree<interval_key<I>, V, N, P, interval_key_less<I, C> > base_t;
+
+  public:
+
+    class snapshot : public base_t::snapshot
+    {
+      public:
+
+        snapshot() { }
+
+        snapshot( typename base_t::snapshot &&other ) : base_t::snapshot( std::move( other ) ) { }
+
+        typename base_t::iterator find( I low, I high ) const
+        {
+          return base_t::snapshot::find( interval_key<I>( low, high ) );
+        }
+
+        // calls visitor( node ) for every interval overlapping with
+        // ( low, high ) in ascending order of low, the visitor returns
+        // false to stop the query early
+        //
+        // returns false if the query has been stopped by the visitor
+        template<typename F>
+        bool query( I low, I high, F visitor ) const
+        {
+          return query_in_order( low, high, this->root(), visitor );
+        }
+
+        size_t count_overlaps( I low, I high ) const
+        {
+          return count_in( low, high, this->root(), false );
+        }
+    };
+
+    explicit persistent_interval_tree( size_t readers = 64 ) : base_t( readers ) { }
+
+    snapshot read() const
+    {
+      return snapshot( base_t::read() );
+    }
+
+    // any number of intervals can start at the same low, an interval
+    // that is already in the tree is skipped
+    void insert( I low, I high, const V &value )
+    {
+      this->insert_node( interval_key<I>( low, high ), low, high, value );
+    }
+
+    void erase( I low, I high )
+    {
+      this->erase_node( interval_key<I>( low, high ), []( const N* ) { return true; } );
+    }
+
+  private:
+
+    using base_t::insert;
+    using base_t::erase;
+
+    static bool overlaps( I low, I high, const N *node )
+    {
+      return order::overlaps( low, high, node->low, node->high );
+    }
+
+    // the same pruning as in interval_tree
+    template<typename F>
+    static bool query_in_order( I low, I high, const N *node, F &visitor )
+    {
+      if( !node ) return true;
+      if( !order::less( low, base_t::summary_of( node ).max ) ) return true;
+      if( !query_in_order( low, high, base_t::left_of( node ), visitor ) )
+        return false;
+      if( !order::less( node->low, high ) ) return true;
+      if( overlaps( low, high, node ) && !visitor( *node ) )
+        return false;
+      return query_in_order( low, high, base_t::right_of( node ), visitor );
+    }
+
+    static size_t count_in( I low, I high, const N *node, bool below_high )
+    {
+      if( !node ) return 0;
+      if( !order::less( low, base_t::summary_of( node ).max ) ) return 0;
+      if( below_high && order::less( low, base_t::summary_of( node ).min_high ) ) return base_t::summary_of( node ).count;
+      size_t count = count_in( low, high, base_t::left_of( node ), below_high || order::less( node->low, high ) );
+      if( !order::less( node->low, high ) ) return count;
+      if( overlaps( low, high, node ) ) ++count;
+      return count + count_in( low, high, base_t::right_of( node ), below_high );
+    }
+};
+
+#endif /* PERSISTENT_INTERVAL_TREE_HH_ */
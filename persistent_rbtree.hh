@@ -0,0 +1,754 @@
+/*
+ * persistent_rbtree.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef PERSISTENT_RBTREE_HH_
+#define PERSISTENT_RBTREE_HH_
+
+#include "rbtree.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <utility>
+
+// Epoch based reclamation:
+// - a reader pins the current epoch in one of the reader slots
+//   for as long as it looks at the tree
+// - the writer retires the nodes it has unlinked with the epoch
+//   it published the new root in and starts a new epoch
+// - retired nodes are freed once every pinned epoch is newer
+//
+// all the operations are sequentially consistent, so a reader that
+// has pinned a newer epoch can only see the newer root
+class epoch_domain
+{
+  public:
+
+    explicit epoch_domain( size_t slots = 64 ) : epoch( 1 ), readers( slots ? slots : 1 ) { }
+
+    epoch_domain( const epoch_domain& ) = delete;
+
+    epoch_domain& operator=( const epoch_domain& ) = delete;
+
+    // pins the current epoch and returns the slot, if all
+    // the slots are taken waits for one to become free
+    size_t pin()
+    {
+      while( true )
+      {
+        uint64_t current = epoch.load();
+        for( size_t i = 0; i < readers.size(); ++i )
+        {
+          uint64_t expected = 0;
+          if( readers[i].epoch.compare_exchange_strong( expected, current ) )
+            return i;
+        }
+        std::this_thread::yield();
+      }
+    }
+
+    void unpin( size_t slot )
+    {
+      readers[slot].epoch.store( 0 );
+    }
+
+    // starts a new epoch, returns the one that ended
+    uint64_t advance()
+    {
+      return epoch.fetch_add( 1 );
+    }
+
+    // the oldest epoch that is still pinned (or the current one), the
+    // nodes retired in the epochs before that can't be seen any more
+    uint64_t oldest() const
+    {
+      uint64_t oldest = epoch.load();
+      for( size_t i = 0; i < readers.size(); ++i )
+      {
+        uint64_t pinned = readers[i].epoch.load();
+        if( pinned && pinned < oldest )
+          oldest = pinned;
+      }
+      return oldest;
+    }
+
+  private:
+
+    // one per cache line, so the readers don't get in each other's way
+    struct slot_t
+    {
+        slot_t() : epoch( 0 ) { }
+
+        std::atomic<uint64_t> epoch; // 0 if the slot is free
+        char                  padding[64 - sizeof( std::atomic<uint64_t> )];
+    };
+
+    std::atomic<uint64_t> epoch;
+    std::vector<slot_t>   readers;
+};
+
+// Node of a persistent tree: no parent link, so that subtrees can be
+// shared between versions, and nothing changes once it's published
+// (a write works on copies of the nodes on its paths).
+template<typename K, typename V, typename A = no_augmentation>
+class persistent_node_t : private summary_holder<typename A::value_type>
+{
+  template<typename, typename, typename, typename, typename> friend class persistent_rbtree;
+
+  public:
+    typedef A augmentation;
+
+    persistent_node_t( const K &key, const V &value ) :
+      key( key ), value( value ), left( nullptr ), right( nullptr ), colour( RED ), version( 0 ) { }
+
+    const K key;
+    const V value;
+
+  private:
+    persistent_node_t *left;
+    persistent_node_t *right;
+    colour_t           colour;
+    uint64_t           version; // the write that created the node
+};
+
+template<typename K, typename V, typename A>
+inline const K& node_key( const persistent_node_t<K, V, A> &node )
+{
+  return node.key;
+}
+
+// Persistent (path copying) red-black tree for concurrent readers:
+// - a writer copies the nodes it would change and publishes the new
+//   root atomically, writers take turns on a mutex
+// - read() gives a snapshot that is iterated without any locking and
+//   doesn't change whatever the writers do
+// - the nodes a write has replaced are freed once the snapshots that
+//   might still see them are gone (epoch based reclamation)
+//
+// insert and erase are both built on join, so they copy O(log n) nodes
+// and keep the summaries of the augmentation up to date along the way
+//
+// the nodes live in a node_pool that only the writer touches; the
+// tree must not be destroyed while there are snapshots of it
+//
+// O is the order of the keys, as for rbtree
+template<typename K, typename V, typename N = persistent_node_t<K, V>, typename P = node_pool<N>, typename O = std::less<K> >
+class persistent_rbtree
+{
+    friend class persistent_rbtree_tester;
+
+  protected:
+
+    typedef typename N::augmentation augmentation;
+
+    typedef typename augmentation::value_type summary_t;
+
+    static const bool augmented = !std::is_empty<summary_t>::value;
+
+  public:
+
+    // in-order iterator over a snapshot (keeps the path from the root)
+    class iterator
+    {
+        friend class persistent_rbtree;
+
+      public:
+
+        iterator() { }
+
+        const N* operator->() const
+        {
+          return path.back();
+        }
+
+        const N& operator*() const
+        {
+          return *path.back();
+        }
+
+        operator bool() const
+        {
+          return !path.empty();
+        }
+
+        iterator& operator++()
+        {
+          if( path.empty() )
+            return *this;
+
+          const N *node = path.back();
+          if( node->right )
+          {
+            descend( node->right );
+            return *this;
+          }
+
+          path.pop_back();
+          while( !path.empty() && path.back()->right == node )
+          {
+            node = path.back();
+            path.pop_back();
+          }
+          return *this;
+        }
+
+        bool operator!=( const iterator &itr ) const
+        {
+          return node() != itr.node();
+        }
+
+        bool operator==( const iterator &itr ) const
+        {
+          return node() == itr.node();
+        }
+
+      private:
+
+        const N* node() const
+        {
+          return path.empty() ? nullptr : path.back();
+        }
+
+        // goes down to the smallest key in the subtree
+        void descend( const N *node )
+        {
+          for( ; node; node = node->left )
+            path.push_back( node );
+        }
+
+        std::vector<const N*> path;
+    };
+
+    // a consistent version of the tree, unaffected by later writes
+    class snapshot
+    {
+        friend class persistent_rbtree;
+
+      public:
+
+        snapshot() : epochs( nullptr ), slot( 0 ), tree_root( nullptr ) { }
+
+        snapshot( snapshot &&other ) : epochs( other.epochs ), slot( other.slot ), tree_root( other.tree_root )
+        {
+          other.epochs = nullptr;
+          other.tree_root = nullptr;
+        }
+
+        snapshot& operator=( snapshot &&other )
+        {
+          if( this != &other )
+          {
+            release();
+            epochs = other.epochs;
+            slot = other.slot;
+            tree_root = other.tree_root;
+            other.epochs = nullptr;
+            other.tree_root = nullptr;
+          }
+          return *this;
+        }
+
+        ~snapshot()
+        {
+          release();
+        }
+
+        bool empty() const
+        {
+          return !tree_root;
+        }
+
+        iterator begin() const
+        {
+          iterator itr;
+          itr.descend( tree_root );
+          return itr;
+        }
+
+        iterator end() const
+        {
+          return iterator();
+        }
+
+        iterator find( const K &key ) const
+        {
+          iterator itr;
+          for( const N *node = tree_root; node; )
+          {
+            itr.path.push_back( node );
+            if( key_less( key, key_of( node ) ) )
+              node = node->left;
+            else if( key_less( key_of( node ), key ) )
+              node = node->right;
+            else
+              return itr;
+          }
+          return iterator();
+        }
+
+        // lets the writer free what only this snapshot could see
+        void release()
+        {
+          if( !epochs ) return;
+          epochs->unpin( slot );
+          epochs = nullptr;
+          tree_root = nullptr;
+        }
+
+      protected:
+
+        snapshot( epoch_domain *epochs, size_t slot, const N *root ) : epochs( epochs ), slot( slot ), tree_root( root ) { }
+
+        const N* root() const
+        {
+          return tree_root;
+        }
+
+      private:
+
+        epoch_domain *epochs;
+        size_t        slot;
+        const N      *tree_root;
+    };
+
+    // readers is the number of snapshots that can be held at the same
+    // time, beyond that read() waits for one to be released
+    explicit persistent_rbtree( size_t readers = 64 ) : tree_root( nullptr ), tree_size( 0 ), version( 0 ), epochs( readers ) { }
+
+    persistent_rbtree( const persistent_rbtree& ) = delete;
+
+    persistent_rbtree& operator=( const persistent_rbtree& ) = delete;
+
+    ~persistent_rbtree()
+    {
+      // the pool gives back the memory, the nodes
+      // only have to be visited if they hold something
+      if( std::is_trivially_destructible<N>::value ) return;
+      destroy_subtree( tree_root.load() );
+      for( size_t i = 0; i < retired.size(); ++i )
+        pool.destroy( retired[i].second );
+    }
+
+    snapshot read() const
+    {
+      size_t slot = epochs.pin();
+      return snapshot( &epochs, slot, tree_root.load() );
+    }
+
+    // keys that are already in the tree are skipped
+    void insert( const K &key, const V &value )
+    {
+      insert_node( key, key, value );
+    }
+
+    void erase( const K &key )
+    {
+      erase_node( key, []( const N* ) { return true; } );
+    }
+
+    // the size of the latest version
+    size_t size() const
+    {
+      return tree_size.load( std::memory_order_relaxed );
+    }
+
+    bool empty() const
+    {
+      return !tree_root.load();
+    }
+
+    // frees the replaced nodes no snapshot can see any more (the writes
+    // do that as well, this is for when the readers are gone)
+    void reclaim()
+    {
+      std::lock_guard<std::mutex> lock( writer );
+      reclaim_retired();
+    }
+
+  protected:
+
+    static auto key_of( const N *node ) -> decltype( node_key( *node ) ) { return node_key( *node ); }
+
+    static bool key_less( const K &x, const K &y ) { return O()( x, y ); }
+
+    static const N* left_of( const N *node ) { return node->left; }
+
+    static const N* right_of( const N *node ) { return node->right; }
+
+    static colour_t colour_of( const N *node ) { return node ? node->colour : BLACK; }
+
+    static typename summary_holder<summary_t>::reference summary_of( const N *node )
+    {
+      return node->summary();
+    }
+
+    // args are passed to the node constructor
+    template<typename ... Args>
+    void insert_node( const K &key, Args&& ... args )
+    {
+      std::lock_guard<std::mutex> lock( writer );
+      N *root = tree_root.load();
+      if( find_in( key, root ) ) return;
+
+      begin_write();
+      try
+      {
+        N *node = make_node( std::forward<Args>( args )... );
+        size_t height;
+        root = insert_into( root, black_height( root ), node, height );
+      }
+      catch( ... )
+      {
+        abort_write();
+        throw;
+      }
+      publish( root, 1 );
+    }
+
+    // erases key if match( node ) says so
+    template<typename M>
+    bool erase_node( const K &key, M match )
+    {
+      std::lock_guard<std::mutex> lock( writer );
+      N *root = tree_root.load();
+      N *node = find_in( key, root );
+      if( !node || !match( node ) ) return false;
+
+      begin_write();
+      try
+      {
+        size_t height;
+        root = erase_from( root, black_height( root ), key, height );
+      }
+      catch( ... )
+      {
+        abort_write();
+        throw;
+      }
+      publish( root, -1 );
+      return true;
+    }
+
+    static N* find_in( const K &key, N *node )
+    {
+      while( node )
+      {
+        if( key_less( key, key_of( node ) ) )
+          node = node->left;
+        else if( key_less( key_of( node ), key ) )
+          node = node->right;
+        else
+          break;
+      }
+      return node;
+    }
+
+    // BLACK nodes on the way from node down to a leaf (node included)
+    static size_t black_height( const N *node )
+    {
+      size_t height = 0;
+      for( ; node; node = node->left )
+        if( node->colour == BLACK ) ++height;
+      return height;
+    }
+
+    void update_summary( N *node )
+    {
+      if( !augmented ) return;
+      summary_t summary = augmentation::lift( *node );
+      if( node->left ) summary = augmentation::combine( node->left->summary(), summary );
+      if( node->right ) summary = augmentation::combine( summary, node->right->summary() );
+      node->summary( summary );
+    }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    void begin_write()
+    {
+      ++version;
+      created.clear();
+      replaced.clear();
+    }
+
+    // the old version is untouched, so only the new nodes have to go
+    void abort_write()
+    {
+      for( size_t i = 0; i < created.size(); ++i )
+        pool.destroy( created[i] );
+      created.clear();
+      replaced.clear();
+    }
+
+    void publish( N *root, int change )
+    {
+      if( colour_of( root ) == RED )
+      {
+        root = own( root );
+        root->colour = BLACK;
+      }
+      tree_root.store( root );
+      tree_size.store( tree_size.load( std::memory_order_relaxed ) + change, std::memory_order_relaxed );
+
+      uint64_t epoch = epochs.advance();
+      for( size_t i = 0; i < replaced.size(); ++i )
+        retired.push_back( std::make_pair( epoch, replaced[i] ) );
+      created.clear();
+      replaced.clear();
+      reclaim_retired();
+    }
+
+    void reclaim_retired()
+    {
+      uint64_t oldest = epochs.oldest();
+      while( !retired.empty() && retired.front().first < oldest )
+      {
+        pool.destroy( retired.front().second );
+        retired.pop_front();
+      }
+    }
+
+    template<typename ... Args>
+    N* make_node( Args&& ... args )
+    {
+      N *node = pool.create( std::forward<Args>( args )... );
+      node->version = version;
+      created.push_back( node );
+      return node;
+    }
+
+    // the node in a state it can be changed in: the nodes created by
+    // the current write as they are, the published ones are copied
+    // (and replaced in the new version)
+    N* own( N *node )
+    {
+      if( node->version == version ) return node;
+      N *copy = pool.create( *node );
+      copy->version = version;
+      created.push_back( copy );
+      replaced.push_back( node );
+      return copy;
+    }
+
+    void destroy_subtree( N *node )
+    {
+      if( !node ) return;
+      destroy_subtree( node->left );
+      destroy_subtree( node->right );
+      pool.destroy( node );
+    }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    // All the functions below take subtrees together with their black
+    // heights and return the new subtree, they never change a published
+    // node (only what own gives back).
+
+    // joins left < middle < right, height is set to the
+    // black height of the result, O( |lh - rh| + 1 )
+    N* join( N *left, size_t lh, N *middle, N *right, size_t rh, size_t &height )
+    {
+      // a RED root might clash with a RED middle
+      if( colour_of( left ) == RED )
+      {
+        left = own( left );
+        left->colour = BLACK;
+        ++lh;
+      }
+      if( colour_of( right ) == RED )
+      {
+        right = own( right );
+        right->colour = BLACK;
+        ++rh;
+      }
+
+      N *root;
+      if( lh > rh )
+      {
+        root = join_right( left, lh, middle, right, rh );
+        height = lh;
+      }
+      else if( lh < rh )
+      {
+        root = join_left( left, lh, middle, right, rh );
+        height = rh;
+      }
+      else
+      {
+        root = own( middle );
+        root->left = left;
+        root->right = right;
+        root->colour = BLACK;
+        update_summary( root );
+        height = lh + 1;
+        return root;
+      }
+
+      // a RED root with a RED child is made BLACK
+      if( root->colour == RED && ( colour_of( root->left ) == RED || colour_of( root->right ) == RED ) )
+      {
+        root->colour = BLACK;
+        ++height;
+      }
+      return root;
+    }
+
+    // goes down the right spine of node (black height h) to the BLACK
+    // node of black height rh, puts a RED middle in its place and fixes
+    // RED-RED on the way back up with a rotation
+    N* join_right( N *node, size_t h, N *middle, N *right, size_t rh )
+    {
+      if( colour_of( node ) == BLACK && h == rh )
+      {
+        middle = own( middle );
+        middle->left = node;
+        middle->right = right;
+        middle->colour = RED;
+        update_summary( middle );
+        return middle;
+      }
+
+      node = own( node );
+      size_t child_height = h - ( node->colour == BLACK ? 1 : 0 );
+      node->right = join_right( node->right, child_height, middle, right, rh );
+      if( node->colour == BLACK && node->right->colour == RED && colour_of( node->right->right ) == RED )
+      {
+        N *pivot = node->right;
+        pivot->right = own( pivot->right );
+        pivot->right->colour = BLACK;
+        node->right = pivot->left;
+        pivot->left = node;
+        update_summary( node );
+        update_summary( pivot );
+        return pivot;
+      }
+      update_summary( node );
+      return node;
+    }
+
+    N* join_left( N *left, size_t lh, N *middle, N *node, size_t h )
+    {
+      if( colour_of( node ) == BLACK && h == lh )
+      {
+        middle = own( middle );
+        middle->left = left;
+        middle->right = node;
+        middle->colour = RED;
+        update_summary( middle );
+        return middle;
+      }
+
+      node = own( node );
+      size_t child_height = h - ( node->colour == BLACK ? 1 : 0 );
+      node->left = join_left( left, lh, middle, node->left, child_height );
+      if( node->colour == BLACK && node->left->colour == RED && colour_of( node->left->left ) == RED )
+      {
+        N *pivot = node->left;
+        pivot->left = own( pivot->left );
+        pivot->left->colour = BLACK;
+        node->left = pivot->right;
+        pivot->right = node;
+        update_summary( node );
+        update_summary( pivot );
+        return pivot;
+      }
+      update_summary( node );
+      return node;
+    }
+
+    // joins left < right
+    N* join( N *left, size_t lh, N *right, size_t rh, size_t &height )
+    {
+      if( !right )
+      {
+        height = lh;
+        return left;
+      }
+
+      // the smallest node of right goes in the middle
+      N *middle;
+      right = remove_min( right, rh, middle, rh );
+      return join( left, lh, middle, right, rh, height );
+    }
+
+    // takes the smallest node out (min is set to the
+    // published node, join makes a copy of it)
+    N* remove_min( N *node, size_t h, N* &min, size_t &height )
+    {
+      size_t child_height = h - ( node->colour == BLACK ? 1 : 0 );
+      if( !node->left )
+      {
+        min = node;
+        height = child_height;
+        return node->right;
+      }
+
+      size_t left_height;
+      N *left = remove_min( node->left, child_height, min, left_height );
+      return join( left, left_height, node, node->right, child_height, height );
+    }
+
+    // the key of fresh is not in the tree
+    N* insert_into( N *node, size_t h, N *fresh, size_t &height )
+    {
+      if( !node )
+      {
+        fresh->left = fresh->right = nullptr;
+        fresh->colour = BLACK;
+        update_summary( fresh );
+        height = 1;
+        return fresh;
+      }
+
+      size_t child_height = h - ( node->colour == BLACK ? 1 : 0 );
+      size_t sub_height;
+      if( key_less( key_of( fresh ), key_of( node ) ) )
+      {
+        N *left = insert_into( node->left, child_height, fresh, sub_height );
+        return join( left, sub_height, node, node->right, child_height, height );
+      }
+      N *right = insert_into( node->right, child_height, fresh, sub_height );
+      return join( node->left, child_height, node, right, sub_height, height );
+    }
+
+    // the key is in the tree
+    N* erase_from( N *node, size_t h, const K &key, size_t &height )
+    {
+      size_t child_height = h - ( node->colour == BLACK ? 1 : 0 );
+      size_t sub_height;
+      if( key_less( key, key_of( node ) ) )
+      {
+        N *left = erase_from( node->left, child_height, key, sub_height );
+        return join( left, sub_height, node, node->right, child_height, height );
+      }
+      if( key_less( key_of( node ), key ) )
+      {
+        N *right = erase_from( node->right, child_height, key, sub_height );
+        return join( node->left, child_height, node, right, sub_height, height );
+      }
+
+      replaced.push_back( node );
+      return join( node->left, child_height, node->right, child_height, height );
+    }
+
+    std::mutex           writer;
+    std::atomic<N*>      tree_root;
+    std::atomic<size_t>  tree_size;
+
+    P                  pool;
+    uint64_t           version;  // the current write
+    std::vector<N*>    created;  // by the current write
+    std::vector<N*>    replaced; // by the current write
+
+    mutable epoch_domain                          epochs;
+    std::deque< std::pair<uint64_t, N*> >         retired;
+};
+
+#endif /* PERSISTENT_RBTREE_HH_ */
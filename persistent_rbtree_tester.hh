@@ -0,0 +1,367 @@
+/*
+ * persistent_rbtree_tester.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef PERSISTENT_RBTREE_TESTER_HH_
+#define PERSISTENT_RBTREE_TESTER_HH_
+
+#include "persistent_rbtree.hh"
+#include "persistent_interval_tree.hh"
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <ctime>
+#include <set>
+#include <map>
+#include <vector>
+#include <functional>
+
+class persistent_rbtree_tester
+{
+  public:
+
+    bool test_invariant()
+    {
+      return test_invariant( tree, tree.tree_root.load() ).first && tree.colour_of( tree.tree_root.load() ) == BLACK;
+    }
+
+    // old snapshots don't see the later writes
+    bool test_snapshot()
+    {
+      clear();
+
+      std::vector< std::set<int> > versions;
+      std::vector< persistent_rbtree<int, int>::snapshot > snapshots;
+
+      srand( time( NULL ) );
+      for( int i = 0; i < 2000; ++i )
+      {
+        int k = rand() % 500;
+        if( rand() % 3 )
+        {
+          tree.insert( k, k );
+          keys.insert( k );
+        }
+        else
+        {
+          tree.erase( k );
+          keys.erase( k );
+        }
+
+        if( i % 200 == 0 )
+        {
+          versions.push_back( keys );
+          snapshots.push_back( tree.read() );
+        }
+      }
+
+      if( !test_invariant() || tree.size() != keys.size() )
+        return false;
+
+      for( size_t i = 0; i < snapshots.size(); ++i )
+        if( !test_keys( snapshots[i], versions[i] ) )
+          return false;
+
+      return test_keys( tree.read(), keys );
+    }
+
+    // the replaced nodes are freed once there are no snapshots
+    // that could see them
+    bool test_reclaim()
+    {
+      clear();
+
+      for( int i = 0; i < 100; ++i )
+        tree.insert( i, i );
+
+      persistent_rbtree<int, int>::snapshot old = tree.read();
+      for( int i = 0; i < 100; i += 2 )
+        tree.erase( i );
+      if( tree.retired.empty() )
+        return false;
+
+      // nothing that the new version uses has been retired
+      std::set<const node_t*> reachable;
+      collect( tree, tree.tree_root.load(), reachable );
+      for( size_t i = 0; i < tree.retired.size(); ++i )
+        if( reachable.count( tree.retired[i].second ) )
+          return false;
+
+      old.release();
+      tree.reclaim();
+      return tree.retired.empty();
+    }
+
+    // readers iterate while the writer keeps changing the tree
+    bool test_concurrent()
+    {
+      clear();
+
+      std::atomic<bool> stop( false );
+      std::atomic<int> errors( 0 );
+      std::vector<std::thread> readers;
+      for( int r = 0; r < 4; ++r )
+      {
+        readers.push_back( std::thread( [&]()
+        {
+          while( !stop )
+          {
+            persistent_rbtree<int, int>::snapshot snapshot = tree.read();
+            int previous = -1;
+            for( persistent_rbtree<int, int>::iterator itr = snapshot.begin(); itr != snapshot.end(); ++itr )
+            {
+              if( itr->key <= previous || itr->value != 2 * itr->key ) ++errors;
+              previous = itr->key;
+            }
+          }
+        } ) );
+      }
+
+      srand( time( NULL ) );
+      for( int i = 0; i < 20000; ++i )
+      {
+        int k = rand() % 1000;
+        if( rand() % 2 )
+          tree.insert( k, 2 * k );
+        else
+          tree.erase( k );
+      }
+
+      stop = true;
+      for( size_t r = 0; r < readers.size(); ++r )
+        readers[r].join();
+
+      return !errors && test_invariant();
+    }
+
+    bool test_interval()
+    {
+      persistent_interval_tree<int, int> intervals;
+      std::set< std::pair<int, int> > expected;
+
+      srand( time( NULL ) );
+      for( int i = 0; i < 5000; ++i )
+      {
+        // plenty of intervals share a low
+        int l = rand() % 500;
+        int h = l + rand() % 100 + 1;
+        if( rand() % 3 )
+        {
+          if( expected.insert( std::make_pair( l, h ) ).second )
+            intervals.insert( l, h, i );
+        }
+        else
+        {
+          std::set< std::pair<int, int> >::iterator itr = expected.lower_bound( std::make_pair( l, 0 ) );
+          if( itr == expected.end() || itr->first != l ) continue;
+          intervals.erase( l, itr->second );
+          expected.erase( itr );
+        }
+      }
+      if( intervals.size() != expected.size() )
+        return false;
+
+      persistent_interval_tree<int, int>::snapshot snapshot = intervals.read();
+      if( !test_intervals( intervals, intervals.tree_root.load() ) )
+        return false;
+
+      for( int i = 0; i < 200; ++i )
+      {
+        int l = rand() % 600;
+        int h = l + rand() % 20 + 1;
+        size_t count = 0;
+        for( std::set< std::pair<int, int> >::iterator itr = expected.begin(); itr != expected.end(); ++itr )
+          if( itr->first < h && l < itr->second ) ++count;
+
+        size_t visited = 0;
+        snapshot.query( l, h, [&]( const persistent_interval_node_t<int, int>& ) { ++visited; return true; } );
+        if( visited != count || snapshot.count_overlaps( l, h ) != count )
+          return false;
+      }
+
+      return true;
+    }
+
+    // intervals starting at the same low are all kept
+    bool test_interval_duplicate_lows()
+    {
+      persistent_interval_tree<int, int> intervals;
+      intervals.insert( 5, 10, 1 );
+      intervals.insert( 5, 20, 2 );
+      intervals.insert( 5, 20, 3 );
+      persistent_interval_tree<int, int>::snapshot snapshot = intervals.read();
+      if( intervals.size() != 2 || !snapshot.find( 5, 10 ) || !snapshot.find( 5, 20 ) || snapshot.find( 5, 15 ) )
+        return false;
+      if( snapshot.find( 5, 10 )->value != 1 || snapshot.find( 5, 20 )->value != 2 || snapshot.count_overlaps( 12, 13 ) != 1 || snapshot.count_overlaps( 0, 6 ) != 2 )
+        return false;
+
+      // only the given one goes
+      intervals.erase( 5, 20 );
+      persistent_interval_tree<int, int>::snapshot after = intervals.read();
+      return intervals.size() == 1 && after.find( 5, 10 ) && !after.find( 5, 20 ) && snapshot.find( 5, 20 );
+    }
+
+    // both trees follow the order they are given
+    bool test_comparator()
+    {
+      typedef persistent_node_t<int, int> node;
+      persistent_rbtree<int, int, node, node_pool<node>, std::greater<int> > descending;
+      typedef persistent_interval_node_t<int, int, std::greater<int> > interval_node;
+      persistent_interval_tree<int, int, node_pool<interval_node> > reversed;
+      std::set< int, std::greater<int> > expected;
+      std::map<int, int> intervals;
+
+      srand( time( NULL ) );
+      for( int i = 0; i < 2000; ++i )
+      {
+        int k = rand() % 500;
+        descending.insert( k, k );
+        expected.insert( k );
+        // the ends are reversed too, high < low
+        if( intervals.insert( std::make_pair( k, k - 1 - rand() % 20 ) ).second )
+          reversed.insert( k, intervals[k], i );
+      }
+      for( int i = 0; i < 500; ++i )
+      {
+        int k = rand() % 500;
+        descending.erase( k );
+        expected.erase( k );
+        if( intervals.count( k ) )
+        {
+          reversed.erase( k, intervals[k] );
+          intervals.erase( k );
+        }
+      }
+
+      persistent_rbtree<int, int, node, node_pool<node>, std::greater<int> >::snapshot snapshot = descending.read();
+      std::set< int, std::greater<int> >::iterator k = expected.begin();
+      for( persistent_rbtree<int, int, node, node_pool<node>, std::greater<int> >::iterator itr = snapshot.begin(); itr != snapshot.end(); ++itr, ++k )
+        if( k == expected.end() || itr->key != *k )
+          return false;
+      if( k != expected.end() || !snapshot.find( expected.empty() ? 0 : *expected.begin() ) == !expected.empty() )
+        return false;
+
+      persistent_interval_tree<int, int, node_pool<interval_node> >::snapshot intervals_snapshot = reversed.read();
+      for( int i = 0; i < 200; ++i )
+      {
+        // ( l, h ) with h < l in the reversed order
+        int l = rand() % 520;
+        int h = l - rand() % 20 - 1;
+        size_t count = 0;
+        for( std::map<int, int>::iterator itr = intervals.begin(); itr != intervals.end(); ++itr )
+          if( itr->first > h && l > itr->second ) ++count;
+        size_t visited = 0;
+        intervals_snapshot.query( l, h, [&]( const interval_node& ) { ++visited; return true; } );
+        if( visited != count || intervals_snapshot.count_overlaps( l, h ) != count )
+          return false;
+      }
+      return true;
+    }
+
+    void clear()
+    {
+      std::vector<int> all;
+      {
+        persistent_rbtree<int, int>::snapshot snapshot = tree.read();
+        for( persistent_rbtree<int, int>::iterator itr = snapshot.begin(); itr != snapshot.end(); ++itr )
+          all.push_back( itr->key );
+      }
+      for( size_t i = 0; i < all.size(); ++i )
+        tree.erase( all[i] );
+      keys.clear();
+    }
+
+    void populate()
+    {
+      srand( time( NULL ) );
+
+      for( int i = 0; i < 1000; ++i )
+      {
+        int k = rand() % 1000 + 1;
+        tree.insert( k, k );
+        keys.insert( k );
+      }
+
+      for( int i = 0; i < 200; ++i )
+      {
+        int k = rand() % 1000 + 1;
+        tree.erase( k );
+        keys.erase( k );
+      }
+    }
+
+  private:
+
+    typedef persistent_node_t<int, int> node_t;
+
+    static bool test_keys( const persistent_rbtree<int, int>::snapshot &snapshot, const std::set<int> &keys )
+    {
+      std::set<int>::const_iterator k = keys.begin();
+      for( persistent_rbtree<int, int>::iterator itr = snapshot.begin(); itr != snapshot.end(); ++itr, ++k )
+        if( k == keys.end() || itr->key != *k )
+          return false;
+      return k == keys.end();
+    }
+
+    static void collect( const persistent_rbtree<int, int> &t, const node_t *node, std::set<const node_t*> &nodes )
+    {
+      if( !node ) return;
+      nodes.insert( node );
+      collect( t, t.left_of( node ), nodes );
+      collect( t, t.right_of( node ), nodes );
+    }
+
+    template<typename TREE, typename N>
+    static std::pair<bool, int> test_invariant( const TREE &t, const N *root )
+    {
+      // base case
+      if( !root )
+        return std::make_pair( true, 0 );
+
+      int black = 0;
+      if( t.colour_of( root ) == RED )
+      {
+        // RED node cannot have RED children
+        if( t.colour_of( t.left_of( root ) ) == RED || t.colour_of( t.right_of( root ) ) == RED )
+          return std::make_pair( false, -1 );
+      }
+      else
+        black += 1;
+
+      std::pair<bool, int> l = test_invariant( t, t.left_of( root ) );
+      std::pair<bool, int> r = test_invariant( t, t.right_of( root ) );
+
+      if( !l.first || !r.first || l.second != r.second )
+        return std::make_pair( false, -1 );
+
+      return std::make_pair( true, l.second + black );
+    }
+
+    // max is the highest high in the subtree
+    template<typename TREE, typename N>
+    static bool test_intervals( const TREE &t, const N *root )
+    {
+      if( !test_invariant( t, root ).first )
+        return false;
+      return test_max( t, root );
+    }
+
+    template<typename TREE, typename N>
+    static bool test_max( const TREE &t, const N *node )
+    {
+      if( !node )
+        return true;
+      int max = node->high;
+      if( t.left_of( node ) ) max = std::max( max, t.summary_of( t.left_of( node ) ).max );
+      if( t.right_of( node ) ) max = std::max( max, t.summary_of( t.right_of( node ) ).max );
+      return t.summary_of( node ).max == max && test_max( t, t.left_of( node ) ) && test_max( t, t.right_of( node ) );
+    }
+
+    persistent_rbtree<int, int> tree;
+    std::set<int> keys;
+};
+
+#endif /* PERSISTENT_RBTREE_TESTER_HH_ */
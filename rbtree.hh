@@ -8,8 +8,22 @@
 #ifndef RBTREE_HH_
 #define RBTREE_HH_
 
-#include <memory>
+#include "node_pool.hh"
+#include "task_pool.hh"
+
 #include <exception>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <system_error>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <iterator>
+#include <cstddef>
 
 class rb_invariant_error : public std::exception
 {
@@ -24,651 +38,2155 @@ class rb_invariant_error : public std::exception
 
 };
 
-enum colour_t
+// Augmentation policies:
+// each node keeps a summary of its subtree, that is:
+//
+//   combine( combine( left summary, lift( node ) ), right summary )
+//
+// (missing children are simply left out, so combine has
+// to be associative but doesn't need an identity)
+//
+// a policy provides:
+//   typedef ... value_type;
+//   template<typename N> static value_type lift( const N &node );
+//   static value_type combine( const value_type &left, const value_type &right );
+//
+// rbtree keeps the summaries up to date in rotations,
+// inserts and erases
+
+// nothing is stored in the nodes and all
+// the bookkeeping compiles away
+struct no_augmentation
 {
-  RED = true,
-  BLACK = false
+    struct value_type { };
+
+    template<typename N>
+    static value_type lift( const N& ) { return value_type(); }
+
+    static value_type combine( const value_type&, const value_type& ) { return value_type(); }
 };
 
-template<typename K, typename V>
-class node_t
+// stores the summary in the node (empty
+// summaries take no space at all)
+template<typename S, bool EMPTY = std::is_empty<S>::value>
+class summary_holder
 {
-  template<typename, typename, typename> friend class rbtree;
-  friend class rbtree_tester;
-
   public:
-    node_t( const K &key, const V &value ) : key( key ), value( value ), colour( RED ), parent( nullptr ) { }
+    typedef const S& reference;
 
-    const K key;
-    V value;
+    const S& summary() const { return value; }
+    void summary( const S &s ) { value = s; }
 
   private:
-    colour_t colour;
-    node_t* parent;
+    S value;
+};
+
+template<typename S>
+class summary_holder<S, true>
+{
+  public:
+    typedef S reference;
+
+    S summary() const { return S(); }
+    void summary( const S& ) { }
+};
+
+// L is the link storage: pointer_links (used with node_pool)
+// or index_links (used with index_node_pool), A is the
+// augmentation policy (the summary goes first, so it packs
+// well with the 32-bit index links)
+template<typename K, typename V, template<typename> class L = pointer_links, typename A = no_augmentation>
+class node_t : private summary_holder<typename A::value_type>, private L< node_t<K, V, L, A> >
+{
+  template<typename, size_t> friend class node_pool;
+  template<typename, size_t> friend class index_node_pool;
+  template<typename, typename, typename, typename, typename> friend class rbtree;
+
+  public:
+    typedef A augmentation;
+
+    // the value is constructed in place from args
+    template<typename KK, typename ... Args>
+    node_t( KK &&key, Args&& ... args ) : key( std::forward<KK>( key ) ), value( std::forward<Args>( args )... ) { }
 
-    std::unique_ptr<node_t> left;
-    std::unique_ptr<node_t> right;
+    const K key;
+    V value;
 };
 
-template<typename K, typename V, typename N = node_t<K, V> >
+template<typename K, typename V, template<typename> class L, typename A>
+inline const K& node_key( const node_t<K, V, L, A> &node )
+{
+  return node.key;
+}
+
+// O is the order of the keys, a strict weak ordering (the keys are
+// equal if neither is less than the other), it is default constructed
+// for every comparison so it can't carry any state
+template<typename K, typename V, typename N = node_t<K, V>, typename P = node_pool<N>, typename O = std::less<K> >
 class rbtree
 {
     friend class rbtree_tester;
     friend class interval_tree_tester;
+    friend class order_statistic_tree_tester;
 
   protected:
 
-    static std::unique_ptr<N> make_node( const K &key, const V &value )
-    {
-      return std::unique_ptr<N>( new N( key, value ) );
-    }
+    typedef typename N::augmentation augmentation;
+
+    typedef typename augmentation::value_type summary_t;
+
+    // false if there is nothing to keep up to date
+    static const bool augmented = !std::is_empty<summary_t>::value;
 
-    static void swap_right_child( std::unique_ptr<N> &node, std::unique_ptr<N> &successor )
+    // true if the nodes link to their in-order neighbours
+    static const bool threaded = std::is_base_of< threaded_links<N>, N >::value;
+
+    template<typename ... Args>
+    N* make_node( Args&& ... args )
     {
-      std::swap( node->colour, successor->colour );
-      // first do the obvious
-      std::swap( node->left, successor->left );
-      if( node->left ) node->left->parent = node.get();
-      if( successor->left ) successor->left->parent = successor.get();
-      // now gather remaining pointers
-      N *p = node->parent;
-      N *n = node.release();
-      N *s = successor.release();
-      N *s_right = s->right.release();
-      // and finally reassign those pointers
-      s->parent = p;
-      node.reset( s );
-      s->right.reset( n );
-      n->parent = s;
-      n->right.reset( s_right );
-      if( s_right ) s_right->parent = n;
+      return pool.create( std::forward<Args>( args )... );
     }
 
-    static void swap_successor( std::unique_ptr<N> &node, std::unique_ptr<N> &successor )
+    // swaps the node with its in-order successor (the
+    // successor is the leftmost node in the right subtree
+    // so it does not have a left child)
+    void swap_successor( N *node, N *successor, N* &root )
     {
-      // first check if successor is a direct child of node,
-      // since it is the in-order successor it can be only
-      // the right child
+      N *parent = parent_of( node );
+      N *left = left_of( node );
+      N *right = right_of( node );
+      N *successor_parent = parent_of( successor );
+      N *successor_right = right_of( successor );
 
-      if( node->right.get() == successor.get() )
+      // swap colour
+      colour_t colour = colour_of( node );
+      set_colour( node, colour_of( successor ) );
+      set_colour( successor, colour );
+
+      // the successor takes the place of the node
+      replace_child( parent, node, successor, root );
+      set_parent( successor, parent );
+      set_left( successor, left );
+      set_parent( left, successor );
+      if( right == successor )
       {
-        // it is the right child
-        swap_right_child( node, successor );
-        return;
+        // the successor is the right child of the node
+        set_right( successor, node );
+        set_parent( node, successor );
       }
-      // swap colour
-      std::swap( node->colour, successor->colour );
-      // swap parents
-      std::swap( node, successor );
-      std::swap( node->parent, successor->parent );
-      // swap left
-      std::swap( node->left, successor->left );
-      if( node->left ) node->left->parent = node.get();
-      if( successor->left ) successor->left->parent = successor.get();
-      // swap right
-      std::swap( node->right, successor->right );
-      if( node->right ) node->right->parent = node.get();
-      if( successor->right ) successor->right->parent = successor.get();
+      else
+      {
+        set_right( successor, right );
+        set_parent( right, successor );
+        set_left( successor_parent, node );
+        set_parent( node, successor_parent );
+      }
+
+      // and the node takes the place of the successor
+      set_left( node, nullptr );
+      set_right( node, successor_right );
+      if( successor_right ) set_parent( successor_right, node );
     }
 
-    static std::unique_ptr<N> null_node;
+  public:
 
-    // this class is just used in rb_erase_case# methods as
-    // they need to accept a leaf (null) node as an argument
-    // that can return its parent and is BLACK
-    struct leaf_node_t
+    // bidirectional iterator over the nodes in order of the keys,
+    // end() steps back to the last node (except for the end of
+    // a subtree, which doesn't know where it belongs); CONST makes
+    // it a const_iterator
+    template<bool CONST>
+    class iterator_t
     {
-        leaf_node_t( N *parent ) : colour( BLACK ), parent( parent ) { }
+        friend class rbtree;
+        template<bool> friend class iterator_t;
+
+      public:
+
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef N value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef typename std::conditional<CONST, const N*, N*>::type pointer;
+        typedef typename std::conditional<CONST, const N&, N&>::type reference;
+
+        iterator_t() : node( nullptr ), tree( nullptr ) { }
+
+        // an iterator converts to a const_iterator
+        template<bool OTHER, typename = typename std::enable_if<CONST && !OTHER>::type>
+        iterator_t( const iterator_t<OTHER> &itr ) : node( itr.node ), tree( itr.tree ) { }
+
+        pointer operator->() const
+        {
+          return node;
+        }
+
+        reference operator*() const
+        {
+          return *node;
+        }
 
-        leaf_node_t( const leaf_node_t &leaf ) : colour( leaf.colour ), parent( leaf.parent ) { }
+        operator bool() const
+        {
+          return bool( node );
+        }
 
-        leaf_node_t& operator=( const leaf_node_t &leaf )
+        iterator_t& operator++()
         {
-          colour = leaf.colour;
-          parent = leaf.parent;
+          if( node ) node = tree->next_in_order( node );
           return *this;
         }
 
-        leaf_node_t* operator->()
+        iterator_t operator++( int )
         {
-          return this;
+          iterator_t itr( *this );
+          ++*this;
+          return itr;
         }
 
-        leaf_node_t& operator*()
+        iterator_t& operator--()
         {
+          node = node ? tree->prev_in_order( node ) : tree->find_max( tree->tree_root );
           return *this;
         }
 
-        operator bool() const
+        iterator_t operator--( int )
+        {
+          iterator_t itr( *this );
+          --*this;
+          return itr;
+        }
+
+        template<bool OTHER>
+        bool operator==( const iterator_t<OTHER> &itr ) const
         {
-          return true;
+          return node == itr.node;
         }
 
-        bool operator==( N *node ) const
+        template<bool OTHER>
+        bool operator!=( const iterator_t<OTHER> &itr ) const
         {
-          return node == nullptr;
+          return node != itr.node;
         }
 
-        colour_t colour;
-        N *parent;
+      private:
+
+        iterator_t( N *node, const rbtree *tree ) : node( node ), tree( tree ) { }
+
+        N             *node;
+        const rbtree  *tree;
     };
 
-  public:
+    typedef iterator_t<false> iterator;
+
+    typedef iterator_t<true> const_iterator;
 
-    class iterator
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    // a part of the tree cut out with split or extract_range, the
+    // nodes still live in the pool of the tree (so the tree has to
+    // outlive it), it can be put back with join or freed with release
+    // (or on destruction) whenever it's convenient
+    class subtree
     {
+        friend class rbtree;
+        friend class rbtree_tester;
+        friend class interval_tree_tester;
+
       public:
 
-        iterator( N *node = 0 ) : node( node ) { }
+        subtree() : tree( nullptr ), root( nullptr ), count( 0 ) { }
 
-        N* operator->()
+        subtree( subtree &&other ) : tree( other.tree ), root( other.root ), count( other.count )
         {
-          return node;
+          other.root = nullptr;
+          other.count = 0;
         }
 
-        N& operator*()
+        subtree& operator=( subtree &&other )
         {
-          return *node;
+          if( this != &other )
+          {
+            release();
+            tree = other.tree;
+            root = other.root;
+            count = other.count;
+            other.root = nullptr;
+            other.count = 0;
+          }
+          return *this;
         }
 
-        const N* operator->() const
+        ~subtree()
         {
-          return node;
+          release();
         }
 
-        const N& operator*() const
+        bool empty() const
         {
-          return *node;
+          return !root;
         }
 
-        operator bool() const
+        // O(k) the first time
+        size_t size() const
         {
-          return bool( node );
+          if( count == unknown_size )
+            count = tree->count_nodes( root );
+          return count;
         }
 
-        iterator& operator++()
+        iterator begin() const
         {
-          if( !node )
-            return *this;
-
-          if( node->right )
-          {
-            node = node->right.get();
-            while( node->left )
-              node = node->left.get();
-            return *this;
-          }
+          return root ? tree->make_iterator( tree->find_min( root ) ) : iterator();
+        }
 
-          N *parent = node->parent;
-          while( parent && is_right( node ) )
-          {
-            node = parent;
-            parent = node->parent;
-          }
-          node = parent;
-          return *this;
+        iterator end() const
+        {
+          return iterator();
         }
 
-        bool operator!=( const iterator &itr )
+        // gives the nodes back to the pool, O(k)
+        void release()
         {
-          return node != itr.node;
+          if( !root ) return;
+          tree->destroy_subtree( root );
+          --tree->detached;
+          root = nullptr;
+          count = 0;
         }
 
       private:
 
-        N *node;
+        subtree( rbtree *tree, N *root ) : tree( tree ), root( root ), count( root ? unknown_size : 0 ) { }
+
+        // takes the nodes away (they are joined into a tree)
+        N* take()
+        {
+          N *node = root;
+          if( root ) --tree->detached;
+          root = nullptr;
+          count = 0;
+          return node;
+        }
+
+        rbtree         *tree;
+        N              *root;
+        mutable size_t  count;
     };
 
-    rbtree() : tree_size( 0 ) { }
+    rbtree() : tree_root( nullptr ), tree_size( 0 ), detached( 0 ), finger( nullptr ), finger_next( nullptr ), finger_known( false ), finger_on( false ) { }
+
+    rbtree( const rbtree& ) = delete;
 
-    virtual ~rbtree() { }
+    rbtree& operator=( const rbtree& ) = delete;
 
-    void insert( const K &key, const V &value )
+    // not virtual, the trees are not meant to be
+    // deleted through a pointer to the base class
+    ~rbtree()
     {
-      insert_into( key, value, tree_root );
+      clear();
     }
 
-    void erase( const K &key )
+    // the inserts return the node with the key and whether it
+    // is a new one (if the key was there already, the tree is
+    // left as it is and the value is not used)
+    std::pair<iterator, bool> insert( const K &key, const V &value )
     {
-      std::unique_ptr<N> &node = find_in( key, tree_root );
-      erase_node( node );
+      return try_emplace( key, value );
     }
 
-    void clear()
+    std::pair<iterator, bool> insert( const K &key, V &&value )
     {
-      tree_root.reset();
-      tree_size = 0;
+      return try_emplace( key, std::move( value ) );
     }
 
-    iterator find( const K &key )
+    std::pair<iterator, bool> insert( K &&key, V &&value )
     {
-      const std::unique_ptr<N> &n = find_in( key, tree_root );
-      return iterator( n.get() );
+      return try_emplace( std::move( key ), std::move( value ) );
     }
 
-    const iterator find( const K &key ) const
+    // the node is made from args (the key and the arguments of
+    // the value) first, and destroyed again if the key is there
+    template<typename ... Args>
+    std::pair<iterator, bool> emplace( Args&& ... args )
     {
-      const std::unique_ptr<N> &n = find_in( key, tree_root );
-      return iterator( n.get() );
+      N *node = make_node( std::forward<Args>( args )... );
+      std::pair<N*, bool> result = insert_with( key_of( node ), [node]() { return node; } );
+      if( !result.second ) pool.destroy( node );
+      return std::make_pair( make_iterator( result.first ), result.second );
     }
 
-    size_t size() const
+    // the value is constructed in place from args, and only
+    // if the key is not there yet
+    template<typename ... Args>
+    std::pair<iterator, bool> try_emplace( const K &key, Args&& ... args )
     {
-      return tree_size;
+      std::pair<N*, bool> result = insert_node( key, key, std::forward<Args>( args )... );
+      return std::make_pair( make_iterator( result.first ), result.second );
     }
 
-    bool empty() const
+    template<typename ... Args>
+    std::pair<iterator, bool> try_emplace( K &&key, Args&& ... args )
     {
-      return !tree_root;
+      std::pair<N*, bool> result = insert_node( key, std::move( key ), std::forward<Args>( args )... );
+      return std::make_pair( make_iterator( result.first ), result.second );
     }
 
-    iterator begin()
+    // like insert, but if the key is there its value is
+    // assigned from value
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign( const K &key, M &&value )
     {
-      N *node = tree_root.get();
-      if( !node ) return iterator();
-      while( node->left )
-      {
-        node = node->left.get();
-      }
+      std::pair<iterator, bool> result = try_emplace( key, std::forward<M>( value ) );
+      if( !result.second ) result.first->value = std::forward<M>( value );
+      return result;
+    }
 
-      return iterator( node );
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign( K &&key, M &&value )
+    {
+      std::pair<iterator, bool> result = try_emplace( std::move( key ), std::forward<M>( value ) );
+      if( !result.second ) result.first->value = std::forward<M>( value );
+      return result;
     }
 
-    iterator end()
+    // like std::map, if the key goes right before hint the node is
+    // linked there without a search (e.g. insert( end(), ... ) for
+    // increasing keys), otherwise it's an ordinary insert; returns
+    // the node with the key
+    iterator insert( const_iterator hint, const K &key, const V &value )
     {
-      return iterator();
+      return make_iterator( insert_node_hint( hint, key, key, value ).first );
     }
 
-  protected:
+    iterator insert( const_iterator hint, K &&key, V &&value )
+    {
+      return make_iterator( insert_node_hint( hint, key, std::move( key ), std::move( value ) ).first );
+    }
 
-    void insert_into( const K &key, const V &value, std::unique_ptr<N> &node, N *parent = nullptr )
+    // with the finger on, insert looks for the key from the last
+    // inserted node rather than from the root: a run of increasing
+    // keys (e.g. timestamps) costs O(1) amortised per insert plus the
+    // fix-up, a key d nodes away from the last one O(log d), but a
+    // random key up to twice the comparisons of an ordinary insert
+    void use_finger( bool on = true )
     {
-      if( !node )
-      {
-        node = make_node( key, value );
-        node->parent = parent;
-        ++tree_size;
-        rb_insert_case1( node.get() );
-        return;
-      }
+      finger_on = on;
+    }
 
-      if( key == node->key )
-        return;
+    void erase( const K &key )
+    {
+      erase_node( find_in( key, tree_root ) );
+    }
 
-      if( key < node->key )
-        insert_into( key, value, node->left, node.get() );
-      else
-        insert_into( key, value, node->right, node.get() );
+    void clear()
+    {
+      // the pool gives back all the memory at once, so we
+      // only need to visit the nodes if they have something
+      // to clean up (or if there are detached subtrees, then
+      // the nodes go back to the pool one by one)
+      if( detached || !std::is_trivially_destructible<N>::value )
+        destroy_subtree( tree_root );
+      if( !detached )
+        pool.release();
+      tree_root = nullptr;
+      tree_size = 0;
+      finger = nullptr;
     }
 
-    void erase_node( std::unique_ptr<N> &node )
+    // moves the keys >= key out of the tree, O(log n)
+    subtree split( const K &key )
     {
-      if( !node ) return;
+      N *left, *right;
+      size_t left_height, right_height;
+      split_tree( tree_root, black_height( tree_root ), key, left, left_height, right, right_height );
+      set_root( left );
+      if( threaded ) unthread( left, right );
+      return make_subtree( right );
+    }
 
-      if( has_two( node.get() ) )
+    // moves the keys in [ first, last ) out of the tree, O(log n)
+    subtree extract_range( const K &first, const K &last )
+    {
+      if( !key_less( first, last ) ) return make_subtree( nullptr );
+      N *left, *rest, *middle, *right;
+      size_t left_height, rest_height, middle_height, right_height, height;
+      split_tree( tree_root, black_height( tree_root ), first, left, left_height, rest, rest_height );
+      split_tree( rest, rest_height, last, middle, middle_height, right, right_height );
+      if( threaded && middle )
       {
-        // in this case:
-        // 1. look for the in-order successor
-        // 2. replace the node with the in-order successor
-        // 3. erase the in-order successor
-        N *n = node.get();
-        std::unique_ptr<N> &successor = find_successor( node );
-        swap_successor( node, successor );
-        // we swapped the node with successor and the
-        // 'successor' unique pointer holds now the node
-        if( successor.get() == n )
-          erase_node( successor );
-        // otherwise the successor was the right child of node,
-        // hence node should be now the right child of 'node'
-        // unoique pointer
-        else if( node->right.get() == n )
-          erase_node( node->right );
-        // there are no other cases so anything else is wrong
-        else
-          throw std::logic_error( "Bad rbtree swap." );
-        return;
+        N *before = left ? find_max( left ) : nullptr;
+        N *after = right ? find_min( right ) : nullptr;
+        thread( before, after );
+        thread( nullptr, find_min( middle ) );
+        thread( find_max( middle ), nullptr );
       }
+      set_root( join_trees( left, left_height, right, right_height, height ) );
+      return make_subtree( middle );
+    }
 
-      // node has at most one child
-      // in this case simply replace the node with the
-      // single child or null if there are no children
-      N *parent = node->parent;
-      std::unique_ptr<N> &child = node->left ? node->left : node->right;
-      colour_t old_colour = node->colour;
-      if( child ) child->parent = node->parent;
-      node.reset( child.release() );
-      --tree_size;
-      if( old_colour == BLACK)
-      {
-        if( node && node->colour == RED )
-          node->colour = BLACK;
-        else
-        {
-          // if we are here the node is null because a BLACK
-          // node that has at most one non-leaf child must
-          // have two null children (null children are BLACK)
-          if( node ) throw rb_invariant_error();
-          rb_erase_case1( leaf_node_t( parent ) );
-        }
+    // puts back a subtree cut out of this tree, its keys have to fit
+    // in between two neighbouring keys of the tree (or below or above
+    // all of them), otherwise std::invalid_argument is thrown, O(log n)
+    void join( subtree &&other )
+    {
+      check_subtree( other );
+      if( other.empty() ) return;
+
+      // the smallest key in the tree that is not below the subtree
+      const K &first = key_of( find_min( other.root ) );
+      N *next = lower_bound_in( first, tree_root );
+      if( next && !key_less( key_of( find_max( other.root ) ), key_of( next ) ) )
+        throw std::invalid_argument( "rbtree: join of overlapping key ranges" );
+      if( threaded )
+      {
+        thread( next ? prev_in_order( next ) : find_max( tree_root ), find_min( other.root ) );
+        thread( find_max( other.root ), next );
       }
-      else if( node )
-        // if the node was red it has to have two BLACK children
-        // and since at most one of those children is a non-leaf
-        // child actually both have to be leafs (null) in order
-        // to satisfy the red-black tree invariant
-        throw rb_invariant_error();
+
+      N *left, *right, *middle = other.take();
+      size_t left_height, right_height, height;
+      split_tree( tree_root, black_height( tree_root ), first, left, left_height, right, right_height );
+      left = join_trees( left, left_height, middle, black_height( middle ), height );
+      set_root( join_trees( left, height, right, right_height, height ) );
     }
 
-    template<typename PTR> // make it a template so it works both for constant and mutable pointers
-    static PTR& find_in( const K &key, PTR &node )
+    // joins two subtrees cut out of this tree, the keys in left
+    // have to be below the keys in right, O(log n)
+    subtree join( subtree &&left, subtree &&right )
     {
-      if( !node ) return null_node;
-
-      if( key == node->key )
-        return node;
+      check_subtree( left );
+      check_subtree( right );
+      if( !left.empty() && !right.empty() && !key_less( key_of( find_max( left.root ) ), key_of( find_min( right.root ) ) ) )
+        throw std::invalid_argument( "rbtree: join of overlapping key ranges" );
+      if( threaded && !left.empty() && !right.empty() )
+        thread( find_max( left.root ), find_min( right.root ) );
+
+      N *l = left.take();
+      N *r = right.take();
+      size_t height;
+      return make_subtree( join_trees( l, black_height( l ), r, black_height( r ), height ) );
+    }
 
-      if( key < node->key )
-        return find_in( key, node->left );
-      else
-        return find_in( key, node->right );
+    // replaces the content of the tree with the ( key, value ) pairs
+    // from [ first, last ), which have to be sorted by key without
+    // duplicates (otherwise std::invalid_argument is thrown and the
+    // tree is left empty)
+    //
+    // O(n), with threads > 1 the subtrees are linked in parallel
+    template<typename It>
+    void build_from_sorted( It first, It last, unsigned threads = 1 )
+    {
+      build_sorted( first, last, [this]( It itr ) { return make_node( itr->first, itr->second ); }, threads );
     }
 
-    template<typename PTR> // make it a template so it works both for constant and mutable pointers
-    static PTR& find_min( PTR &node )
+    // inserts the ( key, value ) pairs from [ first, last ) (forward
+    // iterators), like insert keys that are already in the tree are
+    // skipped and so are repeated keys in the batch (the first wins)
+    //
+    // the batch is sorted, so the searches for neighbouring keys
+    // share the cached top of the path; batches at least as big as
+    // the tree are merged with it in O(n + m), computing each summary
+    // only once
+    template<typename It>
+    void insert_batch( It first, It last )
     {
-      if( !node ) return null_node;
-      if( node->left )
-        return find_min( node->left );
-      return node;
+      insert_batch_by( first, last, []( It itr ) -> const K& { return itr->first; },
+                       [this]( It itr ) { return make_node( itr->first, itr->second ); } );
     }
 
-    template<typename PTR> // make it a template so it works both for constant and mutable pointers
-    static PTR& find_successor( PTR &node )
+    // erases the keys from [ first, last ) (forward iterators)
+    template<typename It>
+    void erase_batch( It first, It last )
     {
-      if( !node ) return null_node;
-      return find_min( node->right );
+      erase_batch_by( first, last, []( It itr ) -> const K& { return *itr; }, []( const N*, It ) { return true; } );
     }
 
-    static bool has_two( const N *node )
+    // set operations with another tree of the same type (which is
+    // left as it is): union_with adds copies of the nodes of other
+    // with keys that are not in this tree yet, intersection_with
+    // keeps only the keys that are in other as well and
+    // difference_with only those that are not
+    //
+    // divide and conquer along this tree: the matching range of other
+    // is found with a binary search, the two halves are combined in
+    // parallel (with threads > 1) and joined back in O(log n); the
+    // result is the same whatever the number of threads, and the
+    // bigger tree should be this one, that's the one that gets split
+    //
+    // if copying a node of other throws, this tree is left empty
+    // (its nodes are destroyed, none of them is leaked) and other
+    // as it is
+    void union_with( const rbtree &other, unsigned threads = 1 )
     {
-      return node->left && node->right;
+      set_operation( other, set_union, threads, []( const N*, const N* ) { return true; },
+                     [this]( const N *node ) { return make_node( node->key, node->value ); } );
     }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    void intersection_with( const rbtree &other, unsigned threads = 1 )
+    {
+      set_operation( other, set_intersection, threads, []( const N*, const N* ) { return true; },
+                     [this]( const N *node ) { return make_node( node->key, node->value ); } );
+    }
 
-    static void replace( std::unique_ptr<N> &ptr, N *node )
+    void difference_with( const rbtree &other, unsigned threads = 1 )
     {
-      ptr.release();
-      ptr.reset( node );
+      set_operation( other, set_difference, threads, []( const N*, const N* ) { return true; },
+                     [this]( const N *node ) { return make_node( node->key, node->value ); } );
     }
 
-    virtual void right_rotation( N *node )
+    iterator find( const K &key )
     {
-      if( !node ) return;
+      N *n = find_in( key, tree_root );
+      return make_iterator( n );
+    }
 
-      N *parent = node->parent;
-      N *left_child = node->left.release();
+    const_iterator find( const K &key ) const
+    {
+      N *n = find_in( key, tree_root );
+      return make_iterator( n );
+    }
 
-      bool is_left = ( parent && parent->left.get() == node ) ? true : false;
+    // the first key not below key, O(log n), so a scan of the k keys
+    // in a range costs O(log n + k)
+    iterator lower_bound( const K &key )
+    {
+      return make_iterator( lower_bound_in( key, tree_root ) );
+    }
 
-      node->left.reset( left_child->right.release() );
-      if( node->left ) node->left->parent = node;
+    const_iterator lower_bound( const K &key ) const
+    {
+      return make_iterator( lower_bound_in( key, tree_root ) );
+    }
 
-      left_child->right.reset( node );
-      if( left_child->right ) left_child->right->parent = left_child;
+    // the first key above key
+    iterator upper_bound( const K &key )
+    {
+      return make_iterator( upper_bound_in( key, tree_root ) );
+    }
 
-      left_child->parent = parent;
-      if( !parent )
-        replace( tree_root, left_child );
-      else if( is_left )
-        replace( parent->left, left_child );
-      else
-        replace( parent->right, left_child );
+    const_iterator upper_bound( const K &key ) const
+    {
+      return make_iterator( upper_bound_in( key, tree_root ) );
     }
 
-    virtual void left_rotation( N *node )
+    std::pair<iterator, iterator> equal_range( const K &key )
     {
-      if( !node ) return;
+      return std::make_pair( lower_bound( key ), upper_bound( key ) );
+    }
 
-      N *parent = node->parent;
-      N *right_child = node->right.release();
+    std::pair<const_iterator, const_iterator> equal_range( const K &key ) const
+    {
+      return std::make_pair( lower_bound( key ), upper_bound( key ) );
+    }
 
-      bool is_left = ( parent && parent->left.get() == node ) ? true : false;
+    size_t size() const
+    {
+      // split, extract_range and join leave it to be recounted
+      if( tree_size == unknown_size )
+        tree_size = count_nodes( tree_root );
+      return tree_size;
+    }
 
-      node->right.reset( right_child->left.release() );
-      if( node->right ) node->right->parent = node;
+    bool empty() const
+    {
+      return !tree_root;
+    }
 
-      right_child->left.reset( node );
-      if( right_child->left ) right_child->left->parent = right_child;
+    iterator begin()
+    {
+      return make_iterator( find_min( tree_root ) );
+    }
 
-      right_child->parent = parent;
-      if( !parent )
-        replace( tree_root, right_child );
-      else if( is_left )
-        replace( parent->left, right_child );
-      else
-        replace( parent->right, right_child );
+    iterator end()
+    {
+      return make_iterator( nullptr );
     }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    const_iterator begin() const
+    {
+      return make_iterator( find_min( tree_root ) );
+    }
 
-    N* get_grandparent( N *node )
+    const_iterator end() const
     {
-      if( !node || !node->parent ) return nullptr;
-      return node->parent->parent;
+      return make_iterator( nullptr );
     }
 
-    N* get_uncle( N *node )
+    const_iterator cbegin() const
     {
-      N *grandparent = get_grandparent( node );
-      if( !grandparent ) return nullptr;
-      if( grandparent->left.get() == node->parent )
-        return grandparent->right.get();
-      else
-        return grandparent->left.get();
+      return begin();
     }
 
-    void rb_insert_case1( N *node )
+    const_iterator cend() const
     {
-      if( node->parent == nullptr ) // it is the root
-        node->colour = BLACK;
-      else
-        rb_insert_case2( node );
+      return end();
     }
 
-    void rb_insert_case2( N *node )
+    reverse_iterator rbegin()
     {
-      if( node->parent->colour == BLACK )
-        return; // the invariant is OK
-      else
-        rb_insert_case3( node );
+      return reverse_iterator( end() );
     }
 
-    void rb_insert_case3( N *node )
+    reverse_iterator rend()
     {
-      N *uncle = get_uncle( node );
-      if( uncle && uncle->colour == RED )
-      {
-        node->parent->colour = BLACK;
-        uncle->colour = BLACK;
-        N *grandparent = get_grandparent( node );
-        grandparent->colour = RED;
-        rb_insert_case1( grandparent );
-      }
-      else
-        rb_insert_case4( node );
+      return reverse_iterator( begin() );
     }
 
-    void rb_insert_case4( N *node )
+    const_reverse_iterator rbegin() const
     {
-      N *grandparent = get_grandparent( node );
+      return const_reverse_iterator( end() );
+    }
 
-      if( ( node == node->parent->right.get() ) && ( node->parent == grandparent->left.get() ) )
-      {
-        left_rotation( grandparent->left.get() );
-        node = node->left.get();
-      }
-      else if( ( node == node->parent->left.get() ) && ( node->parent == grandparent->right.get() ) )
-      {
-        right_rotation( grandparent->right.get() );
-        node = node->right.get();
-      }
+    const_reverse_iterator rend() const
+    {
+      return const_reverse_iterator( begin() );
+    }
 
-      rb_insert_case5( node );
+    const_reverse_iterator crbegin() const
+    {
+      return rbegin();
     }
 
-    void rb_insert_case5( N *node )
+    const_reverse_iterator crend() const
     {
-      N *grandparent = get_grandparent( node );
-      node->parent->colour = BLACK;
-      grandparent->colour = RED;
-      if( node == node->parent->left.get() )
-        right_rotation( grandparent );
-      else
-        left_rotation( grandparent );
+      return rend();
     }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////
+  protected:
 
-    template<typename NODE>
-    static bool is_left( NODE node )
+    iterator make_iterator( N *node ) const
     {
-      return node == node->parent->left.get();
+      return iterator( node, this );
     }
 
-    template<typename NODE>
-    static bool is_right( NODE node )
+    // all the access to the links goes through the pool,
+    // it knows how they are stored in the node
+
+    // node_key may as well return the key by value (built from
+    // the fields of the node, see interval_tree)
+    static auto key_of( const N *node ) -> decltype( node_key( *node ) ) { return node_key( *node ); }
+
+    static bool key_less( const K &x, const K &y ) { return O()( x, y ); }
+
+    static bool key_equal( const K &x, const K &y ) { return !key_less( x, y ) && !key_less( y, x ); }
+
+    N* parent_of( const N *node ) const { return pool.parent( node ); }
+    N* left_of( const N *node ) const { return pool.left( node ); }
+    N* right_of( const N *node ) const { return pool.right( node ); }
+
+    colour_t colour_of( const N *node ) const
     {
-      return node == node->parent->right.get();
+      // null (leaf) nodes are BLACK
+      return node ? pool.colour( node ) : BLACK;
     }
 
-    template<typename NODE>
-    N* get_sibling( NODE node )
+    void set_parent( N *node, N *parent ) { if( node ) pool.set_parent( node, parent ); }
+    void set_left( N *node, N *left ) { pool.set_left( node, left ); }
+    void set_right( N *node, N *right ) { pool.set_right( node, right ); }
+    void set_colour( N *node, colour_t colour ) { pool.set_colour( node, colour ); }
+
+    typename summary_holder<summary_t>::reference summary_of( const N *node ) const
     {
-      if( !node && !node->parent )
-        return nullptr;
-      if( is_left( node ) )
-        return node->parent->right.get();
-      else
-        return node->parent->left.get();
+      return node->summary();
     }
 
-    template<typename NODE>
-    void rb_erase_case1( NODE node )
+    // recomputes the summary of the node from its children
+    void update_summary( N *node )
     {
-      if( node->parent != nullptr )
-        rb_erase_case2( node );
+      if( !augmented ) return;
+      summary_t summary = augmentation::lift( *node );
+      if( N *left = left_of( node ) )
+        summary = augmentation::combine( left->summary(), summary );
+      if( N *right = right_of( node ) )
+        summary = augmentation::combine( summary, right->summary() );
+      node->summary( summary );
     }
 
-    template<typename NODE>
-    void rb_erase_case2( NODE node )
+    // recomputes the summaries from node up to the root
+    void update_path( N *node )
     {
-      N *sibling = get_sibling( node );
-      if( !sibling ) throw rb_invariant_error();
-      if( sibling->colour == RED )
+      if( !augmented ) return;
+      while( node )
       {
-        node->parent->colour = RED;
-        sibling->colour = BLACK;
-        if( is_left( node ) )
-          left_rotation( node->parent );
-        else
-          right_rotation( node->parent );
+        update_summary( node );
+        node = parent_of( node );
       }
+    }
+
+    // args are passed to the node constructor, returns
+    // the node with the key and whether it is a new one
+    template<typename ... Args>
+    std::pair<N*, bool> insert_node( const K &key, Args&& ... args )
+    {
+      return insert_with( key, [&]() { return make_node( std::forward<Args>( args )... ); } );
+    }
+
+    template<typename ... Args>
+    std::pair<N*, bool> insert_node_hint( const const_iterator &hint, const K &key, Args&& ... args )
+    {
+      return insert_hint_with( hint.node, key, [&]() { return make_node( std::forward<Args>( args )... ); } );
+    }
 
-      rb_erase_case3( node );
+    // create() makes the node (if the key is not there yet),
+    // it may move from key (which is not looked at afterwards)
+    template<typename F>
+    std::pair<N*, bool> insert_with( const K &key, F create )
+    {
+      if( finger_on && finger ) return insert_near_finger( key, create );
+      return insert_below( key, nullptr, false, create );
     }
 
-    template<typename NODE>
-    void rb_erase_case3( NODE node )
+    // finger search: rather than from the root, the key is looked for
+    // from the finger up to the first ancestor beyond the key and back
+    // down, O(log d) for a key d nodes away from the finger (and O(1)
+    // right after it, if its successor is known)
+    template<typename F>
+    std::pair<N*, bool> insert_near_finger( const K &key, F create )
     {
-      N *sibling = get_sibling( node );
-      if( !sibling ) throw rb_invariant_error();
-      colour_t sibling_left_colour = sibling->left ? sibling->left->colour : BLACK;
-      colour_t sibling_right_colour = sibling->right ? sibling->right->colour : BLACK;
-      if( node->parent->colour == BLACK &&
-          sibling->colour == BLACK &&
-          sibling_left_colour == BLACK &&
-          sibling_right_colour == BLACK )
+      bool right = key_less( key_of( finger ), key );
+      if( !right && !key_less( key, key_of( finger ) ) )
+        return std::make_pair( finger, false );
+
+      if( right && finger_known && ( !finger_next || key_less( key, key_of( finger_next ) ) ) )
+        return right_of( finger ) ? insert_at( finger_next, true, create ) : insert_at( finger, false, create );
+
+      // the ancestors reached from the near side are in between the
+      // finger and the key, the key goes below the far child of the
+      // last of them before the first one beyond the key
+      N *bound = finger;
+      N *node = finger;
+      N *parent = parent_of( node );
+      for( ; parent; node = parent, parent = parent_of( node ) )
       {
-        sibling->colour = RED;
-        rb_erase_case1( node->parent );
+        if( ( right ? right_of( parent ) : left_of( parent ) ) == node ) continue;
+        if( right ? key_less( key, key_of( parent ) ) : key_less( key_of( parent ), key ) ) break;
+        if( right ? !key_less( key_of( parent ), key ) : !key_less( key, key_of( parent ) ) )
+          return std::make_pair( parent, false );
+        bound = parent;
       }
-      else
-        rb_erase_case4( node );
+      // nothing above the finger, so it is the last node
+      if( right && !parent && bound == finger && !right_of( finger ) )
+      {
+        finger_next = nullptr;
+        finger_known = true;
+      }
+      return insert_below( key, bound, !right, create );
     }
 
-    template<typename NODE>
-    void rb_erase_case4( NODE node )
+    // looks for the key from the left or right child of parent
+    // (from the root if parent is null) down
+    template<typename F>
+    std::pair<N*, bool> insert_below( const K &key, N *parent, bool left, F create )
     {
-      N *sibling = get_sibling( node );
-      if( !sibling ) throw rb_invariant_error();
-      colour_t sibling_left_colour = sibling->left ? sibling->left->colour : BLACK;
-      colour_t sibling_right_colour = sibling->right ? sibling->right->colour : BLACK;
-      if( node->parent->colour == RED &&
-          sibling->colour == BLACK &&
-          sibling_left_colour == BLACK &&
-          sibling_right_colour == BLACK )
+      N *node = parent ? ( left ? left_of( parent ) : right_of( parent ) ) : tree_root;
+      while( node )
       {
-        sibling->colour = RED;
-        node->parent->colour = BLACK;
+        left = key_less( key, key_of( node ) );
+        if( !left && !key_less( key_of( node ), key ) )
+          return std::make_pair( node, false );
+        parent = node;
+        node = left ? left_of( node ) : right_of( node );
       }
-      else
-        rb_erase_case5( node );
+
+      return insert_at( parent, left, create );
     }
 
-    template<typename NODE>
-    void rb_erase_case5( NODE node )
+    // std::map hint: if the key goes right before hint (null for the
+    // end), the node is linked there without a search, O(1) amortised
+    // plus the fix-up, otherwise it is an ordinary insert
+    template<typename F>
+    std::pair<N*, bool> insert_hint_with( N *hint, const K &key, F create )
     {
-      N *sibling = get_sibling( node );
-      if( !sibling ) throw rb_invariant_error();
-      colour_t sibling_left_colour = sibling->left ? sibling->left->colour : BLACK;
-      colour_t sibling_right_colour = sibling->right ? sibling->right->colour : BLACK;
-      if( sibling->colour == BLACK )
+      N *prev = hint ? prev_in_order( hint ) : last_node();
+      if( hint && !key_less( key, key_of( hint ) ) )
       {
-        if( is_left( node ) &&
-            sibling_right_colour == BLACK &&
-            sibling_left_colour == RED )
-        {
-          sibling->colour = RED;
-          if( sibling->left ) sibling->left->colour = BLACK;
-          right_rotation( sibling );
-        }
-        else if( is_right( node ) &&
-                 sibling_left_colour == BLACK &&
-                 sibling_right_colour == RED )
-        {
-          sibling->colour = RED;
-          if( sibling->right ) sibling->right->colour = BLACK;
-          left_rotation( sibling );
-        }
+        if( !key_less( key_of( hint ), key ) ) return std::make_pair( hint, false );
+        return insert_with( key, create );
+      }
+      if( prev && !key_less( key_of( prev ), key ) )
+      {
+        if( !key_less( key, key_of( prev ) ) ) return std::make_pair( prev, false );
+        return insert_with( key, create );
       }
+      // if hint has a left child, prev is the rightmost node below it
+      return hint && !left_of( hint ) ? insert_at( hint, true, create ) : insert_at( prev, false, create );
+    }
 
-      rb_erase_case6( node );
+    // the last node, for free if it was the last one inserted
+    N* last_node() const
+    {
+      return finger && finger_known && !finger_next ? finger : find_max( tree_root );
     }
 
-    template<typename NODE>
-    void rb_erase_case6( NODE node )
+    // links the node made by create() as the left or right child
+    // of parent (which has no child on that side), or as the root
+    template<typename F>
+    std::pair<N*, bool> insert_at( N *parent, bool left, F create )
     {
-      N *sibling = get_sibling( node );
-      if( !sibling ) throw rb_invariant_error();
-      sibling->colour = node->parent->colour;
-      node->parent->colour = BLACK;
-      if( is_left( node ) )
+      N *node = create();
+      link_node( node, parent, left );
+      if( threaded )
       {
-        if( sibling->right ) sibling->right->colour = BLACK;
-        left_rotation( node->parent );
+        // in between the parent and its old neighbour
+        N *prev = !parent || !left ? parent : prev_in_order( parent );
+        N *next = !parent || left ? parent : next_in_order( parent );
+        thread( prev, node );
+        thread( node, next );
       }
-      else
+      if( tree_size != unknown_size ) ++tree_size;
+      update_summary( node );
+      update_path( parent );
+      rb_insert_fixup( node, tree_root );
+
+      // the node is the finger now, its successor is the parent if
+      // it went to the left, the successor of the parent otherwise
+      // (known only if the parent was the finger)
+      if( left )
+      {
+        finger_next = parent;
+        finger_known = true;
+      }
+      else if( !parent || parent != finger )
       {
-        if( sibling->left ) sibling->left->colour = BLACK;
-        right_rotation( node->parent );
+        finger_next = nullptr;
+        finger_known = !parent;
       }
+      finger = node;
+      return std::make_pair( node, true );
     }
 
-    std::unique_ptr<N> tree_root;
-    size_t             tree_size;
-};
+    // links a freshly created node as the left or
+    // right child of parent (or as the root if
+    // parent is null)
+    void link_node( N *node, N *parent, bool left )
+    {
+      set_parent( node, parent );
+      if( !parent )
+        tree_root = node;
+      else if( left )
+        set_left( parent, node );
+      else
+        set_right( parent, node );
+    }
+
+    // puts node in the place of child (parent
+    // is the parent of child or null for the root)
+    void replace_child( N *parent, N *child, N *node, N* &root )
+    {
+      if( !parent )
+        root = node;
+      else if( left_of( parent ) == child )
+        set_left( parent, node );
+      else
+        set_right( parent, node );
+    }
+
+    // removes the node from the tree (without rebalancing and
+    // without destroying it), returns the parent of the removed node
+    N* unlink_node( N *node, colour_t &old_colour, N* &child, N* &root )
+    {
+      if( has_two( node ) )
+      {
+        // in this case:
+        // 1. look for the in-order successor
+        // 2. replace the node with the in-order successor
+        // 3. erase the node from the successor's position
+        //    (there it has at most one child)
+        swap_successor( node, find_min( right_of( node ) ), root );
+      }
+
+      // node has at most one child
+      // in this case simply replace the node with the
+      // single child or null if there are no children
+      N *parent = parent_of( node );
+      child = left_of( node ) ? left_of( node ) : right_of( node );
+      old_colour = colour_of( node );
+      set_parent( child, parent );
+      replace_child( parent, node, child, root );
+      return parent;
+    }
+
+    void erase_node( N *node )
+    {
+      if( !node ) return;
+
+      // we don't update the summaries while swapping the node
+      // with its successor, the walk up from the removed position
+      // passes through the new position of the successor
+      colour_t old_colour;
+      N *child;
+      if( node == finger || node == finger_next ) finger = nullptr;
+      if( threaded ) thread( prev_in_order( node ), next_in_order( node ) );
+      N *parent = unlink_node( node, old_colour, child, tree_root );
+      update_path( parent );
+      rb_erase_fixup( old_colour, child, parent, tree_root );
+      pool.destroy( node );
+      if( tree_size != unknown_size ) --tree_size;
+    }
+
+    N* find_in( const K &key, N *node ) const
+    {
+      while( node )
+      {
+        if( key_less( key, key_of( node ) ) )
+          node = left_of( node );
+        else if( key_less( key_of( node ), key ) )
+          node = right_of( node );
+        else
+          return node;
+      }
+      return nullptr;
+    }
+
+    // the first node with a key not below key (null if there is none)
+    N* lower_bound_in( const K &key, N *node ) const
+    {
+      N *bound = nullptr;
+      while( node )
+      {
+        if( key_less( key_of( node ), key ) )
+          node = right_of( node );
+        else
+        {
+          bound = node;
+          node = left_of( node );
+        }
+      }
+      return bound;
+    }
+
+    // the first node with a key above key (null if there is none)
+    N* upper_bound_in( const K &key, N *node ) const
+    {
+      N *bound = nullptr;
+      while( node )
+      {
+        if( key_less( key, key_of( node ) ) )
+        {
+          bound = node;
+          node = left_of( node );
+        }
+        else
+          node = right_of( node );
+      }
+      return bound;
+    }
+
+    N* find_min( N *node ) const
+    {
+      if( !node ) return nullptr;
+      while( N *left = left_of( node ) )
+        node = left;
+      return node;
+    }
+
+    N* find_max( N *node ) const
+    {
+      if( !node ) return nullptr;
+      while( N *right = right_of( node ) )
+        node = right;
+      return node;
+    }
+
+    N* find_successor( N *node ) const
+    {
+      if( !node ) return nullptr;
+      return find_min( right_of( node ) );
+    }
+
+    // in-order next node
+    N* next_node( N *node ) const
+    {
+      if( N *right = right_of( node ) )
+        return find_min( right );
+      N *parent = parent_of( node );
+      while( parent && right_of( parent ) == node )
+      {
+        node = parent;
+        parent = parent_of( node );
+      }
+      return parent;
+    }
+
+    // next_node and prev_node, but in one hop with threaded links
+    // (only for the nodes in the tree or in a subtree cut out of it)
+    N* next_in_order( N *node ) const
+    {
+      return next_in_order( node, std::integral_constant<bool, threaded>() );
+    }
+
+    N* prev_in_order( N *node ) const
+    {
+      return prev_in_order( node, std::integral_constant<bool, threaded>() );
+    }
+
+    N* next_in_order( N *node, std::true_type ) const { return pool.next( node ); }
+    N* next_in_order( N *node, std::false_type ) const { return next_node( node ); }
+
+    N* prev_in_order( N *node, std::true_type ) const { return pool.prev( node ); }
+    N* prev_in_order( N *node, std::false_type ) const { return prev_node( node ); }
+
+    // makes prev and next neighbours (either may be null),
+    // nothing to do without threaded links
+    void thread( N *prev, N *next )
+    {
+      thread( prev, next, std::integral_constant<bool, threaded>() );
+    }
+
+    void thread( N *prev, N *next, std::true_type )
+    {
+      if( prev ) pool.set_next( prev, next );
+      if( next ) pool.set_prev( next, prev );
+    }
+
+    void thread( N*, N*, std::false_type ) { }
+
+    // the sorted nodes become neighbours one after the other
+    void thread_all( const std::vector<N*> &nodes )
+    {
+      if( nodes.empty() ) return;
+      thread( nullptr, nodes.front() );
+      for( size_t i = 1; i < nodes.size(); ++i )
+        thread( nodes[i - 1], nodes[i] );
+      thread( nodes.back(), nullptr );
+    }
+
+    // cuts the links between the last node of left
+    // and the first one of right
+    void unthread( N *left, N *right )
+    {
+      if( left ) thread( find_max( left ), nullptr );
+      if( right ) thread( nullptr, find_min( right ) );
+    }
+
+    N* prev_node( N *node ) const
+    {
+      if( N *left = left_of( node ) )
+        return find_max( left );
+      N *parent = parent_of( node );
+      while( parent && left_of( parent ) == node )
+      {
+        node = parent;
+        parent = parent_of( node );
+      }
+      return parent;
+    }
+
+    // all the nodes in-order
+    std::vector<N*> collect_nodes() const
+    {
+      std::vector<N*> nodes;
+      nodes.reserve( size() );
+      for( N *node = find_min( tree_root ); node; node = next_node( node ) )
+        nodes.push_back( node );
+      return nodes;
+    }
+
+    // the number of nodes in the subtree
+    size_t count_nodes( N *node ) const
+    {
+      if( !node ) return 0;
+      size_t count = 1;
+      N *last = find_max( node );
+      for( N *n = find_min( node ); n != last; n = next_node( n ) )
+        ++count;
+      return count;
+    }
+
+    bool has_two( const N *node ) const
+    {
+      return left_of( node ) && right_of( node );
+    }
+
+    // post-order walk, so each node is destroyed after its children
+    void destroy_subtree( N *node )
+    {
+      if( !node ) return;
+      N *stop = parent_of( node );
+      while( node != stop )
+      {
+        if( N *left = left_of( node ) )
+          node = left;
+        else if( N *right = right_of( node ) )
+          node = right;
+        else
+        {
+          N *parent = parent_of( node );
+          if( parent != stop )
+          {
+            if( left_of( parent ) == node )
+              set_left( parent, nullptr );
+            else
+              set_right( parent, nullptr );
+          }
+          pool.destroy( node );
+          node = parent;
+        }
+      }
+    }
+
+    // subtrees smaller than that are not worth a thread
+    static const size_t build_grain = 1 << 14;
+
+    // make( itr ) creates the node for *itr
+    template<typename It, typename F>
+    void build_sorted( It first, It last, F make, unsigned threads )
+    {
+      clear();
+
+      // the pool is not thread safe, so the nodes are
+      // created up front and only linked in parallel
+      std::vector<N*> nodes;
+      try
+      {
+        for( ; first != last; ++first )
+        {
+          N *node = make( first );
+          nodes.push_back( node );
+          if( nodes.size() > 1 && !key_less( key_of( nodes[nodes.size() - 2] ), key_of( node ) ) )
+            throw std::invalid_argument( "rbtree: build_from_sorted input is not sorted" );
+        }
+      }
+      catch( ... )
+      {
+        for( size_t i = 0; i < nodes.size(); ++i )
+          pool.destroy( nodes[i] );
+        throw;
+      }
+
+      link_all( nodes, threads );
+    }
+
+    // makes a balanced tree out of the sorted nodes
+    void link_all( std::vector<N*> &nodes, unsigned threads = 1 )
+    {
+      finger = nullptr;
+      tree_root = link_balanced( nodes, threads );
+      tree_size = nodes.size();
+      if( threaded ) thread_all( nodes );
+    }
+
+    // links the sorted nodes into a balanced detached tree
+    N* link_balanced( std::vector<N*> &nodes, unsigned threads = 1 )
+    {
+      if( nodes.empty() ) return nullptr;
+
+      // the tree is complete except for the last level, which is RED
+      size_t red_depth = 0;
+      while( size_t( 2 ) << red_depth <= nodes.size() )
+        ++red_depth;
+
+      N *root = link_sorted( nodes.data(), nodes.size(), 0, red_depth, threads );
+      set_parent( root, nullptr );
+      set_colour( root, BLACK );
+      return root;
+    }
+
+    // links nodes[0, count) into a balanced subtree (the sizes of
+    // the left and right subtrees differ by at most one), computing
+    // the summaries bottom-up
+    N* link_sorted( N **nodes, size_t count, size_t depth, size_t red_depth, unsigned threads )
+    {
+      if( !count ) return nullptr;
+
+      size_t mid = count / 2;
+      N *node = nodes[mid];
+      N *left = nullptr;
+      N *right = nullptr;
+
+      std::thread worker;
+      if( threads > 1 && count >= build_grain )
+      {
+        try
+        {
+          worker = std::thread( [&]() { left = link_sorted( nodes, mid, depth + 1, red_depth, threads / 2 ); } );
+        }
+        catch( const std::system_error& )
+        {
+          // no more threads, carry on sequentially
+        }
+      }
+      if( !worker.joinable() )
+        left = link_sorted( nodes, mid, depth + 1, red_depth, threads / 2 );
+      right = link_sorted( nodes + mid + 1, count - mid - 1, depth + 1, red_depth, threads - threads / 2 );
+      if( worker.joinable() )
+        worker.join();
+
+      set_left( node, left );
+      set_right( node, right );
+      set_parent( left, node );
+      set_parent( right, node );
+      set_colour( node, depth == red_depth ? RED : BLACK );
+      update_summary( node );
+      return node;
+    }
+
+    // a batch that is at least 1/batch_merge_ratio of the tree is
+    // merged with it rather than inserted one by one (the in-order
+    // walk over the whole tree is mostly cache misses, so it pays
+    // off only for really big batches)
+    static const size_t batch_merge_ratio = 1;
+
+    // the batch sorted by key( itr ), if unique of the
+    // equal keys only the first one is kept
+    template<typename It, typename F>
+    static std::vector<It> sort_batch( It first, It last, F key, bool unique )
+    {
+      std::vector<It> batch;
+      for( ; first != last; ++first )
+        batch.push_back( first );
+      std::stable_sort( batch.begin(), batch.end(), [&key]( It a, It b ) { return key_less( key( a ), key( b ) ); } );
+      if( unique )
+        batch.erase( std::unique( batch.begin(), batch.end(), [&key]( It a, It b ) { return key_equal( key( a ), key( b ) ); } ), batch.end() );
+      return batch;
+    }
+
+    // whether a batch of the given size should be merged rather than
+    // inserted or erased one by one; if the size was lost in a split
+    // or join, a tree of black height h has at least 2^h - 1 nodes,
+    // so it is recounted only when the batch might be big enough
+    bool merge_batch_into( size_t count ) const
+    {
+      count *= batch_merge_ratio;
+      if( tree_size == unknown_size && count < ( size_t( 1 ) << black_height( tree_root ) ) - 1 )
+        return false;
+      return count >= size();
+    }
+
+    // key( itr ) is the key of *itr and make( itr ) creates its node
+    template<typename It, typename F, typename M>
+    void insert_batch_by( It first, It last, F key, M make )
+    {
+      std::vector<It> batch = sort_batch( first, last, key, true );
+      if( batch.empty() ) return;
+
+      if( merge_batch_into( batch.size() ) )
+      {
+        merge_batch( batch, key, make );
+        return;
+      }
+
+      // in key order consecutive searches share the top of the
+      // path, which stays in the cache (starting from the previous
+      // node instead costs about as much climbing up as it saves);
+      // the summaries are updated right away as well, the path is
+      // still in the cache (deferring them to a single pass at the
+      // end turned out slower)
+      for( size_t i = 0; i < batch.size(); ++i )
+      {
+        It itr = batch[i];
+        insert_with( key( itr ), [&]() { return make( itr ); } );
+      }
+    }
+
+    template<typename It, typename F, typename M>
+    void merge_batch( const std::vector<It> &batch, F key, M make )
+    {
+      std::vector<N*> nodes = collect_nodes();
+      std::vector<N*> merged;
+      merged.reserve( nodes.size() + batch.size() );
+      std::vector<N*> created;
+      created.reserve( batch.size() );
+
+      try
+      {
+        size_t i = 0;
+        for( size_t j = 0; j < batch.size(); ++j )
+        {
+          while( i < nodes.size() && key_less( key_of( nodes[i] ), key( batch[j] ) ) )
+            merged.push_back( nodes[i++] );
+          if( i < nodes.size() && !key_less( key( batch[j] ), key_of( nodes[i] ) ) )
+            continue;
+          created.push_back( make( batch[j] ) );
+          merged.push_back( created.back() );
+        }
+        while( i < nodes.size() )
+          merged.push_back( nodes[i++] );
+      }
+      catch( ... )
+      {
+        // the tree hasn't been touched yet
+        for( size_t i = 0; i < created.size(); ++i )
+          pool.destroy( created[i] );
+        throw;
+      }
+
+      link_all( merged );
+    }
+
+    // match( node, itr ) tells if the node with the key of *itr goes,
+    // so repeated keys are kept (any of them may match)
+    template<typename It, typename F, typename M>
+    void erase_batch_by( It first, It last, F key, M match )
+    {
+      std::vector<It> batch = sort_batch( first, last, key, false );
+      if( batch.empty() || !tree_root ) return;
+
+      if( merge_batch_into( batch.size() ) )
+      {
+        std::vector<N*> nodes = collect_nodes();
+        size_t kept = 0;
+        size_t j = 0;
+        for( size_t i = 0; i < nodes.size(); ++i )
+        {
+          while( j < batch.size() && key_less( key( batch[j] ), key_of( nodes[i] ) ) )
+            ++j;
+          bool erase = false;
+          for( size_t k = j; !erase && k < batch.size() && !key_less( key_of( nodes[i] ), key( batch[k] ) ); ++k )
+            erase = match( nodes[i], batch[k] );
+          if( erase )
+            pool.destroy( nodes[i] );
+          else
+            nodes[kept++] = nodes[i];
+        }
+        nodes.resize( kept );
+        link_all( nodes );
+        return;
+      }
+
+      for( size_t i = 0; i < batch.size(); ++i )
+      {
+        N *node = find_in( key( batch[i] ), tree_root );
+        if( node && match( node, batch[i] ) )
+          erase_node( node );
+      }
+    }
+
+    // marks the size of a tree or a subtree that
+    // is only counted when somebody asks for it
+    static const size_t unknown_size = size_t( -1 );
+
+    // BLACK nodes on the way from node down to a leaf (node included)
+    size_t black_height( N *node ) const
+    {
+      size_t height = 0;
+      for( ; node; node = left_of( node ) )
+        if( colour_of( node ) == BLACK ) ++height;
+      return height;
+    }
+
+    void set_root( N *root )
+    {
+      finger = nullptr;
+      tree_root = root;
+      tree_size = unknown_size;
+      if( !root ) return;
+      set_parent( root, nullptr );
+      set_colour( root, BLACK );
+    }
+
+    subtree make_subtree( N *root )
+    {
+      if( root )
+      {
+        set_parent( root, nullptr );
+        set_colour( root, BLACK );
+        ++detached;
+      }
+      return subtree( this, root );
+    }
+
+    void check_subtree( const subtree &other ) const
+    {
+      if( other.root && other.tree != this )
+        throw std::invalid_argument( "rbtree: the subtree comes from another tree" );
+    }
+
+    // The split and join below work on detached trees: roots
+    // without a parent, with their black heights passed along.
+    // They never touch tree_root, so disjoint detached trees
+    // can be worked on in parallel.
+
+    // runs the insert fix-up for node in the detached tree, returns
+    // the new root and adds one to height if the root had to be
+    // made BLACK
+    N* insert_fixup_detached( N *root, N *node, size_t &height )
+    {
+      if( rb_insert_fixup( node, root ) ) ++height;
+      return root;
+    }
+
+    // takes the node out of the detached tree (without destroying
+    // it), returns the new root
+    N* detach_node( N *root, N *node )
+    {
+      colour_t old_colour;
+      N *child;
+      N *parent = unlink_node( node, old_colour, child, root );
+      update_path( parent );
+      rb_erase_fixup( old_colour, child, parent, root );
+      return root;
+    }
+
+    // joins the detached trees left < middle < right, height is
+    // set to the black height of the result
+    //
+    // O( |left_height - right_height| + 1 ): middle goes next to
+    // the node on the spine of the higher tree that has the black
+    // height of the lower one
+    N* join_trees( N *left, size_t left_height, N *middle, N *right, size_t right_height, size_t &height )
+    {
+      // a RED root might clash with a RED middle
+      if( colour_of( left ) == RED )
+      {
+        set_colour( left, BLACK );
+        ++left_height;
+      }
+      if( colour_of( right ) == RED )
+      {
+        set_colour( right, BLACK );
+        ++right_height;
+      }
+
+      if( left_height == right_height )
+      {
+        set_parent( middle, nullptr );
+        set_left( middle, left );
+        set_right( middle, right );
+        set_parent( left, middle );
+        set_parent( right, middle );
+        set_colour( middle, BLACK );
+        update_summary( middle );
+        height = left_height + 1;
+        return middle;
+      }
+
+      if( left_height > right_height )
+      {
+        // go down the right spine of left
+        N *parent = nullptr;
+        N *node = left;
+        size_t h = left_height;
+        while( colour_of( node ) == RED || h > right_height )
+        {
+          if( colour_of( node ) == BLACK ) --h;
+          parent = node;
+          node = right_of( node );
+        }
+
+        set_left( middle, node );
+        set_right( middle, right );
+        set_parent( node, middle );
+        set_parent( right, middle );
+        set_parent( middle, parent );
+        set_right( parent, middle );
+        set_colour( middle, RED );
+        update_summary( middle );
+        update_path( parent );
+        height = left_height;
+        return insert_fixup_detached( left, middle, height );
+      }
+
+      // go down the left spine of right
+      N *parent = nullptr;
+      N *node = right;
+      size_t h = right_height;
+      while( colour_of( node ) == RED || h > left_height )
+      {
+        if( colour_of( node ) == BLACK ) --h;
+        parent = node;
+        node = left_of( node );
+      }
+
+      set_left( middle, left );
+      set_right( middle, node );
+      set_parent( left, middle );
+      set_parent( node, middle );
+      set_parent( middle, parent );
+      set_left( parent, middle );
+      set_colour( middle, RED );
+      update_summary( middle );
+      update_path( parent );
+      height = right_height;
+      return insert_fixup_detached( right, middle, height );
+    }
+
+    // joins the detached trees left < right
+    N* join_trees( N *left, size_t left_height, N *right, size_t right_height, size_t &height )
+    {
+      if( !right )
+      {
+        height = left_height;
+        return left;
+      }
+
+      // the smallest node of right goes in the middle
+      N *middle = find_min( right );
+      right = detach_node( right, middle );
+      right_height = black_height( right );
+      return join_trees( left, left_height, middle, right, right_height, height );
+    }
+
+    // splits the detached tree (with the given black height) into
+    // the keys below key and the rest, O(log n) since the heights
+    // of the joined trees grow along the way up
+    void split_tree( N *node, size_t height, const K &key, N* &left, size_t &left_height, N* &right, size_t &right_height )
+    {
+      if( !node )
+      {
+        left = right = nullptr;
+        left_height = right_height = 0;
+        return;
+      }
+
+      N *l = left_of( node );
+      N *r = right_of( node );
+      set_parent( l, nullptr );
+      set_parent( r, nullptr );
+      size_t child_height = height - ( colour_of( node ) == BLACK ? 1 : 0 );
+
+      if( key_less( key_of( node ), key ) )
+      {
+        N *rest;
+        size_t rest_height;
+        split_tree( r, child_height, key, rest, rest_height, right, right_height );
+        left = join_trees( l, child_height, node, rest, rest_height, left_height );
+      }
+      else
+      {
+        N *rest;
+        size_t rest_height;
+        split_tree( l, child_height, key, left, left_height, rest, rest_height );
+        right = join_trees( rest, rest_height, node, r, child_height, right_height );
+      }
+    }
+
+    enum set_operation_t { set_union, set_intersection, set_difference };
+
+    // subtrees smaller than that are merged sequentially
+    static const size_t set_grain = 1 << 12;
+
+    // match( node, other_node ) tells if two nodes with the same
+    // key are the same and copy( other_node ) makes a node for this
+    // tree out of a node of the other one
+    template<typename M, typename C>
+    struct set_context
+    {
+        set_context( const rbtree &other, set_operation_t operation, task_pool *tasks, M match, C copy ) :
+          other( other ), operation( operation ), tasks( tasks ), match( match ), copy( copy ) { }
+
+        const rbtree    &other;
+        set_operation_t  operation;
+        task_pool       *tasks;
+        M                match;
+        C                copy;
+        std::mutex       mutex; // the pool is not thread safe
+    };
+
+    template<typename M, typename C>
+    void set_operation( const rbtree &other, set_operation_t operation, unsigned threads, M match, C copy )
+    {
+      if( &other == this )
+      {
+        if( operation == set_difference ) clear();
+        return;
+      }
+
+      std::unique_ptr<task_pool> tasks;
+      if( threads > 1 ) tasks.reset( new task_pool( threads ) );
+      set_context<M, C> ctx( other, operation, tasks.get(), match, copy );
+      // the workers follow links while nodes are being copied, so
+      // the pool mustn't grow under them
+      if( tasks && operation == set_union ) pool.reserve( other.size() );
+
+      N *root = tree_root;
+      tree_root = nullptr;
+      try
+      {
+        auto combine = [&]()
+        {
+          size_t height;
+          root = set_combine( ctx, root, black_height( root ), other.find_min( other.tree_root ), nullptr, height );
+        };
+        if( tasks )
+          tasks->run( combine );
+        else
+          combine();
+      }
+      catch( ... )
+      {
+        // a copy failed, every step has destroyed the nodes it was
+        // handed on the way out, so the tree is left empty
+        clear();
+        throw;
+      }
+      set_root( root );
+      // the nodes went through too many splits and
+      // joins to patch the links one by one
+      if( threaded ) thread_all( collect_nodes() );
+    }
+
+    // combines the detached subtree node (of the given black height)
+    // with [ first, last ), the nodes of other with keys in between
+    // the neighbours of the subtree, height is set to the black
+    // height of the result
+    //
+    // if a copy throws, the subtree (and whatever has been made of
+    // it so far) is destroyed before the exception is passed on
+    template<typename S>
+    N* set_combine( S &ctx, N *node, size_t height, N *first, N *last, size_t &result_height )
+    {
+      if( first == last )
+      {
+        if( ctx.operation == set_intersection && node )
+        {
+          std::lock_guard<std::mutex> lock( ctx.mutex );
+          destroy_subtree( node );
+          node = nullptr;
+          height = 0;
+        }
+        result_height = height;
+        return node;
+      }
+
+      if( ( size_t( 1 ) << height ) < set_grain )
+        return set_merge( ctx, node, first, last, result_height );
+
+      N *left = left_of( node );
+      N *right = right_of( node );
+      set_parent( left, nullptr );
+      set_parent( right, nullptr );
+      size_t child_height = height - ( colour_of( node ) == BLACK ? 1 : 0 );
+
+      // the key is in between the neighbours, so the
+      // bound is in [ first, last ] as well
+      N *middle = ctx.other.lower_bound_in( key_of( node ), ctx.other.tree_root );
+      bool same = middle != last && !key_less( key_of( node ), key_of( middle ) );
+      N *next = same ? ctx.other.next_node( middle ) : middle;
+
+      // each half is handed over to set_combine (left and right are
+      // cleared) and comes back as l and r
+      N *l = nullptr, *r = nullptr;
+      size_t left_height, right_height;
+      auto combine_left = [&]()
+      {
+        N *subtree = left;
+        left = nullptr;
+        l = set_combine( ctx, subtree, child_height, first, middle, left_height );
+      };
+      auto combine_right = [&]()
+      {
+        N *subtree = right;
+        right = nullptr;
+        r = set_combine( ctx, subtree, child_height, next, last, right_height );
+      };
+      bool keep;
+      try
+      {
+        if( ctx.tasks )
+          ctx.tasks->invoke( combine_left, combine_right );
+        else
+        {
+          combine_left();
+          combine_right();
+        }
+        keep = keep_node( ctx, node, same ? middle : nullptr );
+      }
+      catch( ... )
+      {
+        std::lock_guard<std::mutex> lock( ctx.mutex );
+        destroy_subtree( left );
+        destroy_subtree( right );
+        destroy_subtree( l );
+        destroy_subtree( r );
+        pool.destroy( node );
+        throw;
+      }
+
+      if( keep )
+        return join_trees( l, left_height, node, r, right_height, result_height );
+
+      {
+        std::lock_guard<std::mutex> lock( ctx.mutex );
+        pool.destroy( node );
+      }
+      return join_trees( l, left_height, r, right_height, result_height );
+    }
+
+    // match is the node of other with the same key (if any)
+    template<typename S>
+    static bool keep_node( S &ctx, const N *node, const N *match )
+    {
+      if( ctx.operation == set_union ) return true;
+      return ( match && ctx.match( node, match ) ) == ( ctx.operation == set_intersection );
+    }
+
+    // after that many steps over nodes of other that don't matter
+    // the merge rather looks for the next key with a binary search
+    static const size_t set_skip = 16;
+
+    // small subtrees are merged with [ first, last ) like two
+    // sorted lists and linked back into a balanced tree
+    template<typename S>
+    N* set_merge( S &ctx, N *node, N *first, N *last, size_t &height )
+    {
+      std::vector<N*> merged, dropped;
+      std::vector<size_t> copies; // the positions of the nodes of other
+      size_t copied = 0;
+
+      try
+      {
+        merge_nodes( ctx, node, first, last, merged, dropped, copies );
+        if( !copies.empty() || !dropped.empty() )
+        {
+          std::lock_guard<std::mutex> lock( ctx.mutex );
+          // the subtree stays in one piece until all the copies
+          // are there
+          for( ; copied < copies.size(); ++copied )
+            merged[copies[copied]] = ctx.copy( merged[copies[copied]] );
+          for( size_t i = 0; i < dropped.size(); ++i )
+            pool.destroy( dropped[i] );
+        }
+      }
+      catch( ... )
+      {
+        std::lock_guard<std::mutex> lock( ctx.mutex );
+        while( copied > 0 )
+          pool.destroy( merged[copies[--copied]] );
+        destroy_subtree( node );
+        throw;
+      }
+
+      N *root = link_balanced( merged );
+      height = black_height( root );
+      return root;
+    }
+
+    // the nodes of the subtree that are kept and those of other
+    // that are to be copied in order (copies has the positions of
+    // the latter), and the nodes of the subtree that go
+    template<typename S>
+    void merge_nodes( S &ctx, N *node, N *first, N *last, std::vector<N*> &merged, std::vector<N*> &dropped, std::vector<size_t> &copies )
+    {
+      N *o = first;
+      for( N *n = find_min( node ); n; n = next_node( n ) )
+      {
+        for( size_t steps = 0; o != last && key_less( key_of( o ), key_of( n ) ); o = ctx.other.next_node( o ) )
+        {
+          if( ctx.operation == set_union )
+          {
+            copies.push_back( merged.size() );
+            merged.push_back( o );
+          }
+          else if( ++steps > set_skip )
+          {
+            o = ctx.other.lower_bound_in( key_of( n ), ctx.other.tree_root );
+            break;
+          }
+        }
+
+        bool same = o != last && !key_less( key_of( n ), key_of( o ) );
+        if( keep_node( ctx, n, same ? o : nullptr ) )
+          merged.push_back( n );
+        else
+          dropped.push_back( n );
+        if( same )
+          o = ctx.other.next_node( o );
+      }
+      if( ctx.operation == set_union )
+      {
+        for( ; o != last; o = ctx.other.next_node( o ) )
+        {
+          copies.push_back( merged.size() );
+          merged.push_back( o );
+        }
+      }
+    }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    void right_rotation( N *node, N* &root )
+    {
+      if( !node ) return;
+
+      N *parent = parent_of( node );
+      N *left_child = left_of( node );
+
+      bool is_left = ( parent && left_of( parent ) == node ) ? true : false;
+
+      set_left( node, right_of( left_child ) );
+      set_parent( left_of( node ), node );
+
+      set_right( left_child, node );
+      set_parent( node, left_child );
+
+      set_parent( left_child, parent );
+      if( !parent )
+        root = left_child;
+      else if( is_left )
+        set_left( parent, left_child );
+      else
+        set_right( parent, left_child );
+
+      update_summary( node ); // first the node since now it's lower in the tree
+      update_summary( left_child );
+    }
+
+    void left_rotation( N *node, N* &root )
+    {
+      if( !node ) return;
+
+      N *parent = parent_of( node );
+      N *right_child = right_of( node );
+
+      bool is_left = ( parent && left_of( parent ) == node ) ? true : false;
+
+      set_right( node, left_of( right_child ) );
+      set_parent( right_of( node ), node );
+
+      set_left( right_child, node );
+      set_parent( node, right_child );
+
+      set_parent( right_child, parent );
+      if( !parent )
+        root = right_child;
+      else if( is_left )
+        set_left( parent, right_child );
+      else
+        set_right( parent, right_child );
+
+      update_summary( node ); // first the node since now it's lower in the tree
+      update_summary( right_child );
+    }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    N* get_grandparent( N *node ) const
+    {
+      if( !node || !parent_of( node ) ) return nullptr;
+      return parent_of( parent_of( node ) );
+    }
+
+    N* get_uncle( N *node ) const
+    {
+      N *grandparent = get_grandparent( node );
+      if( !grandparent ) return nullptr;
+      if( left_of( grandparent ) == parent_of( node ) )
+        return right_of( grandparent );
+      else
+        return left_of( grandparent );
+    }
+
+    // returns true if the root was RED and had to be
+    // made BLACK (so the black height has grown)
+    bool rb_insert_fixup( N *node, N* &root )
+    {
+      // case 1: the node is the root, we only need to make it BLACK
+      // case 2: the parent is BLACK, the invariant is OK
+      while( colour_of( parent_of( node ) ) == RED )
+      {
+        // the parent is RED so it is not the root,
+        // hence there is a grandparent
+        N *parent = parent_of( node );
+        N *grandparent = get_grandparent( node );
+        N *uncle = get_uncle( node );
+
+        // case 3: the uncle is RED as well, recolour
+        // and carry on from the grandparent
+        if( colour_of( uncle ) == RED )
+        {
+          set_colour( parent, BLACK );
+          set_colour( uncle, BLACK );
+          set_colour( grandparent, RED );
+          node = grandparent;
+          continue;
+        }
+
+        // case 4: the node is an inner grandchild,
+        // rotate it to the outside
+        if( ( node == right_of( parent ) ) && ( parent == left_of( grandparent ) ) )
+        {
+          left_rotation( parent, root );
+          node = left_of( node );
+        }
+        else if( ( node == left_of( parent ) ) && ( parent == right_of( grandparent ) ) )
+        {
+          right_rotation( parent, root );
+          node = right_of( node );
+        }
+
+        // case 5: the node is an outer grandchild,
+        // rotate the grandparent
+        parent = parent_of( node );
+        set_colour( parent, BLACK );
+        set_colour( grandparent, RED );
+        if( node == left_of( parent ) )
+          right_rotation( grandparent, root );
+        else
+          left_rotation( grandparent, root );
+        break;
+      }
+
+      bool grown = colour_of( root ) == RED;
+      set_colour( root, BLACK );
+      return grown;
+    }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    bool is_left( const N *node ) const
+    {
+      return node == left_of( parent_of( node ) );
+    }
+
+    bool is_right( const N *node ) const
+    {
+      return node == right_of( parent_of( node ) );
+    }
+
+    // node has been removed from under parent and child took
+    // its place (child can be a null leaf)
+    void rb_erase_fixup( colour_t old_colour, N *child, N *parent, N* &root )
+    {
+      if( old_colour == RED )
+      {
+        // if the node was red it has to have two BLACK children
+        // and since at most one of those children is a non-leaf
+        // child actually both have to be leafs (null) in order
+        // to satisfy the red-black tree invariant
+        if( child ) throw rb_invariant_error();
+        return;
+      }
+
+      if( colour_of( child ) == RED )
+      {
+        set_colour( child, BLACK );
+        return;
+      }
+
+      // if we are here the child is null because a BLACK
+      // node that has at most one non-leaf child must
+      // have two null children (null children are BLACK)
+      if( child ) throw rb_invariant_error();
+
+      // the node is one BLACK short, the node itself is
+      // BLACK (either a leaf or a BLACK node pushed up
+      // in case 3)
+      N *node = child;
+      // case 1: if the node is the root we are done
+      while( parent )
+      {
+        // null node has a BLACK height of 0 so the sibling
+        // cannot be a leaf
+        bool left = ( node == left_of( parent ) );
+        N *sibling = left ? right_of( parent ) : left_of( parent );
+        if( !sibling ) throw rb_invariant_error();
+
+        // case 2: RED sibling, rotate so the node
+        // gets a BLACK sibling
+        if( colour_of( sibling ) == RED )
+        {
+          set_colour( parent, RED );
+          set_colour( sibling, BLACK );
+          if( left )
+            left_rotation( parent, root );
+          else
+            right_rotation( parent, root );
+          sibling = left ? right_of( parent ) : left_of( parent );
+          if( !sibling ) throw rb_invariant_error();
+        }
+
+        colour_t parent_colour = colour_of( parent );
+        colour_t sibling_colour = colour_of( sibling );
+        colour_t sibling_left_colour = colour_of( left_of( sibling ) );
+        colour_t sibling_right_colour = colour_of( right_of( sibling ) );
+
+        // case 3: everything is BLACK, make the sibling RED
+        // and move the problem one level up
+        if( parent_colour == BLACK &&
+            sibling_colour == BLACK &&
+            sibling_left_colour == BLACK &&
+            sibling_right_colour == BLACK )
+        {
+          set_colour( sibling, RED );
+          node = parent;
+          parent = parent_of( node );
+          continue;
+        }
+
+        // case 4: RED parent, swap the colours of
+        // the parent and the sibling
+        if( parent_colour == RED &&
+            sibling_colour == BLACK &&
+            sibling_left_colour == BLACK &&
+            sibling_right_colour == BLACK )
+        {
+          set_colour( sibling, RED );
+          set_colour( parent, BLACK );
+          return;
+        }
+
+        // case 5: the sibling's RED child is the inner one,
+        // rotate it to the outside
+        if( sibling_colour == BLACK )
+        {
+          if( left &&
+              sibling_right_colour == BLACK &&
+              sibling_left_colour == RED )
+          {
+            set_colour( sibling, RED );
+            set_colour( left_of( sibling ), BLACK );
+            right_rotation( sibling, root );
+          }
+          else if( !left &&
+                   sibling_left_colour == BLACK &&
+                   sibling_right_colour == RED )
+          {
+            set_colour( sibling, RED );
+            set_colour( right_of( sibling ), BLACK );
+            left_rotation( sibling, root );
+          }
+          sibling = left ? right_of( parent ) : left_of( parent );
+        }
+
+        // case 6: the sibling's RED child is the outer one,
+        // rotate the parent
+        set_colour( sibling, parent_colour );
+        set_colour( parent, BLACK );
+        if( left )
+        {
+          if( N *right = right_of( sibling ) ) set_colour( right, BLACK );
+          left_rotation( parent, root );
+        }
+        else
+        {
+          if( N *left = left_of( sibling ) ) set_colour( left, BLACK );
+          right_rotation( parent, root );
+        }
+        return;
+      }
+    }
+
+    // the pool has to outlive the nodes
+    P      pool;
+    N     *tree_root;
+    mutable size_t tree_size;
+
+    // the number of subtrees cut out of the
+    // tree that still hold nodes of the pool
+    size_t detached;
+
+    // the last inserted node (null if it has been erased or the
+    // tree restructured since) and its successor if finger_known,
+    // finger_on makes insert try right after the finger first
+    N     *finger;
+    N     *finger_next;
+    bool   finger_known;
+    bool   finger_on;
+};
+
+// same API as rbtree, but the nodes are kept in an
+// index_node_pool and link to each other with 32-bit
+// indices (roughly half the per-node overhead)
+template<typename K, typename V>
+using compact_rbtree = rbtree< K, V, node_t<K, V, index_links>, index_node_pool< node_t<K, V, index_links> > >;
+
+// same API as rbtree, but every node links to its in-order
+// neighbours, so the iterators step in one hop (two more
+// pointers per node, kept up to date on insert and erase and
+// patched at the boundaries by split, join and the bulk loads)
+template<typename K, typename V>
+using threaded_rbtree = rbtree< K, V, node_t<K, V, threaded_links> >;
 
-template<typename K, typename V, typename N>
-std::unique_ptr<N> rbtree<K, V, N>::null_node;
 #endif /* RBTREE_HH_ */
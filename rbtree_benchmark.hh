@@ -0,0 +1,824 @@
+/*
+ * rbtree_benchmark.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef RBTREE_BENCHMARK_HH_
+#define RBTREE_BENCHMARK_HH_
+
+#include "rbtree.hh"
+#include "interval_tree.hh"
+#include "order_statistic_tree.hh"
+#include "concurrent_interval_tree.hh"
+#include "frozen_interval_tree.hh"
+#include "mapped_interval_tree.hh"
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <tuple>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <cstdio>
+
+class rbtree_benchmark
+{
+  public:
+
+    rbtree_benchmark( size_t size = 1000000, unsigned seed = 0 ) : size( size ), seed( seed ) { }
+
+    // slab pool versus one heap allocation per node
+    void node_allocation()
+    {
+      typedef node_t<int, int> node;
+      typedef interval_node_t<int, int> interval_node;
+
+      std::cout << "rbtree insert/erase (" << size << " keys):" << std::endl;
+      report( "  node_pool<N, 1>", insert_erase< rbtree<int, int, node, node_pool<node, 1> > >() );
+      report( "  node_pool<N>   ", insert_erase< rbtree<int, int, node> >() );
+
+      std::cout << "interval_tree insert/erase (" << size << " intervals):" << std::endl;
+      report( "  node_pool<N, 1>", interval_insert_erase< interval_tree<int, int, node_pool<interval_node, 1> > >() );
+      report( "  node_pool<N>   ", interval_insert_erase< interval_tree<int, int> >() );
+    }
+
+    // cost of a single insert and a single lookup
+    // (half of the lookups hit, half of them miss)
+    void insert_lookup()
+    {
+      std::vector<int> keys = random_keys();
+      rbtree<int, int> tree;
+
+      steady_clock::time_point start = steady_clock::now();
+      for( size_t i = 0; i < keys.size(); ++i )
+        tree.insert( keys[i], int( i ) );
+      double insert_sec = seconds( start );
+
+      size_t found = 0;
+      start = steady_clock::now();
+      for( size_t i = 0; i < keys.size(); ++i )
+        if( tree.find( i % 2 ? keys[i] : keys[i] ^ 1 ) ) ++found;
+      double lookup_sec = seconds( start );
+
+      std::cout << "rbtree (" << size << " keys, " << found << " hits):" << std::endl;
+      std::cout << "  insert : " << insert_sec * 1e9 / keys.size() << " ns/op" << std::endl;
+      std::cout << "  lookup : " << lookup_sec * 1e9 / keys.size() << " ns/op" << std::endl;
+    }
+
+    // pointer links versus 32-bit index links
+    void node_layout()
+    {
+      std::cout << "node size (int key, int value):" << std::endl;
+      std::cout << "  node_t                         : " << sizeof( node_t<int, int> ) << " B" << std::endl;
+      std::cout << "  node_t, index_links            : " << sizeof( node_t<int, int, index_links> ) << " B" << std::endl;
+      std::cout << "  interval_node_t                : " << sizeof( interval_node_t<int, int> ) << " B" << std::endl;
+      std::cout << "  interval_node_t, index_links   : " << sizeof( interval_node_t<int, int, index_links, std::less<int>, interval_max<int> > ) << " B" << std::endl;
+      std::cout << "    with the counts              : " << sizeof( interval_node_t<int, int, index_links> ) << " B" << std::endl;
+
+      std::cout << "interval_tree insert + query (" << size << " intervals):" << std::endl;
+      report( "  interval_tree        ", interval_insert_query< interval_tree<int, int> >() );
+      report( "  compact_interval_tree", interval_insert_query< compact_interval_tree<int, int> >() );
+    }
+
+    // insert and erase, including the rebalancing and (for the
+    // augmented trees) the summary updates in the rotations; ascending
+    // keys rotate on almost every insert
+    void fixup_cost()
+    {
+      std::vector<int> keys = random_keys();
+      std::vector<int> sorted( keys );
+      std::sort( sorted.begin(), sorted.end() );
+
+      std::cout << "insert + erase, random keys (" << size << " keys):" << std::endl;
+      report_op( "  rbtree              ", insert_erase_all< rbtree<int, int> >( keys ) );
+      report_op( "  order_statistic_tree", insert_erase_all< order_statistic_tree<int, int> >( keys ) );
+      report_op( "  interval_tree       ", interval_insert_erase_all< interval_tree<int, int> >( keys ) );
+
+      std::cout << "insert + erase, ascending keys (" << size << " keys):" << std::endl;
+      report_op( "  rbtree              ", insert_erase_all< rbtree<int, int> >( sorted ) );
+      report_op( "  order_statistic_tree", insert_erase_all< order_statistic_tree<int, int> >( sorted ) );
+      report_op( "  interval_tree       ", interval_insert_erase_all< interval_tree<int, int> >( sorted ) );
+    }
+
+    // n inserts versus building from sorted input
+    void bulk_load()
+    {
+      std::vector<int> keys = random_keys();
+      std::sort( keys.begin(), keys.end() );
+      keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+
+      std::vector< std::pair<int, int> > pairs;
+      std::vector< std::tuple<int, int, int> > intervals;
+      for( size_t i = 0; i < keys.size(); ++i )
+      {
+        pairs.push_back( std::make_pair( keys[i], int( i ) ) );
+        intervals.push_back( std::make_tuple( keys[i], keys[i] + 100, int( i ) ) );
+      }
+
+      std::cout << "rbtree build (" << keys.size() << " sorted keys):" << std::endl;
+      {
+        rbtree<int, int> tree;
+        steady_clock::time_point start = steady_clock::now();
+        for( size_t i = 0; i < pairs.size(); ++i )
+          tree.insert( pairs[i].first, pairs[i].second );
+        report( "  insert            ", seconds( start ) );
+      }
+      {
+        rbtree<int, int> tree;
+        steady_clock::time_point start = steady_clock::now();
+        tree.build_from_sorted( pairs.begin(), pairs.end() );
+        report( "  build_from_sorted ", seconds( start ) );
+      }
+      {
+        rbtree<int, int> tree;
+        steady_clock::time_point start = steady_clock::now();
+        tree.build_from_sorted( pairs.begin(), pairs.end(), std::thread::hardware_concurrency() );
+        report( "  parallel build    ", seconds( start ) );
+      }
+
+      std::cout << "interval_tree build (" << keys.size() << " sorted intervals):" << std::endl;
+      {
+        interval_tree<int, int> tree;
+        steady_clock::time_point start = steady_clock::now();
+        for( size_t i = 0; i < intervals.size(); ++i )
+          tree.insert( std::get<0>( intervals[i] ), std::get<1>( intervals[i] ), std::get<2>( intervals[i] ) );
+        report( "  insert            ", seconds( start ) );
+      }
+      {
+        interval_tree<int, int> tree;
+        steady_clock::time_point start = steady_clock::now();
+        tree.build_from_sorted( intervals.begin(), intervals.end() );
+        report( "  build_from_sorted ", seconds( start ) );
+      }
+      {
+        interval_tree<int, int> tree;
+        steady_clock::time_point start = steady_clock::now();
+        tree.build_from_sorted( intervals.begin(), intervals.end(), std::thread::hardware_concurrency() );
+        report( "  parallel build    ", seconds( start ) );
+      }
+    }
+
+    // one by one versus insert_batch/erase_batch for batches of
+    // 16 up to 1M keys going in and out of a tree of size keys
+    void batch()
+    {
+      std::cout << "rbtree insert + erase of a batch (" << size << " keys in the tree):" << std::endl;
+      batch_sizes< rbtree<int, int> >( []( size_t i, int k ) { return std::make_pair( k, int( i ) ); },
+                                       []( int k ) { return k; } );
+
+      std::cout << "interval_tree insert + erase of a batch (" << size << " intervals in the tree):" << std::endl;
+      batch_sizes< interval_tree<int, int> >( []( size_t i, int k ) { return std::make_tuple( k, k + 100, int( i ) ); },
+                                              []( int k ) { return std::make_pair( k, k + 100 ); } );
+    }
+
+    // evicting a window of 16 up to 64k consecutive intervals: one
+    // by one versus extract_range (and releasing the subtree)
+    void evict()
+    {
+      std::vector<int> keys = random_keys();
+      std::sort( keys.begin(), keys.end() );
+      keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+
+      std::vector< std::tuple<int, int, int> > intervals;
+      for( size_t i = 0; i < keys.size(); ++i )
+        intervals.push_back( std::make_tuple( keys[i], keys[i] + 100, int( i ) ) );
+
+      interval_tree<int, int> tree;
+      tree.build_from_sorted( intervals.begin(), intervals.end() );
+
+      std::cout << "interval_tree eviction of a window (" << keys.size() << " intervals in the tree):" << std::endl;
+      std::mt19937 gen( seed + 2 );
+      for( size_t n = 16; n <= ( 1 << 16 ) && n < keys.size(); n *= 4 )
+      {
+        size_t rounds = std::max<size_t>( 1, ( 1 << 18 ) / n );
+        double one_sec = 0, extract_sec = 0;
+        for( size_t r = 0; r < rounds; ++r )
+        {
+          // a different window for each, put back untimed
+          for( int m = 0; m < 2; ++m )
+          {
+            size_t first = gen() % ( keys.size() - n );
+            steady_clock::time_point start = steady_clock::now();
+            if( m == 0 )
+            {
+              for( size_t i = first; i < first + n; ++i )
+                tree.erase( keys[i], keys[i] + 100 );
+              one_sec += seconds( start );
+            }
+            else
+            {
+              tree.extract_range( keys[first], keys[first + n] ).release();
+              extract_sec += seconds( start );
+            }
+            tree.insert_batch( intervals.begin() + first, intervals.begin() + first + n );
+          }
+        }
+        std::cout << "  " << n << " intervals : one by one " << one_sec * 1e9 / ( rounds * n )
+                  << " ns/interval, extract_range " << extract_sec * 1e9 / ( rounds * n ) << " ns/interval" << std::endl;
+      }
+    }
+
+    // union, intersection and difference of two trees of n keys
+    // each (half of them shared) with 1, 2, 4, ... threads up to
+    // the number of cores
+    void set_operations( size_t n = 10000000 )
+    {
+      std::vector< std::pair<int, int> > a, b;
+      for( size_t i = 0; i < 2 * n; ++i )
+      {
+        // every other key is in a, every other pair of keys in b
+        if( i % 2 == 0 ) a.push_back( std::make_pair( int( i ), 0 ) );
+        if( i % 4 < 2 ) b.push_back( std::make_pair( int( i ), 0 ) );
+      }
+
+      rbtree<int, int> other;
+      other.build_from_sorted( b.begin(), b.end() );
+
+      unsigned cores = std::max( 1u, std::thread::hardware_concurrency() );
+      std::cout << "rbtree set operations (" << n << " keys in each tree, " << cores << " cores):" << std::endl;
+      for( unsigned threads = 1; ; threads = std::min( threads * 2, cores ) )
+      {
+        double sec[3];
+        for( int op = 0; op < 3; ++op )
+        {
+          rbtree<int, int> tree;
+          tree.build_from_sorted( a.begin(), a.end() );
+          steady_clock::time_point start = steady_clock::now();
+          if( op == 0 ) tree.union_with( other, threads );
+          else if( op == 1 ) tree.intersection_with( other, threads );
+          else tree.difference_with( other, threads );
+          sec[op] = seconds( start );
+        }
+        std::cout << "  " << threads << " threads : union " << sec[0] << " s, intersection "
+                  << sec[1] << " s, difference " << sec[2] << " s" << std::endl;
+        if( threads == cores ) break;
+      }
+    }
+
+    // mixed read / write throughput of 1, 2, 4, ... threads: 90%
+    // count_overlaps and 10% inserts and erases, one interval_tree
+    // behind a mutex versus concurrent_interval_tree
+    void concurrent_mixed( unsigned max_threads = 16, size_t shards = 64 )
+    {
+      const int range = 1 << 30;
+      std::vector<int> keys = random_keys();
+
+      std::cout << "interval_tree mixed reads and writes (" << size << " intervals, "
+                << std::max( 1u, std::thread::hardware_concurrency() ) << " cores):" << std::endl;
+      for( unsigned threads = 1; threads <= max_threads; threads *= 2 )
+      {
+        locked_interval_tree locked;
+        concurrent_interval_tree<int, int> sharded( 0, range, shards );
+        // the writers use odd lows, so they never erase these
+        for( size_t i = 0; i < keys.size(); ++i )
+        {
+          locked.insert( ( keys[i] % range ) & ~1, ( ( keys[i] % range ) & ~1 ) + 100, int( i ) );
+          sharded.insert( ( keys[i] % range ) & ~1, ( ( keys[i] % range ) & ~1 ) + 100, int( i ) );
+        }
+
+        double locked_ops = mixed_throughput( locked, threads, range );
+        double sharded_ops = mixed_throughput( sharded, threads, range );
+        std::cout << "  " << threads << " threads : mutex " << locked_ops / 1e6 << " Mops/s, "
+                  << shards << " shards " << sharded_ops / 1e6 << " Mops/s" << std::endl;
+      }
+    }
+
+    // queries on an interval_tree versus the same intervals frozen
+    // (fanout 16 and 64)
+    void frozen_query()
+    {
+      std::vector<int> keys = random_keys();
+      interval_tree<int, int> tree;
+      for( size_t i = 0; i < keys.size(); ++i )
+        tree.insert( keys[i], keys[i] + 1000, int( i ) );
+      frozen_interval_tree<int, int> frozen( tree );
+      frozen_interval_tree<int, int, 64> wide( tree );
+
+      std::vector<int> lows( keys.size() );
+      std::mt19937 gen( seed + 3 );
+      for( size_t i = 0; i < lows.size(); ++i )
+        lows[i] = int( gen() >> 1 );
+
+      std::cout << "interval queries (" << tree.size() << " intervals):" << std::endl;
+      report_op( "  interval_tree count_overlaps   ", count_queries( tree, lows ) );
+      report_op( "  frozen<16> count_overlaps      ", count_queries( frozen, lows ) );
+      report_op( "  frozen<64> count_overlaps      ", count_queries( wide, lows ) );
+      report_op( "  interval_tree query            ", visit_queries<interval_tree<int, int>::iterator>( tree, lows ) );
+      report_op( "  frozen<16> query               ", visit_queries<frozen_interval_tree<int, int>::entry>( frozen, lows ) );
+      report_op( "  frozen<64> query               ", visit_queries<frozen_interval_tree<int, int, 64>::entry>( wide, lows ) );
+    }
+
+    // what a restart costs: inserting every interval into an
+    // interval_tree again versus mapping a saved frozen tree (the
+    // file is in the page cache, as it is for all but the first
+    // process), and queries on the mapped tree versus in memory
+    void mapped_startup( const std::string &path = "/tmp/rbtree_benchmark.frozen" )
+    {
+      std::vector<int> keys = random_keys();
+      std::cout << "startup (" << keys.size() << " intervals):" << std::endl;
+
+      steady_clock::time_point start = steady_clock::now();
+      interval_tree<int, int> tree;
+      for( size_t i = 0; i < keys.size(); ++i )
+        tree.insert( keys[i], keys[i] + 1000, int( i ) );
+      report( "  interval_tree insert   ", seconds( start ) );
+
+      start = steady_clock::now();
+      frozen_interval_tree<int, int> frozen( tree );
+      report( "  frozen from the tree   ", seconds( start ) );
+      start = steady_clock::now();
+      frozen.save( path );
+      report( "  save                   ", seconds( start ) );
+
+      start = steady_clock::now();
+      {
+        mapped_interval_tree<int, int> mapped( path );
+      }
+      report( "  map                    ", seconds( start ) );
+
+      std::vector<int> lows( keys.size() );
+      std::mt19937 gen( seed + 3 );
+      for( size_t i = 0; i < lows.size(); ++i )
+        lows[i] = int( gen() >> 1 );
+
+      start = steady_clock::now();
+      mapped_interval_tree<int, int> mapped( path );
+      std::cout << "  map and the first query: " << mapped.count_overlaps( lows[0], lows[0] + 10 ) << " hits, "
+                << seconds( start ) * 1e6 << " us" << std::endl;
+
+      report_op( "  frozen count_overlaps  ", count_queries( frozen, lows ) );
+      report_op( "  mapped count_overlaps  ", count_queries( mapped, lows ) );
+      std::remove( path.c_str() );
+    }
+
+    // the overlap test over blocks of 16 intervals: the scalar loop
+    // versus the kernel overlap_mask picks at runtime, and dense
+    // queries (thousands of hits each) on interval_tree and frozen
+    void overlap_kernels()
+    {
+      std::vector<int> keys = random_keys();
+      std::sort( keys.begin(), keys.end() );
+      std::vector<int> highs( keys.size() );
+      for( size_t i = 0; i < keys.size(); ++i )
+        highs[i] = keys[i] + int( i % 1000 ) * 1000;
+
+      const char *isa[] = { "scalar", "AVX2", "AVX-512" };
+      std::cout << "overlap test, blocks of 16 (" << keys.size() << " intervals, " << isa[overlap_isa()] << "):" << std::endl;
+      const int rounds = 20;
+      for( int m = 0; m < 2; ++m )
+      {
+        uint64_t hits = 0;
+        steady_clock::time_point start = steady_clock::now();
+        for( int r = 0; r < rounds; ++r )
+        {
+          int low = keys[keys.size() / 2] + r;
+          for( size_t i = 0; i + 16 <= keys.size(); i += 16 )
+            hits += mask_count( m == 0 ? overlap_mask_scalar( &keys[i], &highs[i], 16, low, low + 1000 )
+                                       : overlap_mask( &keys[i], &highs[i], 16, low, low + 1000 ) );
+        }
+        double sec = seconds( start );
+        std::cout << "  " << ( m == 0 ? "scalar       " : "overlap_mask " ) << " : " << sec * 1e9 / ( double( rounds ) * keys.size() )
+                  << " ns/interval (" << hits << " hits)" << std::endl;
+      }
+
+      interval_tree<int, int> tree;
+      for( size_t i = 0; i < keys.size(); ++i )
+        tree.insert( keys[i], highs[i], int( i ) );
+      frozen_interval_tree<int, int> frozen( tree );
+      std::vector<int> lows( 1000 );
+      std::mt19937 gen( seed + 4 );
+      for( size_t i = 0; i < lows.size(); ++i )
+        lows[i] = int( gen() >> 1 );
+
+      std::cout << "dense queries:" << std::endl;
+      double tree_sec = visit_queries<interval_tree<int, int>::iterator>( tree, lows, 1 << 20 );
+      double frozen_sec = visit_queries<frozen_interval_tree<int, int>::entry>( frozen, lows, 1 << 20 );
+      std::cout << "  interval_tree : " << tree_sec * 1e6 / lows.size() << " us/query" << std::endl;
+      std::cout << "  frozen        : " << frozen_sec * 1e6 / lows.size() << " us/query" << std::endl;
+    }
+
+    // n queries one by one versus query_batch, for sorted
+    // (a stream of positions) and shuffled queries
+    void query_batch( size_t n = 1000000 )
+    {
+      std::vector<int> keys = random_keys();
+      interval_tree<int, int> tree;
+      for( size_t i = 0; i < keys.size(); ++i )
+        tree.insert( keys[i], keys[i] + 1000, int( i ) );
+
+      std::mt19937 gen( seed + 5 );
+      std::vector< std::pair<int, int> > queries( n );
+      for( size_t i = 0; i < n; ++i )
+      {
+        int low = int( gen() >> 1 );
+        queries[i] = std::make_pair( low, low + 100 );
+      }
+
+      std::cout << "interval_tree " << n << " queries (" << tree.size() << " intervals):" << std::endl;
+      for( int sorted = 1; sorted >= 0; --sorted )
+      {
+        if( sorted ) std::sort( queries.begin(), queries.end() );
+        else std::shuffle( queries.begin(), queries.end(), gen );
+
+        size_t hits = 0;
+        steady_clock::time_point start = steady_clock::now();
+        for( size_t i = 0; i < n; ++i )
+          tree.query( queries[i].first, queries[i].second, [&hits]( const interval_tree<int, int>::iterator& ) { ++hits; return true; } );
+        double one_sec = seconds( start );
+
+        size_t batch_hits = 0;
+        start = steady_clock::now();
+        tree.query_batch( queries.begin(), queries.end(), [&batch_hits]( size_t, const interval_tree<int, int>::iterator& ) { ++batch_hits; } );
+        double batch_sec = seconds( start );
+
+        std::cout << "  " << ( sorted ? "sorted   " : "shuffled " ) << " : one by one " << one_sec * 1e9 / n << " ns/query, query_batch "
+                  << batch_sec * 1e9 / n << " ns/query (" << hits << " / " << batch_hits << " hits)" << std::endl;
+      }
+    }
+
+    // all the overlapping pairs of two trees of size intervals: a
+    // query into b for every interval of a versus join_overlaps with
+    // 1, 2, 4, ... threads up to the number of cores
+    void join_overlaps()
+    {
+      std::vector<int> keys = random_keys();
+      interval_tree<int, int> a, b;
+      std::mt19937 gen( seed + 6 );
+      for( size_t i = 0; i < keys.size(); ++i )
+      {
+        a.insert( keys[i], keys[i] + 1000, int( i ) );
+        int low = int( gen() >> 1 );
+        b.insert( low, low + 1000, int( i ) );
+      }
+
+      std::cout << "interval_tree join of two trees (" << a.size() << " and " << b.size() << " intervals):" << std::endl;
+
+      size_t pairs = 0;
+      steady_clock::time_point start = steady_clock::now();
+      for( interval_tree<int, int>::iterator itr = a.begin(); itr != a.end(); ++itr )
+        b.query( itr->low, itr->high, [&pairs]( const interval_tree<int, int>::iterator& ) { ++pairs; return true; } );
+      std::cout << "  nested query          : " << seconds( start ) << " s (" << pairs << " pairs)" << std::endl;
+
+      unsigned cores = std::max( 1u, std::thread::hardware_concurrency() );
+      for( unsigned threads = 1; ; threads = std::min( threads * 2, cores ) )
+      {
+        std::atomic<size_t> joined( 0 );
+        start = steady_clock::now();
+        a.join_overlaps( b, [&joined]( const interval_tree<int, int>::iterator&, const interval_tree<int, int>::iterator& )
+        {
+          joined.fetch_add( 1, std::memory_order_relaxed );
+        }, threads );
+        std::cout << "  join_overlaps " << threads << " threads : " << seconds( start ) << " s (" << joined << " pairs)" << std::endl;
+        if( threads == cores ) break;
+      }
+    }
+
+    // a full in-order scan (the export of the whole tree), climbing
+    // through the parents versus following the threaded links
+    void threaded_scan()
+    {
+      std::vector<int> keys = random_keys();
+
+      std::cout << "rbtree full scan (" << size << " keys, random insert order):" << std::endl;
+      report_op( "  rbtree                ", full_scan< rbtree<int, int> >( keys ) );
+      report_op( "  threaded_rbtree       ", full_scan< threaded_rbtree<int, int> >( keys ) );
+
+      std::cout << "interval_tree full scan (" << size << " intervals):" << std::endl;
+      report_op( "  interval_tree         ", full_scan< interval_tree<int, int> >( keys ) );
+      report_op( "  threaded_interval_tree", full_scan< threaded_interval_tree<int, int> >( keys ) );
+    }
+
+    // sorted, nearly sorted (shuffled within windows of 16) and random
+    // keys: an ordinary insert, an insert with the end as the hint,
+    // and an insert with the finger on
+    void hinted_insert()
+    {
+      std::vector<int> random = random_keys();
+      std::vector<int> sorted( random );
+      std::sort( sorted.begin(), sorted.end() );
+      std::vector<int> nearly( sorted );
+      std::mt19937 gen( seed + 7 );
+      for( size_t i = 0; i + 16 <= nearly.size(); i += 16 )
+        std::shuffle( nearly.begin() + i, nearly.begin() + i + 16, gen );
+
+      const char *orders[] = { "sorted", "nearly sorted", "random" };
+      const std::vector<int> *keys[] = { &sorted, &nearly, &random };
+      for( int o = 0; o < 3; ++o )
+      {
+        std::cout << "rbtree insert, " << orders[o] << " (" << size << " keys):" << std::endl;
+        report_op( "  insert           ", ordered_insert( *keys[o], false, false ) );
+        report_op( "  insert( end() )  ", ordered_insert( *keys[o], true, false ) );
+        report_op( "  insert, finger   ", ordered_insert( *keys[o], false, true ) );
+      }
+    }
+
+  private:
+
+    static double ordered_insert( const std::vector<int> &keys, bool hint, bool finger )
+    {
+      rbtree<int, int> tree;
+      tree.use_finger( finger );
+      steady_clock::time_point start = steady_clock::now();
+      for( size_t i = 0; i < keys.size(); ++i )
+      {
+        if( hint )
+          tree.insert( tree.end(), keys[i], int( i ) );
+        else
+          tree.insert( keys[i], int( i ) );
+      }
+      return seconds( start );
+    }
+
+    // the best of 5 scans
+    template<typename TREE>
+    static double full_scan( const std::vector<int> &keys )
+    {
+      TREE tree;
+      for( size_t i = 0; i < keys.size(); ++i )
+        insert_key( tree, keys[i], int( i ) );
+
+      double best = 0;
+      long sum = 0;
+      for( int round = 0; round < 5; ++round )
+      {
+        steady_clock::time_point start = steady_clock::now();
+        for( typename TREE::const_iterator itr = tree.cbegin(); itr != tree.cend(); ++itr )
+          sum += itr->value;
+        double sec = seconds( start );
+        if( !round || sec < best ) best = sec;
+      }
+      if( !sum ) std::cout << "  (empty)" << std::endl;
+      return best;
+    }
+
+    template<typename K, typename V, typename N, typename P, typename O>
+    static void insert_key( rbtree<K, V, N, P, O> &tree, int key, int value )
+    {
+      tree.insert( key, value );
+    }
+
+    template<typename I, typename V, typename P>
+    static void insert_key( interval_tree<I, V, P> &tree, int key, int value )
+    {
+      tree.insert( key, key + 1000, value );
+    }
+
+    template<typename TREE>
+    static double count_queries( TREE &tree, const std::vector<int> &lows )
+    {
+      size_t hits = 0;
+      steady_clock::time_point start = steady_clock::now();
+      for( size_t i = 0; i < lows.size(); ++i )
+        hits += tree.count_overlaps( lows[i], lows[i] + 10 );
+      double sec = seconds( start );
+      std::cout << "  (" << hits << " hits)" << std::endl;
+      return sec;
+    }
+
+    template<typename E, typename TREE>
+    static double visit_queries( TREE &tree, const std::vector<int> &lows, int width = 10 )
+    {
+      size_t hits = 0;
+      steady_clock::time_point start = steady_clock::now();
+      for( size_t i = 0; i < lows.size(); ++i )
+        tree.query( lows[i], lows[i] + width, [&hits]( const E& ) { ++hits; return true; } );
+      double sec = seconds( start );
+      std::cout << "  (" << hits << " hits)" << std::endl;
+      return sec;
+    }
+
+    // the baseline for concurrent_mixed
+    struct locked_interval_tree
+    {
+        void insert( int low, int high, int value )
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          tree.insert( low, high, value );
+        }
+
+        void erase( int low, int high )
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          tree.erase( low, high );
+        }
+
+        size_t count_overlaps( int low, int high )
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          return tree.count_overlaps( low, high );
+        }
+
+        std::mutex               mutex;
+        interval_tree<int, int>  tree;
+    };
+
+    // operations per second of the given number of threads
+    template<typename TREE>
+    double mixed_throughput( TREE &tree, unsigned threads, int range ) const
+    {
+      const size_t ops = 200000;
+      std::atomic<size_t> hits( 0 );
+      std::vector<std::thread> workers;
+      steady_clock::time_point start = steady_clock::now();
+      for( unsigned t = 0; t < threads; ++t )
+      {
+        workers.push_back( std::thread( [&, t]()
+        {
+          std::mt19937 gen( seed + 10 + t );
+          size_t found = 0;
+          for( size_t i = 0; i < ops; ++i )
+          {
+            int low = int( gen() % unsigned( range ) );
+            if( i % 10 == 0 )
+              tree.insert( low | 1, ( low | 1 ) + 100, int( i ) );
+            else if( i % 10 == 5 )
+              tree.erase( low | 1, ( low | 1 ) + 100 );
+            else
+              found += tree.count_overlaps( low, low + 1000 );
+          }
+          hits += found;
+        } ) );
+      }
+      for( unsigned t = 0; t < threads; ++t )
+        workers[t].join();
+      return double( ops ) * threads / seconds( start );
+    }
+
+    typedef std::chrono::steady_clock steady_clock;
+
+    static double seconds( steady_clock::time_point start )
+    {
+      return std::chrono::duration<double>( steady_clock::now() - start ).count();
+    }
+
+    static void report( const char *label, double sec )
+    {
+      std::cout << label << " : " << sec << " s" << std::endl;
+    }
+
+    void report_op( const char *label, double sec ) const
+    {
+      std::cout << label << " : " << sec * 1e9 / size << " ns/op" << std::endl;
+    }
+
+    std::vector<int> random_keys() const
+    {
+      std::mt19937 gen( seed );
+      std::vector<int> keys( size );
+      for( size_t i = 0; i < size; ++i )
+        keys[i] = int( gen() >> 1 );
+      return keys;
+    }
+
+    // inserts all the keys, erases every other one,
+    // inserts them back and finally clears the tree
+    template<typename TREE>
+    double insert_erase() const
+    {
+      std::vector<int> keys = random_keys();
+      steady_clock::time_point start = steady_clock::now();
+      TREE tree;
+      for( size_t i = 0; i < keys.size(); ++i )
+        tree.insert( keys[i], int( i ) );
+      for( size_t i = 0; i < keys.size(); i += 2 )
+        tree.erase( keys[i] );
+      for( size_t i = 0; i < keys.size(); i += 2 )
+        tree.insert( keys[i], int( i ) );
+      tree.clear();
+      return seconds( start );
+    }
+
+    template<typename TREE>
+    double interval_insert_erase() const
+    {
+      std::vector<int> keys = random_keys();
+      steady_clock::time_point start = steady_clock::now();
+      TREE tree;
+      for( size_t i = 0; i < keys.size(); ++i )
+        tree.insert( keys[i], keys[i] + 100, int( i ) );
+      for( size_t i = 0; i < keys.size(); i += 2 )
+        tree.erase( keys[i], keys[i] + 100 );
+      for( size_t i = 0; i < keys.size(); i += 2 )
+        tree.insert( keys[i], keys[i] + 100, int( i ) );
+      tree.clear();
+      return seconds( start );
+    }
+
+    // inserts all the keys and erases them in the same order
+    // (the time per key)
+    template<typename TREE>
+    static double insert_erase_all( const std::vector<int> &keys )
+    {
+      TREE tree;
+      steady_clock::time_point start = steady_clock::now();
+      for( size_t i = 0; i < keys.size(); ++i )
+        tree.insert( keys[i], int( i ) );
+      for( size_t i = 0; i < keys.size(); ++i )
+        tree.erase( keys[i] );
+      return seconds( start );
+    }
+
+    template<typename TREE>
+    static double interval_insert_erase_all( const std::vector<int> &keys )
+    {
+      TREE tree;
+      steady_clock::time_point start = steady_clock::now();
+      for( size_t i = 0; i < keys.size(); ++i )
+        tree.insert( keys[i], keys[i] + 100, int( i ) );
+      for( size_t i = 0; i < keys.size(); ++i )
+        tree.erase( keys[i], keys[i] + 100 );
+      return seconds( start );
+    }
+
+    // item( i, key ) makes an insert_batch element and
+    // erased( key ) an erase_batch element
+    template<typename TREE, typename F, typename E>
+    void batch_sizes( F item, E erased ) const
+    {
+      std::vector<int> keys = random_keys();
+      TREE tree;
+      for( size_t i = 0; i < keys.size(); ++i )
+        insert_one( tree, item( i, keys[i] & ~1 ) );
+
+      std::mt19937 gen( seed + 1 );
+      for( size_t n = 16; n <= ( 1 << 20 ); n *= 4 )
+      {
+        typedef decltype( item( 0, 0 ) ) item_t;
+        typedef decltype( erased( 0 ) ) erased_t;
+
+        // about the same number of keys for each batch size
+        size_t rounds = std::max<size_t>( 1, ( 1 << 18 ) / n );
+        double one_sec = 0, batch_sec = 0;
+        for( size_t r = 0; r < rounds; ++r )
+        {
+          // different keys for each, so that one doesn't
+          // warm up the cache for the other
+          std::vector<item_t> items[2];
+          std::vector<erased_t> erase_items[2];
+          for( size_t i = 0; i < 2 * n; ++i )
+          {
+            int k = int( gen() >> 1 ) | 1; // the tree has only even keys
+            items[i % 2].push_back( item( i, k ) );
+            erase_items[i % 2].push_back( erased( k ) );
+          }
+
+          steady_clock::time_point start = steady_clock::now();
+          for( size_t i = 0; i < n; ++i )
+            insert_one( tree, items[0][i] );
+          for( size_t i = 0; i < n; ++i )
+            erase_one( tree, erase_items[0][i] );
+          one_sec += seconds( start );
+
+          start = steady_clock::now();
+          tree.insert_batch( items[1].begin(), items[1].end() );
+          tree.erase_batch( erase_items[1].begin(), erase_items[1].end() );
+          batch_sec += seconds( start );
+        }
+
+        double ops = double( rounds * n );
+        std::cout << "  batch of " << n << " : one by one " << one_sec * 1e9 / ops << " ns/key, batch "
+                  << batch_sec * 1e9 / ops << " ns/key" << std::endl;
+      }
+    }
+
+    template<typename TREE, typename K, typename V>
+    static void insert_one( TREE &tree, const std::pair<K, V> &item ) { tree.insert( item.first, item.second ); }
+
+    template<typename TREE, typename I, typename V>
+    static void insert_one( TREE &tree, const std::tuple<I, I, V> &item ) { tree.insert( std::get<0>( item ), std::get<1>( item ), std::get<2>( item ) ); }
+
+    template<typename TREE>
+    static void erase_one( TREE &tree, int key ) { tree.erase( key ); }
+
+    template<typename TREE, typename I>
+    static void erase_one( TREE &tree, const std::pair<I, I> &item ) { tree.erase( item.first, item.second ); }
+
+    // inserts all the keys as short intervals and
+    // then runs one query per key
+    template<typename TREE>
+    double interval_insert_query() const
+    {
+      std::vector<int> keys = random_keys();
+      steady_clock::time_point start = steady_clock::now();
+      TREE tree;
+      for( size_t i = 0; i < keys.size(); ++i )
+        tree.insert( keys[i], keys[i] + 1000, int( i ) );
+      size_t hits = 0;
+      for( size_t i = 0; i < keys.size(); ++i )
+        hits += tree.query( keys[i] ^ 0x5555, ( keys[i] ^ 0x5555 ) + 10 ).size();
+      double sec = seconds( start );
+      std::cout << "  (" << hits << " hits)" << std::endl;
+      return sec;
+    }
+
+    size_t   size;
+    unsigned seed;
+};
+
+#endif /* RBTREE_BENCHMARK_HH_ */
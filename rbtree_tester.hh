@@ -11,6 +11,20 @@
 #include "rbtree.hh"
 #include <unistd.h>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <list>
+#include <ctime>
+#include <set>
+#include <vector>
+#include <stdexcept>
+#include <type_traits>
+#include <functional>
+#include <memory>
+#include <iterator>
+#include <algorithm>
+#include <atomic>
+#include <climits>
 
 class rbtree_tester
 {
@@ -18,12 +32,12 @@ class rbtree_tester
 
     void print()
     {
-      print( tree.tree_root );
+      print( tree, tree.tree_root );
     }
 
     bool test_invariant()
     {
-      return TestInvariant( tree.tree_root ).first;
+      return test_invariant( tree, tree.tree_root ).first;
     }
 
     bool test_iterator()
@@ -52,6 +66,638 @@ class rbtree_tester
       return true;
     }
 
+    bool test_node_reuse()
+    {
+      tree.clear();
+
+      tree.insert( 1, "1" );
+      tree.insert( 2, "2" );
+      tree.insert( 3, "3" );
+
+      // the erased node should go back to the pool
+      // and be handed out for the next insert
+      const node_t<int, std::string> *n = &*tree.find( 2 );
+      tree.erase( 2 );
+      tree.insert( 4, "4" );
+      if( &*tree.find( 4 ) != n )
+        return false;
+
+      tree.clear();
+      return tree.empty() && tree.size() == 0;
+    }
+
+    bool test_compact()
+    {
+      compact_rbtree<int, std::string> compact;
+      std::set<int> keys;
+
+      srand( time( NULL ) );
+
+      for( int i = 0; i < 5000; ++i )
+      {
+        int k = rand() % 1000 + 1;
+        std::stringstream ss;
+        ss << k;
+        if( rand() % 3 )
+        {
+          compact.insert( k, ss.str() );
+          keys.insert( k );
+        }
+        else
+        {
+          compact.erase( k );
+          keys.erase( k );
+        }
+      }
+
+      if( !test_invariant( compact, compact.tree_root ).first )
+        return false;
+
+      if( compact.size() != keys.size() )
+        return false;
+
+      std::set<int>::iterator k = keys.begin();
+      for( compact_rbtree<int, std::string>::iterator itr = compact.begin(); itr != compact.end(); ++itr, ++k )
+        if( itr->key != *k )
+          return false;
+
+      return true;
+    }
+
+    bool test_build_from_sorted()
+    {
+      typedef std::vector< std::pair<int, std::string> > input_t;
+
+      // all the shapes of the last level, including the empty tree
+      for( int n = 0; n < 70; ++n )
+      {
+        input_t sorted;
+        for( int i = 0; i < n; ++i )
+          sorted.push_back( std::make_pair( i * 2, "" ) );
+        tree.build_from_sorted( sorted.begin(), sorted.end() );
+        if( !test_sorted( sorted ) )
+          return false;
+      }
+
+      // the tree can be modified afterwards
+      tree.insert( 1, "1" );
+      tree.erase( 0 );
+      if( !test_invariant( tree, tree.tree_root ).first || !tree.find( 1 ) || tree.find( 0 ) )
+        return false;
+
+      // the subtrees are linked in parallel
+      input_t sorted;
+      for( int i = 0; i < 100000; ++i )
+        sorted.push_back( std::make_pair( i, "" ) );
+      tree.build_from_sorted( sorted.begin(), sorted.end(), 4 );
+      if( !test_sorted( sorted ) )
+        return false;
+
+      // duplicates are rejected
+      input_t duplicates;
+      duplicates.push_back( std::make_pair( 1, "" ) );
+      duplicates.push_back( std::make_pair( 1, "" ) );
+      try
+      {
+        tree.build_from_sorted( duplicates.begin(), duplicates.end() );
+        return false;
+      }
+      catch( const std::invalid_argument& ) { }
+
+      return tree.empty();
+    }
+
+    bool test_batch()
+    {
+      std::set<int> keys;
+
+      tree.clear();
+      srand( time( NULL ) );
+
+      // the small batches go one by one, the big ones are merged
+      const size_t sizes[] = { 1, 16, 300, 5000 };
+      for( int round = 0; round < 40; ++round )
+      {
+        size_t n = sizes[round % 4];
+
+        std::vector< std::pair<int, std::string> > inserted;
+        for( size_t i = 0; i < n; ++i )
+        {
+          int k = rand() % 20000;
+          inserted.push_back( std::make_pair( k, "" ) );
+          keys.insert( k );
+        }
+        tree.insert_batch( inserted.begin(), inserted.end() );
+
+        std::vector<int> erased;
+        for( size_t i = 0; i < n / 2; ++i )
+        {
+          int k = rand() % 20000;
+          erased.push_back( k );
+          keys.erase( k );
+        }
+        tree.erase_batch( erased.begin(), erased.end() );
+
+        if( !test_invariant( tree, tree.tree_root ).first || tree.size() != keys.size() )
+          return false;
+      }
+
+      std::set<int>::iterator k = keys.begin();
+      for( rbtree<int, std::string>::iterator itr = tree.begin(); itr != tree.end(); ++itr, ++k )
+        if( itr->key != *k )
+          return false;
+
+      return true;
+    }
+
+    bool test_hint()
+    {
+      typedef rbtree<int, std::string>::iterator iterator;
+      std::set<int> keys;
+      tree.clear();
+      srand( time( NULL ) );
+
+      // the right hints: increasing keys at the end, decreasing
+      // ones at the beginning, and in between neighbours
+      for( int k = 1000; k < 2000; k += 2 )
+        if( tree.insert( tree.end(), k, "" )->key != k ) return false;
+      for( int k = 998; k >= 0; k -= 2 )
+        if( tree.insert( tree.begin(), k, "" )->key != k ) return false;
+      for( int k = 1; k < 2000; k += 2 )
+        if( tree.insert( tree.lower_bound( k ), k, "" )->key != k ) return false;
+      for( int k = 0; k < 2000; ++k )
+        keys.insert( k );
+      if( !test_sorted_keys( tree, keys ) )
+        return false;
+
+      // wrong hints and keys that are there already
+      for( int i = 0; i < 5000; ++i )
+      {
+        int k = rand() % 10000 - 2000;
+        iterator hint = rand() % 10 ? tree.lower_bound( rand() % 10000 - 2000 ) : tree.end();
+        size_t size = tree.size();
+        iterator itr = tree.insert( hint, k, "" );
+        if( itr->key != k || tree.size() != size + ( keys.insert( k ).second ? 1 : 0 ) )
+          return false;
+      }
+      return test_sorted_keys( tree, keys );
+    }
+
+    bool test_finger()
+    {
+      threaded_rbtree<int, std::string> threaded;
+      std::set<int> keys;
+      tree.clear();
+      tree.use_finger();
+      threaded.use_finger();
+      srand( time( NULL ) );
+
+      int next = 0;
+      for( int round = 0; round < 200; ++round )
+      {
+        // an increasing run, then a few random keys and erases
+        for( int i = 0; i < 50; ++i, next += 1 + rand() % 3 )
+        {
+          tree.insert( next, "" );
+          threaded.insert( next, "" );
+          keys.insert( next );
+        }
+        for( int i = 0; i < 10; ++i )
+        {
+          int k = rand() % ( next + 10 );
+          tree.insert( k, "" );
+          threaded.insert( k, "" );
+          keys.insert( k );
+          k = rand() % ( next + 10 );
+          tree.erase( k );
+          threaded.erase( k );
+          keys.erase( k );
+        }
+        // the finger itself goes (and its slot is reused right
+        // away), past the random keys, and an increasing and a
+        // decreasing run fill gaps
+        tree.insert( next + 10, "" );
+        threaded.insert( next + 10, "" );
+        tree.erase( next + 10 );
+        threaded.erase( next + 10 );
+        tree.insert( next + 11, "" );
+        threaded.insert( next + 11, "" );
+        keys.insert( next + 11 );
+        next += 12;
+        int gap = rand() % next;
+        for( int k = gap; k < gap + 5; ++k )
+        {
+          tree.insert( k, "" );
+          threaded.insert( k, "" );
+          keys.insert( k );
+        }
+        gap = rand() % next;
+        for( int k = gap + 5; k > gap; --k )
+        {
+          tree.insert( k, "" );
+          threaded.insert( k, "" );
+          keys.insert( k );
+        }
+        if( round % 50 == 49 )
+        {
+          rbtree<int, std::string>::subtree above = tree.split( next / 2 );
+          tree.insert( next / 2 - 1, "" );
+          keys.insert( next / 2 - 1 );
+          tree.join( std::move( above ) );
+          threaded.insert( next / 2 - 1, "" );
+        }
+        if( !test_sorted_keys( tree, keys ) || !test_sorted_keys( threaded, keys ) || !test_threads( threaded ) )
+          return false;
+      }
+      tree.use_finger( false );
+      return true;
+    }
+
+    bool test_threaded()
+    {
+      typedef threaded_rbtree<int, std::string> threaded_t;
+      threaded_t threaded;
+      std::set<int> keys;
+      srand( time( NULL ) );
+
+      for( int round = 0; round < 20; ++round )
+      {
+        // one by one and in batches
+        for( int i = 0; i < 200; ++i )
+        {
+          int k = rand() % 5000;
+          threaded.insert( k, "" );
+          keys.insert( k );
+          k = rand() % 5000;
+          threaded.erase( k );
+          keys.erase( k );
+        }
+        std::vector< std::pair<int, std::string> > inserted;
+        std::vector<int> erased;
+        for( int i = 0; i < 3000; ++i )
+        {
+          inserted.push_back( std::make_pair( rand() % 5000, "" ) );
+          keys.insert( inserted.back().first );
+        }
+        threaded.insert_batch( inserted.begin(), inserted.end() );
+        for( int i = 0; i < 1000; ++i )
+        {
+          erased.push_back( rand() % 5000 );
+          keys.erase( erased.back() );
+        }
+        threaded.erase_batch( erased.begin(), erased.end() );
+        if( !test_threads( threaded ) )
+          return false;
+
+        // cut out and put back
+        int first = rand() % 5000, last = first + rand() % 500;
+        threaded_t::subtree window = threaded.extract_range( first, last );
+        size_t count = 0;
+        for( threaded_t::iterator itr = window.begin(); itr != window.end(); ++itr, ++count )
+          if( itr->key < first || itr->key >= last )
+            return false;
+        if( count != size_t( std::distance( keys.lower_bound( first ), keys.lower_bound( last ) ) ) || !test_threads( threaded ) )
+          return false;
+        threaded_t::subtree above = threaded.split( last );
+        if( round % 2 )
+          threaded.join( threaded.join( std::move( window ), std::move( above ) ) );
+        else
+        {
+          threaded.join( std::move( above ) );
+          threaded.join( std::move( window ) );
+        }
+        if( !test_threads( threaded ) )
+          return false;
+      }
+
+      threaded_t other;
+      std::vector< std::pair<int, std::string> > sorted;
+      for( int k = 0; k < 20000; k += 3 )
+        sorted.push_back( std::make_pair( k, "" ) );
+      other.build_from_sorted( sorted.begin(), sorted.end() );
+      threaded.union_with( other );
+      std::set<int> all( keys );
+      for( size_t i = 0; i < sorted.size(); ++i )
+        all.insert( sorted[i].first );
+      if( !test_threads( other ) || !test_threads( threaded ) || threaded.size() != all.size() )
+        return false;
+      threaded.difference_with( other );
+      if( !test_threads( threaded ) )
+        return false;
+
+      // and the iterators agree with the keys both ways
+      std::set<int>::iterator k = keys.begin();
+      for( threaded_t::iterator itr = threaded.begin(); itr != threaded.end(); ++itr )
+      {
+        while( k != keys.end() && *k % 3 == 0 ) ++k;
+        if( k == keys.end() || itr->key != *k++ )
+          return false;
+      }
+      std::set<int>::reverse_iterator r = keys.rbegin();
+      for( threaded_t::reverse_iterator itr = threaded.rbegin(); itr != threaded.rend(); ++itr )
+      {
+        while( r != keys.rend() && *r % 3 == 0 ) ++r;
+        if( r == keys.rend() || itr->key != *r++ )
+          return false;
+      }
+      return true;
+    }
+
+    bool test_bounds()
+    {
+      typedef rbtree<int, std::string>::iterator iterator;
+      typedef rbtree<int, std::string>::const_iterator const_iterator;
+      static_assert( std::is_same<std::iterator_traits<iterator>::iterator_category, std::bidirectional_iterator_tag>::value, "not bidirectional" );
+
+      std::set<int> keys;
+      tree.clear();
+      srand( time( NULL ) );
+      for( int i = 0; i < 1000; ++i )
+      {
+        int k = rand() % 5000;
+        tree.insert( k, "" );
+        keys.insert( k );
+      }
+
+      const rbtree<int, std::string> &ctree = tree;
+      for( int k = -1; k <= 5001; ++k )
+      {
+        iterator lower = tree.lower_bound( k );
+        const_iterator upper = ctree.upper_bound( k );
+        std::set<int>::iterator l = keys.lower_bound( k ), u = keys.upper_bound( k );
+        if( ( lower == tree.end() ) != ( l == keys.end() ) || ( lower != tree.end() && lower->key != *l ) )
+          return false;
+        if( ( upper == ctree.end() ) != ( u == keys.end() ) || ( upper != ctree.end() && upper->key != *u ) )
+          return false;
+        std::pair<iterator, iterator> range = tree.equal_range( k );
+        if( range.first != lower || range.second != upper || std::distance( range.first, range.second ) != long( keys.count( k ) ) )
+          return false;
+      }
+
+      // a window scanned from its lower bound, and backwards from its upper bound
+      std::vector<int> window;
+      for( iterator itr = tree.lower_bound( 1000 ); itr != tree.lower_bound( 1200 ); ++itr )
+        window.push_back( itr->key );
+      if( !std::equal( window.begin(), window.end(), keys.lower_bound( 1000 ) ) || window.size() != size_t( std::distance( keys.lower_bound( 1000 ), keys.lower_bound( 1200 ) ) ) )
+        return false;
+      iterator itr = tree.lower_bound( 1200 );
+      for( std::vector<int>::reverse_iterator w = window.rbegin(); w != window.rend(); ++w )
+        if( ( --itr )->key != *w )
+          return false;
+
+      // the whole tree backwards, the end steps back to the last key
+      if( std::prev( tree.end() )->key != *keys.rbegin() )
+        return false;
+      std::set<int>::reverse_iterator k = keys.rbegin();
+      for( rbtree<int, std::string>::const_reverse_iterator r = ctree.rbegin(); r != ctree.rend(); ++r, ++k )
+        if( r->key != *k )
+          return false;
+      return k == keys.rend() && std::is_sorted( tree.begin(), tree.end(), []( const node_t<int, std::string> &a, const node_t<int, std::string> &b ) { return a.key < b.key; } );
+    }
+
+    bool test_emplace()
+    {
+      // move-only values, constructed in place
+      rbtree<int, std::unique_ptr<int> > owned;
+      std::pair<rbtree<int, std::unique_ptr<int> >::iterator, bool> result = owned.try_emplace( 1, new int( 10 ) );
+      if( !result.second || *result.first->value != 10 )
+        return false;
+      std::unique_ptr<int> value( new int( 20 ) );
+      result = owned.insert( 1, std::move( value ) );
+      // the key is there, so the value is left alone
+      if( result.second || *result.first->value != 10 || !value )
+        return false;
+      result = owned.insert( 2, std::move( value ) );
+      if( !result.second || *result.first->value != 20 || value )
+        return false;
+      result = owned.emplace( 3, new int( 30 ) );
+      if( !result.second || owned.emplace( 3, new int( 31 ) ).second || *owned.find( 3 )->value != 30 )
+        return false;
+      result = owned.insert_or_assign( 3, std::unique_ptr<int>( new int( 32 ) ) );
+      if( result.second || *result.first->value != 32 || !owned.insert_or_assign( 4, std::unique_ptr<int>( new int( 40 ) ) ).second )
+        return false;
+      if( owned.size() != 4 || !test_invariant( owned, owned.tree_root ).first )
+        return false;
+
+      // nothing is copied on the way into the node
+      rbtree<std::string, std::vector<int> > buffers;
+      std::vector<int> buffer( 1000, 7 );
+      const int *data = buffer.data();
+      std::string key( 100, 'k' );
+      const char *chars = key.data();
+      std::pair<rbtree<std::string, std::vector<int> >::iterator, bool> inserted = buffers.insert( std::move( key ), std::move( buffer ) );
+      return inserted.second && inserted.first->value.data() == data && inserted.first->key.data() == chars &&
+             buffers.try_emplace( std::string( 100, 'k' ), 5, 1 ).first->value.size() == 1000;
+    }
+
+    bool test_comparator()
+    {
+      typedef rbtree<int, std::string, node_t<int, std::string>, node_pool< node_t<int, std::string> >, std::greater<int> > reversed_t;
+      std::set< int, std::greater<int> > keys;
+      reversed_t reversed;
+      srand( time( NULL ) );
+
+      for( int i = 0; i < 2000; ++i )
+      {
+        int k = rand() % 1000;
+        reversed.insert( k, "" );
+        keys.insert( k );
+      }
+      std::vector<int> erased;
+      for( int i = 0; i < 500; ++i )
+      {
+        erased.push_back( rand() % 1000 );
+        keys.erase( erased.back() );
+      }
+      reversed.erase_batch( erased.begin(), erased.end() );
+      if( !test_invariant( reversed, reversed.tree_root ).first || reversed.size() != keys.size() )
+        return false;
+
+      // the keys come in descending order, and so does the split
+      reversed_t::subtree below = reversed.split( 500 );
+      for( reversed_t::iterator itr = reversed.begin(); itr != reversed.end(); ++itr )
+        if( itr->key <= 500 )
+          return false;
+      reversed.join( std::move( below ) );
+
+      std::set< int, std::greater<int> >::iterator k = keys.begin();
+      for( reversed_t::iterator itr = reversed.begin(); itr != reversed.end(); ++itr, ++k )
+        if( itr->key != *k )
+          return false;
+      return k == keys.end();
+    }
+
+    bool test_split_join()
+    {
+      typedef rbtree<int, std::string>::subtree subtree_t;
+
+      srand( time( NULL ) );
+
+      for( int round = 0; round < 200; ++round )
+      {
+        std::set<int> keys;
+        tree.clear();
+        int n = rand() % 500;
+        for( int i = 0; i < n; ++i )
+        {
+          int k = rand() % 1000;
+          tree.insert( k, "" );
+          keys.insert( k );
+        }
+
+        // cut out a window of keys
+        int first = rand() % 1100 - 50;
+        int last = first + rand() % 300;
+        subtree_t window = tree.extract_range( first, last );
+        std::set<int> extracted( keys.lower_bound( first ), keys.lower_bound( last ) );
+        keys.erase( keys.lower_bound( first ), keys.lower_bound( last ) );
+        if( !test_detached( tree.tree_root, keys ) || !test_detached( window.root, extracted ) )
+          return false;
+        if( tree.size() != keys.size() || window.size() != extracted.size() )
+          return false;
+
+        std::set<int>::iterator k = extracted.begin();
+        for( rbtree<int, std::string>::iterator itr = window.begin(); itr != window.end(); ++itr, ++k )
+          if( itr->key != *k )
+            return false;
+
+        // split and put it back together again
+        int key = rand() % 1000;
+        subtree_t upper = tree.split( key );
+        if( !test_detached( tree.tree_root, std::set<int>( keys.begin(), keys.lower_bound( key ) ) ) ||
+            !test_detached( upper.root, std::set<int>( keys.lower_bound( key ), keys.end() ) ) )
+          return false;
+        tree.join( std::move( upper ) );
+        if( !upper.empty() || !test_detached( tree.tree_root, keys ) )
+          return false;
+
+        // the window fits back only if nothing was inserted in between
+        if( round % 2 )
+        {
+          tree.insert( first, "" );
+          keys.insert( first );
+        }
+        try
+        {
+          tree.join( std::move( window ) );
+          keys.insert( extracted.begin(), extracted.end() );
+        }
+        catch( const std::invalid_argument& )
+        {
+          if( extracted.empty() || !( round % 2 ) )
+            return false;
+        }
+        if( !test_detached( tree.tree_root, keys ) || tree.size() != keys.size() )
+          return false;
+
+        // two pieces join into one and the tree is still usable
+        subtree_t low = tree.extract_range( 0, 300 ), high = tree.extract_range( 600, 1000 );
+        subtree_t both = tree.join( std::move( low ), std::move( high ) );
+        std::set<int> outer( keys.lower_bound( 0 ), keys.lower_bound( 300 ) );
+        outer.insert( keys.lower_bound( 600 ), keys.lower_bound( 1000 ) );
+        if( !low.empty() || !high.empty() || !test_detached( both.root, outer ) || both.size() != outer.size() )
+          return false;
+        both.release();
+        tree.insert( 2000, "" );
+        tree.erase( 2000 );
+        if( outer.size() + tree.size() != keys.size() || !test_invariant( tree, tree.tree_root ).first )
+          return false;
+      }
+
+      // the tree can be cleared while a subtree is still out
+      subtree_t out = tree.split( 500 );
+      tree.clear();
+      out.release();
+      tree.insert( 1, "1" );
+      return tree.size() == 1;
+    }
+
+    bool test_set_operations()
+    {
+      srand( time( NULL ) );
+
+      for( int round = 0; round < 30; ++round )
+      {
+        std::set<int> a, b, expected;
+        rbtree<int, std::string> other;
+        // the index links go through the chunk table of the pool,
+        // which mustn't move while the threads copy nodes
+        compact_rbtree<int, std::string> compact, compact_other;
+        tree.clear();
+        // one union big enough (a black height of 12) to be split
+        // between the threads, the rest is merged sequentially
+        int n = round == 3 ? 1 << 20 : round % 3 ? 2000 : 40000;
+        for( int i = 0; i < n; ++i )
+        {
+          int k = rand() % ( 3 * n );
+          tree.insert( k, "a" );
+          compact.insert( k, "a" );
+          a.insert( k );
+          k = rand() % ( 3 * n );
+          other.insert( k, "b" );
+          compact_other.insert( k, "b" );
+          b.insert( k );
+        }
+
+        unsigned threads = round % 2 ? 4 : 1;
+        switch( round % 3 )
+        {
+          case 0:
+            tree.union_with( other, threads );
+            compact.union_with( compact_other, threads );
+            expected = a;
+            expected.insert( b.begin(), b.end() );
+            break;
+          case 1:
+            tree.intersection_with( other, threads );
+            compact.intersection_with( compact_other, threads );
+            for( std::set<int>::iterator itr = a.begin(); itr != a.end(); ++itr )
+              if( b.count( *itr ) ) expected.insert( *itr );
+            break;
+          default:
+            tree.difference_with( other, threads );
+            compact.difference_with( compact_other, threads );
+            for( std::set<int>::iterator itr = a.begin(); itr != a.end(); ++itr )
+              if( !b.count( *itr ) ) expected.insert( *itr );
+        }
+
+        if( !test_detached( tree.tree_root, expected ) || tree.size() != expected.size() || other.size() != b.size() )
+          return false;
+        if( !test_sorted_keys( compact, expected ) )
+          return false;
+
+        // the values of this tree win
+        for( rbtree<int, std::string>::iterator itr = tree.begin(); itr != tree.end(); ++itr )
+          if( itr->value != ( a.count( itr->key ) ? "a" : "b" ) )
+            return false;
+      }
+
+      return true;
+    }
+
+    // a value that can't be copied fails half way through a union,
+    // the tree is left empty and no value is leaked
+    bool test_set_operation_failure()
+    {
+      for( int round = 0; round < 4; ++round )
+      {
+        unsigned threads = round % 2 ? 4 : 1;
+        if( round < 2 ? !test_failed_union< rbtree<int, counted> >( threads, round ) : !test_failed_union< compact_rbtree<int, counted> >( threads, round ) )
+          return false;
+        if( counted::live() != 0 )
+          return false;
+      }
+      return true;
+    }
+
+    // rotations and summary updates are resolved at
+    // compile time, so there is no vtable
+    bool test_no_vtable()
+    {
+      return !std::is_polymorphic< rbtree<int, std::string> >::value &&
+             !std::is_polymorphic< compact_rbtree<int, std::string> >::value;
+    }
+
     void clear()
     {
       tree.clear();
@@ -78,34 +724,163 @@ class rbtree_tester
 
   private:
 
-    void print( const std::unique_ptr< node_t<int, std::string> > &root, const std::string &indent = "" )
+    // counts its instances, and throws on copy once
+    // copies_left() copies have been made
+    struct counted
+    {
+        counted() { ++live(); }
+
+        counted( const counted& )
+        {
+          if( copies_left()-- <= 0 ) throw std::bad_alloc();
+          ++live();
+        }
+
+        ~counted() { --live(); }
+
+        counted& operator=( const counted& ) = default;
+
+        static std::atomic<long>& live()
+        {
+          static std::atomic<long> count( 0 );
+          return count;
+        }
+
+        static std::atomic<long>& copies_left()
+        {
+          static std::atomic<long> count( LONG_MAX );
+          return count;
+        }
+    };
+
+    template<typename TREE>
+    static bool test_failed_union( unsigned threads, int seed )
+    {
+      srand( seed );
+      {
+        TREE t, other;
+        // big enough to be split between the threads
+        int n = threads > 1 ? 1 << 20 : 40000;
+        for( int i = 0; i < n; ++i )
+        {
+          t.insert( rand() % ( 3 * n ), counted() );
+          other.insert( rand() % ( 3 * n ), counted() );
+        }
+        size_t others = other.size();
+
+        counted::copies_left() = 5000;
+        try
+        {
+          t.union_with( other, threads );
+          return false;
+        }
+        catch( const std::bad_alloc& ) { }
+        counted::copies_left() = LONG_MAX;
+
+        if( !t.empty() || t.begin() != t.end() || other.size() != others || counted::live() != long( others ) )
+          return false;
+        // and still usable
+        t.insert( 1, counted() );
+        if( t.size() != 1 )
+          return false;
+      }
+      return true;
+    }
+
+    // the detached tree holds exactly the keys and is a valid red-black tree
+    bool test_detached( node_t<int, std::string> *root, const std::set<int> &keys )
+    {
+      if( ( root && tree.parent_of( root ) ) || tree.colour_of( root ) != BLACK || !test_invariant( tree, root ).first )
+        return false;
+      if( tree.count_nodes( root ) != keys.size() )
+        return false;
+      if( !root )
+        return true;
+
+      std::set<int>::const_iterator k = keys.begin();
+      for( node_t<int, std::string> *node = tree.find_min( root ), *last = tree.find_max( root ); ; node = tree.next_node( node ), ++k )
+      {
+        if( node->key != *k )
+          return false;
+        if( node == last )
+          break;
+      }
+      return true;
+    }
+
+    // the tree holds exactly the sorted keys and is a valid red-black tree
+    bool test_sorted( const std::vector< std::pair<int, std::string> > &sorted )
+    {
+      if( tree.size() != sorted.size() || tree.colour_of( tree.tree_root ) != BLACK || !test_invariant( tree, tree.tree_root ).first )
+        return false;
+
+      size_t i = 0;
+      for( rbtree<int, std::string>::iterator itr = tree.begin(); itr != tree.end(); ++itr, ++i )
+        if( itr->key != sorted[i].first )
+          return false;
+
+      return i == sorted.size();
+    }
+
+    // a valid red-black tree holding exactly the keys
+    template<typename TREE>
+    static bool test_sorted_keys( TREE &t, const std::set<int> &keys )
+    {
+      if( t.size() != keys.size() || !test_invariant( t, t.tree_root ).first )
+        return false;
+      std::set<int>::const_iterator k = keys.begin();
+      for( typename TREE::iterator itr = t.begin(); itr != t.end(); ++itr, ++k )
+        if( itr->key != *k )
+          return false;
+      return true;
+    }
+
+    // the threaded links agree with the order of the tree
+    template<typename TREE>
+    static bool test_threads( const TREE &t )
+    {
+      auto *prev = t.find_min( t.tree_root );
+      if( prev && t.pool.prev( prev ) )
+        return false;
+      for( ; prev; prev = t.next_node( prev ) )
+      {
+        auto *next = t.next_node( prev );
+        if( t.pool.next( prev ) != next || ( next && t.pool.prev( next ) != prev ) )
+          return false;
+      }
+      return test_invariant( t, t.tree_root ).first;
+    }
+
+    template<typename TREE, typename N>
+    void print( const TREE &t, const N *root, const std::string &indent = "" )
     {
       if( !root ) return;
 
-      print( root->right, indent + "  " );
-      std::string colour = root->colour ? "(R)" : "(B)";
+      print( t, t.right_of( root ), indent + "  " );
+      std::string colour = t.colour_of( root ) ? "(R)" : "(B)";
       std::cout << indent << root->key << colour << std::endl;
-      print( root->left, indent + "  " );
+      print( t, t.left_of( root ), indent + "  " );
     }
 
-    static std::pair<bool, int> test_invariant( const std::unique_ptr< node_t<int, std::string> > &root )
+    template<typename TREE, typename N>
+    static std::pair<bool, int> test_invariant( const TREE &t, const N *root )
     {
       // base case
       if( !root )
         return std::make_pair( true, 0 );
 
       int black = 0;
-      if( root->colour == RED )
+      if( t.colour_of( root ) == RED )
       {
         // RED node cannot have RED children
-        if( ( root->left && root->left->colour == RED ) || ( root->right && root->right->colour == RED ) )
+        if( t.colour_of( t.left_of( root ) ) == RED || t.colour_of( t.right_of( root ) ) == RED )
           return std::make_pair( false, -1 );
       }
       else
         black += 1;
 
-      std::pair<bool, int> l = test_invariant( root->left );
-      std::pair<bool, int> r = test_invariant( root->right );
+      std::pair<bool, int> l = test_invariant( t, t.left_of( root ) );
+      std::pair<bool, int> r = test_invariant( t, t.right_of( root ) );
 
       if( !l.first || !r.first )
         return std::make_pair( false, -1 );
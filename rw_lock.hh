@@ -0,0 +1,102 @@
+/*
+ * rw_lock.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef RW_LOCK_HH_
+#define RW_LOCK_HH_
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+// reader-writer spin lock for short critical sections:
+//
+// - the readers only bump a counter, so they don't contend on
+//   a mutex with each other
+// - a writer first sets the writer bit (after which no new reader
+//   gets in) and then waits for the readers that are already in,
+//   so the writers don't starve
+// - waiting threads yield
+//
+// lock / unlock work with std::lock_guard and std::unique_lock,
+// lock_shared / unlock_shared with read_guard
+class rw_lock
+{
+  public:
+
+    rw_lock() : state( 0 ) { }
+
+    rw_lock( const rw_lock& ) = delete;
+
+    rw_lock& operator=( const rw_lock& ) = delete;
+
+    void lock()
+    {
+      uint32_t s = state.load( std::memory_order_relaxed );
+      while( ( s & writer ) || !state.compare_exchange_weak( s, s | writer, std::memory_order_acquire, std::memory_order_relaxed ) )
+      {
+        std::this_thread::yield();
+        s = state.load( std::memory_order_relaxed );
+      }
+
+      // wait for the readers to leave
+      while( state.load( std::memory_order_acquire ) != writer )
+        std::this_thread::yield();
+    }
+
+    void unlock()
+    {
+      state.fetch_and( ~writer, std::memory_order_release );
+    }
+
+    void lock_shared()
+    {
+      uint32_t s = state.load( std::memory_order_relaxed );
+      while( ( s & writer ) || !state.compare_exchange_weak( s, s + 1, std::memory_order_acquire, std::memory_order_relaxed ) )
+      {
+        if( s & writer ) std::this_thread::yield();
+        s = state.load( std::memory_order_relaxed );
+      }
+    }
+
+    void unlock_shared()
+    {
+      state.fetch_sub( 1, std::memory_order_release );
+    }
+
+  private:
+
+    static const uint32_t writer = uint32_t( 1 ) << 31;
+
+    // the writer bit and the number of readers
+    std::atomic<uint32_t> state;
+};
+
+// std::lock_guard for the shared side
+class read_guard
+{
+  public:
+
+    explicit read_guard( rw_lock &lock ) : lock( lock )
+    {
+      lock.lock_shared();
+    }
+
+    read_guard( const read_guard& ) = delete;
+
+    read_guard& operator=( const read_guard& ) = delete;
+
+    ~read_guard()
+    {
+      lock.unlock_shared();
+    }
+
+  private:
+
+    rw_lock &lock;
+};
+
+#endif /* RW_LOCK_HH_ */
@@ -0,0 +1,300 @@
+/*
+ * task_pool.hh
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: simonm
+ */
+
+#ifndef TASK_POOL_HH_
+#define TASK_POOL_HH_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+// small work-stealing thread pool for fork-join parallelism:
+//
+//   pool.run( [&]() { ... pool.invoke( f, g ); ... } );
+//
+// - every thread (the one calling run included) has its own deque
+// - invoke pushes g to the back of the deque of the calling thread
+//   and runs f, if g hasn't been stolen in the meantime it is popped
+//   and run by the same thread (so nothing is shared unless somebody
+//   is idle)
+// - idle threads steal from the front of the other deques, that is
+//   the oldest and so the biggest pieces of work
+// - a thread waiting for a stolen task helps with other tasks
+//
+// invoke outside of run (or on a pool of one thread) simply
+// calls f and then g
+class task_pool
+{
+  public:
+
+    // threads in total, the one calling run included
+    explicit task_pool( unsigned threads = std::thread::hardware_concurrency() ) : active( false ), stopping( false )
+    {
+      if( !threads ) threads = 1;
+      for( unsigned i = 0; i < threads; ++i )
+        queues.emplace_back( new queue_t() );
+
+      for( unsigned i = 1; i < threads; ++i )
+      {
+        try
+        {
+          workers.push_back( std::thread( [this, i]() { work( i ); } ) );
+        }
+        catch( const std::system_error& )
+        {
+          // no more threads, the rest is left to the ones we've got
+          break;
+        }
+      }
+    }
+
+    task_pool( const task_pool& ) = delete;
+
+    task_pool& operator=( const task_pool& ) = delete;
+
+    ~task_pool()
+    {
+      {
+        std::lock_guard<std::mutex> lock( sleep_mutex );
+        stopping = true;
+      }
+      wake_up.notify_all();
+      for( std::thread &worker : workers )
+        worker.join();
+    }
+
+    // the number of threads that actually work on a run
+    unsigned size() const
+    {
+      return unsigned( workers.size() ) + 1;
+    }
+
+    // runs f in the calling thread, with the rest of the pool
+    // stealing whatever f and its subtasks invoke
+    template<typename F>
+    void run( F f )
+    {
+      // already inside a run of this pool
+      if( current().pool == this )
+      {
+        f();
+        return;
+      }
+
+      std::lock_guard<std::mutex> guard( run_mutex );
+      context saved = current();
+      current() = context{ this, 0 };
+      set_active( true );
+      try
+      {
+        f();
+      }
+      catch( ... )
+      {
+        set_active( false );
+        current() = saved;
+        throw;
+      }
+      set_active( false );
+      current() = saved;
+    }
+
+    // runs f and g, possibly in parallel, and returns once both are
+    // done; if any of them throws the exception is rethrown (once
+    // both are done)
+    template<typename F, typename G>
+    void invoke( F f, G g )
+    {
+      context &ctx = current();
+      if( ctx.pool != this || workers.empty() )
+      {
+        f();
+        g();
+        return;
+      }
+
+      task_t task( &call<G>, &g );
+      size_t index = ctx.index;
+      push( index, &task );
+
+      std::exception_ptr error;
+      try
+      {
+        f();
+      }
+      catch( ... )
+      {
+        error = std::current_exception();
+      }
+
+      if( pop( index, &task ) )
+        task.execute();
+      else
+      {
+        // stolen, help out until it's done
+        while( !task.done.load( std::memory_order_acquire ) )
+        {
+          task_t *other = find_task( index );
+          if( other )
+            other->execute();
+          else
+            std::this_thread::yield();
+        }
+      }
+
+      if( error ) std::rethrow_exception( error );
+      if( task.error ) std::rethrow_exception( task.error );
+    }
+
+  private:
+
+    struct task_t
+    {
+        task_t( void ( *function )( void* ), void *argument ) : function( function ), argument( argument ), done( false ) { }
+
+        void execute()
+        {
+          try
+          {
+            function( argument );
+          }
+          catch( ... )
+          {
+            error = std::current_exception();
+          }
+          done.store( true, std::memory_order_release );
+        }
+
+        void               ( *function )( void* );
+        void               *argument;
+        std::exception_ptr  error;
+        std::atomic<bool>   done;
+    };
+
+    template<typename G>
+    static void call( void *g )
+    {
+      ( *static_cast<G*>( g ) )();
+    }
+
+    struct queue_t
+    {
+        std::mutex           mutex;
+        std::deque<task_t*>  tasks;
+    };
+
+    // the pool and the deque of the calling thread
+    struct context
+    {
+        task_pool *pool;
+        size_t     index;
+    };
+
+    static context& current()
+    {
+      static thread_local context ctx = { nullptr, 0 };
+      return ctx;
+    }
+
+    void push( size_t index, task_t *task )
+    {
+      std::lock_guard<std::mutex> lock( queues[index]->mutex );
+      queues[index]->tasks.push_back( task );
+    }
+
+    // pops the task if it is still at the back of the deque
+    bool pop( size_t index, task_t *task )
+    {
+      std::lock_guard<std::mutex> lock( queues[index]->mutex );
+      std::deque<task_t*> &tasks = queues[index]->tasks;
+      if( tasks.empty() || tasks.back() != task )
+        return false;
+      tasks.pop_back();
+      return true;
+    }
+
+    // the newest task of our own deque or the oldest one of somebody else
+    task_t* find_task( size_t index )
+    {
+      {
+        std::lock_guard<std::mutex> lock( queues[index]->mutex );
+        std::deque<task_t*> &tasks = queues[index]->tasks;
+        if( !tasks.empty() )
+        {
+          task_t *task = tasks.back();
+          tasks.pop_back();
+          return task;
+        }
+      }
+
+      for( size_t i = 1; i < queues.size(); ++i )
+      {
+        queue_t &victim = *queues[( index + i ) % queues.size()];
+        std::lock_guard<std::mutex> lock( victim.mutex );
+        if( !victim.tasks.empty() )
+        {
+          task_t *task = victim.tasks.front();
+          victim.tasks.pop_front();
+          return task;
+        }
+      }
+
+      return nullptr;
+    }
+
+    void set_active( bool value )
+    {
+      {
+        std::lock_guard<std::mutex> lock( sleep_mutex );
+        active = value;
+      }
+      if( value ) wake_up.notify_all();
+    }
+
+    // the workers spin (yielding) while there is a run
+    // going on and sleep otherwise
+    void work( size_t index )
+    {
+      current() = context{ this, index };
+      while( true )
+      {
+        task_t *task = find_task( index );
+        if( task )
+        {
+          task->execute();
+          continue;
+        }
+
+        std::unique_lock<std::mutex> lock( sleep_mutex );
+        if( stopping ) return;
+        if( !active )
+        {
+          wake_up.wait( lock, [this]() { return active || stopping; } );
+          continue;
+        }
+        lock.unlock();
+        std::this_thread::yield();
+      }
+    }
+
+    std::vector< std::unique_ptr<queue_t> >  queues;
+    std::vector<std::thread>                 workers;
+
+    std::mutex               run_mutex;
+    std::mutex               sleep_mutex;
+    std::condition_variable  wake_up;
+    bool                     active;
+    bool                     stopping;
+};
+
+#endif /* TASK_POOL_HH_ */